@@ -13,4 +13,7 @@ install:
 modules:
 	\$(MAKE) -f $TCH_MAKEFILE modules
 
+bench:
+	\$(MAKE) -f $TCH_MAKEFILE bench
+
 END
@@ -127,3 +127,25 @@ $tch_obj:	\$(CORE_DEPS)$tch_cont$tch_src
 END
 
 done
+
+# the benchmarks: tch_bench_clients builds the fmq server source in with
+# it, to call the server's own static functions; tch_bench_stress runs a
+# server and its clients as they are
+
+tch_bench=$TCH_OBJS${tch_dirsep}tch_bench_clients$tch_binext
+tch_stress=$TCH_OBJS${tch_dirsep}tch_bench_stress$tch_binext
+tch_fmq_dir=$TCH_OBJS${tch_dirsep}src${tch_dirsep}fmq${tch_dirsep}
+tch_fmqmsg=${tch_fmq_dir}tch_fmqmsg.$tch_objext
+tch_fmq_objs="$tch_fmqmsg$tch_cont ${tch_fmq_dir}tch_client.$tch_objext$tch_cont ${tch_fmq_dir}tch_server.$tch_objext"
+
+cat << END                                                    >> $TCH_MAKEFILE
+
+bench:	$tch_bench$tch_cont $tch_stress
+
+$tch_bench:	\$(CORE_DEPS)$tch_cont src/bench/tch_bench_clients.c$tch_cont src/fmq/tch_server.c$tch_cont $tch_fmqmsg
+	\$(LINK) \$(CFLAGS) \$(CORE_INCS) $tch_binout$tch_bench$tch_tab src/bench/tch_bench_clients.c $tch_fmqmsg$TCH_LIB
+
+$tch_stress:	\$(CORE_DEPS)$tch_cont src/bench/tch_bench_stress.c$tch_cont $tch_fmq_objs
+	\$(LINK) \$(CFLAGS) \$(CORE_INCS) $tch_binout$tch_stress$tch_tab src/bench/tch_bench_stress.c$tch_cont $tch_fmq_objs$TCH_LIB
+
+END
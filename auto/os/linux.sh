@@ -2,4 +2,91 @@
 
 CORE_INCS="$UNIX_INCS"
 CORE_DEPS="$UNIX_DEPS $LINUX_DEPS"
-CORE_SRCS="$UNIX_SRCS $LINUX_SRCS"
\ No newline at end of file
+CORE_SRCS="$UNIX_SRCS $LINUX_SRCS"
+
+# inotify
+
+tch_feature="inotify"
+tch_feature_name="TCH_HAVE_INOTIFY"
+tch_feature_run=yes
+tch_feature_incs="#include <unistd.h>
+#include <sys/inotify.h>"
+tch_feature_path=
+tch_feature_libs=
+tch_feature_test="int  fd;
+                  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                  if (fd == -1) return 1;
+                  (void) close(fd)"
+. auto/feature.sh
+
+# posix_fallocate()
+
+tch_feature="posix_fallocate()"
+tch_feature_name="TCH_HAVE_POSIX_FALLOCATE"
+tch_feature_run=no
+tch_feature_incs="#include <fcntl.h>"
+tch_feature_path=
+tch_feature_libs=
+tch_feature_test="(void) posix_fallocate(0, 0, 4096)"
+. auto/feature.sh
+
+# FICLONE, to copy files by sharing their blocks
+
+tch_feature="FICLONE"
+tch_feature_name="TCH_HAVE_FICLONE"
+tch_feature_run=no
+tch_feature_incs="#include <sys/ioctl.h>
+#include <linux/fs.h>"
+tch_feature_path=
+tch_feature_libs=
+tch_feature_test="(void) ioctl(1, FICLONE, 0)"
+. auto/feature.sh
+
+# io_uring, for the fmq client's disk writer
+
+tch_feature="io_uring"
+tch_feature_name="TCH_HAVE_IO_URING"
+tch_feature_run=yes
+tch_feature_incs="#include <liburing.h>"
+tch_feature_path=
+tch_feature_libs="-luring"
+tch_feature_test="struct io_uring ring;
+                  if (io_uring_queue_init(8, &ring, 0) != 0) return 1;
+                  io_uring_queue_exit(&ring)"
+. auto/feature.sh
+
+if [ $tch_found = yes ]; then
+    TCH_LIB="$TCH_LIB -luring"
+fi
+
+# zstd and lz4, for fmq chunk compression
+
+tch_feature="zstd library"
+tch_feature_name="TCH_HAVE_ZSTD"
+tch_feature_run=yes
+tch_feature_incs="#include <zstd.h>"
+tch_feature_path=
+tch_feature_libs="-lzstd"
+tch_feature_test="char  out[64];
+                  size_t  n = ZSTD_compress(out, sizeof(out), \"taichi\", 6, 1);
+                  if (ZSTD_isError(n)) return 1"
+. auto/feature.sh
+
+if [ $tch_found = yes ]; then
+    TCH_LIB="$TCH_LIB -lzstd"
+fi
+
+tch_feature="lz4 library"
+tch_feature_name="TCH_HAVE_LZ4"
+tch_feature_run=yes
+tch_feature_incs="#include <lz4.h>"
+tch_feature_path=
+tch_feature_libs="-llz4"
+tch_feature_test="char  out[64];
+                  if (LZ4_compress_default(\"taichi\", out, 6, sizeof(out)) <= 0)
+                      return 1"
+. auto/feature.sh
+
+if [ $tch_found = yes ]; then
+    TCH_LIB="$TCH_LIB -llz4"
+fi
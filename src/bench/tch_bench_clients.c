@@ -0,0 +1,163 @@
+/*
+ * Project:
+ *  ___________      .___________ .__    .__
+ * \__    ___/____  |__\_   ___ \|  |__ |__|
+ *   |    |  \__  \ |  /    \  \/|  |  \|  |
+ *   |    |   / __ \|  \     \___|   Y  \  |
+ *   |____|  (____  /__|\______  /___|  /__|
+ *                \/           \/     \/
+ *
+ * Copyright (C) 2021 - 2022, Yan RuiBing, <772166784@qq.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ */
+
+/*
+ * Benchmark of how the fmq server finds the client a message came from.
+ * Hundreds of DEALERs send NOM and HUGZ to one ROUTER, and we look up
+ * the sender of each message two ways: as the server used to, with the
+ * routing id hex-encoded into a zhash key, and as it does now, through
+ * its table keyed on the binary routing id. We print messages per second
+ * for each.
+ *
+ *   tch_bench_clients [clients [messages]]
+ *
+ * We build the server source in with us, so we call its own table.
+ */
+#include "tch_server.c"
+
+#define BENCH_CLIENTS       500
+#define BENCH_MESSAGES      1000000
+
+typedef enum {
+    BENCH_HEX,                      //  zframe_strhex and zhash
+    BENCH_TABLE                     //  s_clients_lookup
+} tch_bench_lookup_t;
+
+static const char *s_bench_names [] = { "strhex + zhash", "s_clients_lookup" };
+
+/* Have each dealer send one message, NOM and HUGZ in turn */
+static void
+s_bench_send(zsock_t **dealers, size_t clients, fmq_msg_t *nom, fmq_msg_t *hugz, size_t round)
+{
+    size_t index;
+    for (index = 0; index < clients; index++)
+        fmq_msg_send((index + round) % 2? nom: hugz, dealers [index]);
+}
+
+/* Receive 'messages' messages and look up the sender of each, adding
+ * senders we haven't seen, as the server does. Returns messages per
+ * second. */
+static uint64_t
+s_bench_run(tch_bench_lookup_t lookup, zsock_t *router, zsock_t **dealers,
+            size_t clients, size_t messages)
+{
+    fmq_msg_t *message = fmq_msg_new();
+    fmq_msg_t *nom = fmq_msg_new();
+    fmq_msg_t *hugz = fmq_msg_new();
+    fmq_msg_set_id(nom, FMQ_MSG_NOM);
+    fmq_msg_set_credit(nom, CHUNK_SIZE);
+    fmq_msg_set_id(hugz, FMQ_MSG_HUGZ);
+
+    zhash_t *hashed = zhash_new();
+    tch_svclients_t *table = s_clients_new(64);
+    size_t found = 0;
+
+    int64_t started = zclock_usecs();
+    size_t done = 0, round = 0;
+    while (done < messages) {
+        //  One message per dealer at a time stays well under the HWM
+        s_bench_send(dealers, clients, nom, hugz, round++);
+        size_t index;
+        for (index = 0; index < clients; index++, done++) {
+            if (fmq_msg_recv(message, router))
+                break;
+            zframe_t *routing_id = fmq_msg_routing_id(message);
+            if (lookup == BENCH_HEX) {
+                char *key = zframe_strhex(routing_id);
+                if (zhash_lookup(hashed, key))
+                    found++;
+                else
+                    zhash_insert(hashed, key, router);
+                zstr_free(&key);
+            }
+            else {
+                uint32_t hash = s_routing_id_hash(routing_id);
+                if (s_clients_lookup(table, routing_id, hash))
+                    found++;
+                else {
+                    tch_sv_client_t *client =
+                        (tch_sv_client_t *) zmalloc(sizeof(tch_sv_client_t));
+                    client->routing_id = zframe_dup(routing_id);
+                    client->hash = hash;
+                    s_clients_insert(table, client);
+                }
+            }
+        }
+    }
+    int64_t elapsed = zclock_usecs() - started;
+    assert(found + clients == done);
+
+    //  Our clients are bare, so we free them rather than destroy them
+    size_t index;
+    for (index = 0; index < table->size; index++) {
+        tch_sv_client_t *client = table->slots [index];
+        if (client && client != CLIENT_DELETED) {
+            zframe_destroy(&client->routing_id);
+            free(client);
+        }
+    }
+    free(table->slots);
+    free(table);
+    zhash_destroy(&hashed);
+    fmq_msg_destroy(&hugz);
+    fmq_msg_destroy(&nom);
+    fmq_msg_destroy(&message);
+    return elapsed > 0? (uint64_t) done * 1000000 / (uint64_t) elapsed: 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t clients = argc > 1? (size_t) atoi(argv [1]): BENCH_CLIENTS;
+    size_t messages = argc > 2? (size_t) atoi(argv [2]): BENCH_MESSAGES;
+    if (clients == 0 || messages < clients) {
+        fprintf(stderr, "usage: %s [clients [messages]]\n", argv [0]);
+        return 1;
+    }
+    messages -= messages % clients;
+
+    zsock_t *router = zsock_new_router("inproc://bench");
+    assert(router);
+    zsock_t **dealers = (zsock_t **) zmalloc(clients * sizeof(zsock_t *));
+    size_t index;
+    for (index = 0; index < clients; index++) {
+        dealers [index] = zsock_new_dealer(">inproc://bench");
+        assert(dealers [index]);
+    }
+    printf("%zu clients, %zu messages\n", clients, messages);
+
+    //  Same dealers, so same routing ids, for both; we run each twice and
+    //  keep the second, once the sockets are warm
+    tch_bench_lookup_t lookup;
+    for (lookup = BENCH_HEX; lookup <= BENCH_TABLE; lookup++) {
+        s_bench_run(lookup, router, dealers, clients, messages / 10 + clients);
+        uint64_t rate = s_bench_run(lookup, router, dealers, clients, messages);
+        printf("%-20s %10llu msgs/sec\n", s_bench_names [lookup], (unsigned long long) rate);
+    }
+
+    for (index = 0; index < clients; index++)
+        zsock_destroy(&dealers [index]);
+    free(dealers);
+    zsock_destroy(&router);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Project:
+ *  ___________      .___________ .__    .__
+ * \__    ___/____  |__\_   ___ \|  |__ |__|
+ *   |    |  \__  \ |  /    \  \/|  |  \|  |
+ *   |    |   / __ \|  \     \___|   Y  \  |
+ *   |____|  (____  /__|\______  /___|  /__|
+ *                \/           \/     \/
+ *
+ * Copyright (C) 2021 - 2022, Yan RuiBing, <772166784@qq.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ */
+
+/*
+ * Stress run of the fmq server with slow and fast clients at once. We
+ * publish a directory of files, and time fast clients fetching all of
+ * them: first alone, then while slow clients, capped to a trickle with
+ * a rate, fetch the same files. With disk reads and digests off the
+ * reactor, the slow clients shouldn't hold the fast ones up, so the two
+ * times should be close. We fail if a fast client doesn't get every file
+ * within the timeout.
+ *
+ *   tch_bench_stress [fast [slow [files [workers]]]]
+ */
+#include <tch_server.h>
+#include <tch_client.h>
+
+#define STRESS_FAST         8
+#define STRESS_SLOW         32
+#define STRESS_FILES        64
+#define STRESS_WORKERS      "4"
+#define STRESS_FILE_SIZE    1000000         //  Largest file we publish
+#define STRESS_SLOW_RATE    65536           //  Bytes per second, slow clients
+#define STRESS_TIMEOUT      120000          //  Msecs fast clients may take
+#define STRESS_DIR          "/tmp/tch_stress"
+
+/* Publish 'files' files of random sizes and content in directory */
+static void
+s_stress_publish(const char *path, size_t files)
+{
+    zsys_dir_create("%s", path);
+    byte *data = (byte *) malloc(STRESS_FILE_SIZE);
+    assert(data);
+    size_t index;
+    for (index = 0; index < STRESS_FILE_SIZE; index++)
+        data [index] = (byte) random();
+    for (index = 0; index < files; index++) {
+        char *name = zsys_sprintf("file-%04zu", index);
+        zfile_t *file = zfile_new(path, name);
+        zfile_output(file);
+        //  Sizes from a few bytes up, so small and large files mix
+        size_t size = 1 + (size_t) random() % STRESS_FILE_SIZE;
+        data [0] = (byte) index;
+        zchunk_t *chunk = zchunk_new(data, size);
+        zfile_write(file, chunk, 0);
+        zchunk_destroy(&chunk);
+        zfile_close(file);
+        zfile_destroy(&file);
+        zstr_free(&name);
+    }
+    free(data);
+}
+
+/* Connect client to endpoint, receiving into its own inbox */
+static tch_fmq_client_t *
+s_stress_client(const char *endpoint, const char *kind, size_t index, uint64_t rate)
+{
+    tch_fmq_client_t *client = fmq_client_new();
+    assert(client);
+    char *inbox = zsys_sprintf(STRESS_DIR "/%s-%zu", kind, index);
+    zsys_dir_create("%s", inbox);
+    if (fmq_client_connect(client, endpoint, 1000)
+    ||  fmq_client_set_inbox(client, inbox)) {
+        zsys_error("stress: %s client %zu could not connect", kind, index);
+        fmq_client_destroy(&client);
+    } else {
+        if (rate)
+            fmq_client_set_rate(client, rate);
+        fmq_client_subscribe(client, "/");
+    }
+    zstr_free(&inbox);
+    return client;
+}
+
+/* Remove a client's inbox */
+static void
+s_stress_remove(const char *kind, size_t index)
+{
+    char *inbox = zsys_sprintf(STRESS_DIR "/%s-%zu", kind, index);
+    zdir_t *dir = zdir_new(inbox, NULL);
+    if (dir)
+        zdir_remove(dir, true);
+    zdir_destroy(&dir);
+    zstr_free(&inbox);
+}
+
+/* Run 'fast' clients to completion, with 'slow' clients fetching too.
+ * Returns msecs the slowest of the fast clients took, or -1 if one of
+ * them didn't get every file in time. */
+static int64_t
+s_stress_run(const char *endpoint, size_t fast, size_t slow, size_t files)
+{
+    tch_fmq_client_t **slows = (tch_fmq_client_t **) zmalloc((slow + 1) * sizeof(tch_fmq_client_t *));
+    tch_fmq_client_t **fasts = (tch_fmq_client_t **) zmalloc(fast * sizeof(tch_fmq_client_t *));
+    size_t *received = (size_t *) zmalloc(fast * sizeof(size_t));
+    size_t index;
+    for (index = 0; index < slow; index++)
+        slows [index] = s_stress_client(endpoint, "slow", index, STRESS_SLOW_RATE);
+    //  Give the slow clients a head start, so they're busy when the
+    //  fast ones come
+    if (slow)
+        zclock_sleep(1000);
+
+    int64_t started = zclock_mono();
+    zpoller_t *poller = zpoller_new(NULL);
+    for (index = 0; index < fast; index++) {
+        fasts [index] = s_stress_client(endpoint, "fast", index, 0);
+        if (fasts [index])
+            zpoller_add(poller, fmq_client_msgpipe(fasts [index]));
+    }
+    size_t done = 0;
+    int64_t elapsed = -1;
+    while (done < fast) {
+        int64_t left = started + STRESS_TIMEOUT - zclock_mono();
+        zsock_t *which = left > 0? (zsock_t *) zpoller_wait(poller, (int) left): NULL;
+        if (!which)
+            break;              //  Timed out or interrupted
+        char *event = NULL, *inbox = NULL, *filename = NULL;
+        zsock_recv(which, "sss", &event, &inbox, &filename);
+        for (index = 0; index < fast; index++)
+            if (fasts [index] && fmq_client_msgpipe(fasts [index]) == which)
+                break;
+        if (index < fast && event && streq(event, "FILE UPDATED")
+        &&  ++received [index] == files)
+            done++;
+        zstr_free(&event);
+        zstr_free(&inbox);
+        zstr_free(&filename);
+    }
+    if (done == fast)
+        elapsed = zclock_mono() - started;
+
+    zpoller_destroy(&poller);
+    for (index = 0; index < fast; index++)
+        fmq_client_destroy(&fasts [index]);
+    for (index = 0; index < slow; index++)
+        fmq_client_destroy(&slows [index]);
+    free(received);
+    free(fasts);
+    free(slows);
+    //  Next run starts from empty inboxes
+    for (index = 0; index < fast; index++)
+        s_stress_remove("fast", index);
+    for (index = 0; index < slow; index++)
+        s_stress_remove("slow", index);
+    return elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t fast = argc > 1? (size_t) atoi(argv [1]): STRESS_FAST;
+    size_t slow = argc > 2? (size_t) atoi(argv [2]): STRESS_SLOW;
+    size_t files = argc > 3? (size_t) atoi(argv [3]): STRESS_FILES;
+    const char *workers = argc > 4? argv [4]: STRESS_WORKERS;
+    if (fast == 0 || files == 0) {
+        fprintf(stderr, "usage: %s [fast [slow [files [workers]]]]\n", argv [0]);
+        return 1;
+    }
+    srandom((unsigned int) zclock_time());
+    s_stress_publish(STRESS_DIR "/publish", files);
+
+    zactor_t *server = zactor_new(fmq_server, "stress");
+    assert(server);
+    zstr_sendx(server, "SET", "server/workers", workers, NULL);
+    zstr_sendx(server, "PUBLISH", STRESS_DIR "/publish", "/", NULL);
+    zstr_sendx(server, "BIND", "tcp://127.0.0.1:*", NULL);
+    zstr_sendx(server, "PORT", NULL);
+    char *command = NULL, *port = NULL;
+    zstr_recvx(server, &command, &port, NULL);
+    char *endpoint = zsys_sprintf("tcp://127.0.0.1:%s", port);
+    zstr_free(&command);
+    zstr_free(&port);
+
+    printf("%zu fast clients, %zu slow clients at %d bytes/sec, %zu files, %s workers\n",
+           fast, slow, STRESS_SLOW_RATE, files, workers);
+    int64_t alone = s_stress_run(endpoint, fast, 0, files);
+    int64_t mixed = s_stress_run(endpoint, fast, slow, files);
+    printf("fast clients alone:      %lld msecs\n", (long long) alone);
+    printf("fast with slow clients:  %lld msecs\n", (long long) mixed);
+
+    zstr_free(&endpoint);
+    zactor_destroy(&server);
+    zdir_t *dir = zdir_new(STRESS_DIR, NULL);
+    if (dir)
+        zdir_remove(dir, true);
+    zdir_destroy(&dir);
+    if (alone < 0 || mixed < 0) {
+        fprintf(stderr, "stress: fast clients didn't get every file in %d msecs\n",
+                STRESS_TIMEOUT);
+        return 1;
+    }
+    return 0;
+}
@@ -35,6 +35,275 @@ static void *thread_start(void *arg);
  */
 tch_data_t server;
 
+static void
+tch_holders_free(void *data)
+{
+    zhash_t *peers = (zhash_t*)data;
+    zhash_destroy(&peers);
+}
+
+/*
+ * Remember that a peer holds a file, from its announcement
+ * "FMQHAVE <digest> <size> <vpath>". We fetch from the peer's fmq
+ * service, so keep its address with the fmq port.
+ */
+static void
+tch_holders_insert(zhash_t *holders, zyre_t *node, const char *peer, const char *message)
+{
+    char digest[41];
+    unsigned long long size;
+    int offset = 0;
+
+    message += tch_strlen(TCH_FMQ_HAVE);
+    if (sscanf(message, " %40s %llu %n", digest, &size, &offset) != 2 || offset == 0)
+        return;
+    const char *vpath = message + offset;
+
+    char *address = zyre_peer_address(node, peer);
+    if (address == NULL)
+        return;
+    char *colon = strrchr(address, ':');
+    if (colon)
+        *colon = '\0';
+    char *endpoint = zsys_sprintf("%s%s", address, TCH_FMQ_PORT);
+    char *value = zsys_sprintf("%s %llu", digest, size);
+
+    zhash_t *peers = (zhash_t*)zhash_lookup(holders, vpath);
+    if (peers == NULL) {
+        peers = zhash_new();
+        zhash_autofree(peers);
+        zhash_insert(holders, vpath, peers);
+        zhash_freefn(holders, vpath, tch_holders_free);
+    }
+    zhash_update(peers, endpoint, value);
+
+    zstr_free(&value);
+    zstr_free(&endpoint);
+    free(address);
+}
+
+/*
+ * Reply with the version of a file most holders agree on: its digest,
+ * the holders as "endpoint vpath" lines, and its size. The digest is
+ * empty if nobody announced the file.
+ */
+static void
+tch_holders_reply(zhash_t *holders, zsock_t *pipe, const char *vpath)
+{
+    zhash_t *peers = (zhash_t*)zhash_lookup(holders, vpath);
+    zhash_t *votes = zhash_new();
+    const char *best = NULL;
+    size_t best_count = 0;
+
+    char *value = peers ? (char*)zhash_first(peers) : NULL;
+    while (value) {
+        size_t *count = (size_t*)zhash_lookup(votes, value);
+        if (count == NULL) {
+            count = (size_t*)zmalloc(sizeof(size_t));
+            zhash_insert(votes, value, count);
+            zhash_freefn(votes, value, free);
+        }
+        if (++*count > best_count) {
+            best_count = *count;
+            best = value;
+        }
+        value = (char*)zhash_next(peers);
+    }
+    zhash_destroy(&votes);
+
+    char digest[41] = "";
+    unsigned long long size = 0;
+    char *sources = strdup("");
+    if (best && sscanf(best, "%40s %llu", digest, &size) == 2) {
+        value = (char*)zhash_first(peers);
+        while (value) {
+            if (streq(value, best)) {
+                char *more = zsys_sprintf("%s%s %s\n", sources, zhash_cursor(peers), vpath);
+                free(sources);
+                sources = more;
+            }
+            value = (char*)zhash_next(peers);
+        }
+    }
+    zsock_send(pipe, "ss8", digest, sources, (uint64_t)size);
+    free(sources);
+}
+
+/* Tree of relays of a publisher, relay -> parent, created if need be */
+static zhash_t *
+tch_relays_tree(zhash_t *relays, const char *publisher)
+{
+    zhash_t *tree = (zhash_t*)zhash_lookup(relays, publisher);
+    if (tree == NULL) {
+        tree = zhash_new();
+        zhash_autofree(tree);
+        zhash_insert(relays, publisher, tree);
+        zhash_freefn(relays, publisher, tch_holders_free);
+    }
+    return tree;
+}
+
+/*
+ * Remember that a peer relays a publisher's files, from its announcement
+ * "FMQRELAY <publisher> <parent>", where parent is the node it receives
+ * them from. Each publisher has its own tree of relays.
+ */
+static void
+tch_relays_insert(zhash_t *relays, const char *name, const char *message)
+{
+    char publisher[65], parent[65];
+
+    message += tch_strlen(TCH_FMQ_RELAY);
+    if (sscanf(message, " %64s %64s", publisher, parent) != 2)
+        return;
+
+    zhash_update(tch_relays_tree(relays, publisher), name, parent);
+}
+
+/* Forget a peer that left, along with the tree it published */
+static void
+tch_relays_remove(zhash_t *relays, const char *name)
+{
+    zhash_delete(relays, name);
+    zhash_t *tree = (zhash_t*)zhash_first(relays);
+    while (tree) {
+        zhash_delete(tree, name);
+        tree = (zhash_t*)zhash_next(relays);
+    }
+}
+
+/* Hops from publisher down to relay, or -1 if its parent has gone */
+static int
+tch_relays_depth(zhash_t *tree, const char *publisher, const char *relay)
+{
+    int depth = 0;
+    while (!streq(relay, publisher)) {
+        relay = (const char*)zhash_lookup(tree, relay);
+        if (relay == NULL || (size_t)++depth > zhash_size(tree))
+            return -1;
+    }
+    return depth;
+}
+
+/* Count of relays each node of the tree feeds, node -> count */
+static zhash_t *
+tch_relays_children(zhash_t *tree)
+{
+    zhash_t *children = zhash_new();
+    char *parent = (char*)zhash_first(tree);
+    while (parent) {
+        size_t *count = (size_t*)zhash_lookup(children, parent);
+        if (count == NULL) {
+            count = (size_t*)zmalloc(sizeof(size_t));
+            zhash_insert(children, parent, count);
+            zhash_freefn(children, parent, free);
+        }
+        ++*count;
+        parent = (char*)zhash_next(tree);
+    }
+    return children;
+}
+
+/*
+ * The node a new receiver should fetch the publisher's files from: the
+ * one nearest the publisher that feeds fewer than TCH_FMQ_FANOUT relays.
+ * Filling the tree level by level keeps it shallow, and the publisher
+ * never feeds more than TCH_FMQ_FANOUT nodes. The receiver mustn't be in
+ * the tree, so nodes below it have no way up and can't be picked.
+ */
+static const char *
+tch_relays_pick(zhash_t *tree, const char *publisher)
+{
+    zhash_t *children = tch_relays_children(tree);
+    const char *best = publisher;
+    int best_depth = -1;
+
+    size_t *count = (size_t*)zhash_lookup(children, publisher);
+    if (count && *count >= TCH_FMQ_FANOUT) {
+        char *parent = (char*)zhash_first(tree);
+        while (parent) {
+            const char *relay = zhash_cursor(tree);
+            int depth = tch_relays_depth(tree, publisher, relay);
+            count = (size_t*)zhash_lookup(children, relay);
+            if (depth > 0 && (count == NULL || *count < TCH_FMQ_FANOUT)
+            &&  (best_depth == -1 || depth < best_depth
+            ||  (depth == best_depth && strcmp(relay, best) < 0))) {
+                best = relay;
+                best_depth = depth;
+            }
+            parent = (char*)zhash_next(tree);
+        }
+    }
+    zhash_destroy(&children);
+    return best;
+}
+
+/*
+ * Reply with the node we should fetch the publisher's files from. We
+ * put ourselves in the tree under that node at once, so a second
+ * request doesn't get the same place before our announcement goes out.
+ */
+static void
+tch_relays_reply(zhash_t *relays, zsock_t *pipe, const char *publisher, const char *self)
+{
+    zhash_t *tree = tch_relays_tree(relays, publisher);
+    zhash_delete(tree, self);
+    const char *best = tch_relays_pick(tree, publisher);
+    zstr_send(pipe, best);
+    if (!streq(best, self))
+        zhash_update(tree, self, (void*)best);
+}
+
+/*
+ * Does our parent keep us? Nodes that ask at the same time may all be
+ * given the same place, and so a node can end up feeding more than
+ * TCH_FMQ_FANOUT relays. Every node sees the same tree once the
+ * announcements are in, so we settle it the same way everywhere: the
+ * children with the lowest names keep their places, and the others
+ * move.
+ */
+static bool
+tch_relays_admitted(zhash_t *tree, const char *parent, const char *self)
+{
+    size_t below = 0;
+    const char *relay = (const char*)zhash_first(tree);
+    while (relay) {
+        if (streq(relay, parent) && strcmp(zhash_cursor(tree), self) < 0)
+            below++;
+        relay = (const char*)zhash_next(tree);
+    }
+    return below < TCH_FMQ_FANOUT;
+}
+
+/*
+ * Move our relay subscriptions whose parent left, or has no room for
+ * us, to another node of the tree, and tell the others where we went.
+ * We run on every change to the trees, so nodes that raced for the same
+ * place keep moving until each has its own.
+ */
+static void
+tch_relays_check(zhash_t *relays, zyre_t *node)
+{
+    const char *self = zyre_name(node);
+    zhash_t *tree = (zhash_t*)zhash_first(relays);
+    while (tree) {
+        const char *publisher = zhash_cursor(relays);
+        const char *parent = (const char*)zhash_lookup(tree, self);
+        if (parent
+        &&  tch_fmq_ishavenode(publisher) == TCH_OK
+        &&  ((!streq(parent, publisher) && !zhash_lookup(tree, parent))
+        ||  !tch_relays_admitted(tree, parent, self))) {
+            zhash_delete(tree, self);
+            char *best = strdup(tch_relays_pick(tree, publisher));
+            zhash_update(tree, self, best);
+            if (tch_file_reparent(publisher, best) == TCH_OK)
+                zyre_shouts(node, "CHAT", "%s %s %s", TCH_FMQ_RELAY, publisher, best);
+            free(best);
+        }
+        tree = (zhash_t*)zhash_next(relays);
+    }
+}
+
 //  This actor will listen and publish anything received
 //  on the CHAT group
 
@@ -49,6 +318,8 @@ msg_actor(zsock_t *pipe, void *args)
     zsock_signal(pipe, 0);     //  Signal "ready" to caller
 
     bool terminated = false;
+    zhash_t *holders = zhash_new();     /* vpath -> endpoint -> "digest size" */
+    zhash_t *relays = zhash_new();      /* publisher -> relay -> parent */
     zpoller_t *poller = zpoller_new(pipe, zyre_socket(node),NULL);
     while (!terminated) {
         void *which = zpoller_wait(poller, -1);
@@ -63,6 +334,14 @@ msg_actor(zsock_t *pipe, void *args)
             } else if (streq(command, "SHOUT")) {
                 char *string = zmsg_popstr(msg);
                 zyre_shouts(node, "CHAT", "%s", string);
+            } else if (streq(command, "PARENT")) {
+                char *publisher = zmsg_popstr(msg);
+                tch_relays_reply(relays, pipe, publisher ? publisher : "", zyre_name(node));
+                free(publisher);
+            } else if (streq(command, "HOLDERS")) {
+                char *vpath = zmsg_popstr(msg);
+                tch_holders_reply(holders, pipe, vpath ? vpath : "");
+                free(vpath);
             } else {
                 puts ("E: invalid message to actor");
                 assert (false);
@@ -81,10 +360,18 @@ msg_actor(zsock_t *pipe, void *args)
                 tch_insert_node(name, zyre_peer_address(node, peer), (zsock_t*)which/*zsock_endpoint(which)*/);
             } else if (streq(event, "EXIT")) {
                 tch_del_node(name);
+                tch_relays_remove(relays, name);
+                tch_relays_check(relays, node);
             } else if (streq(event, "SHOUT")) {
                 //printf("event : %s msg : %s\n", event, message);
                 if (tch_strcmp(TCH_FMQ_SERVER, message) == 0)
                     tch_setfmq_node(name);
+                else if (strncmp(message, TCH_FMQ_HAVE " ", tch_strlen(TCH_FMQ_HAVE) + 1) == 0)
+                    tch_holders_insert(holders, node, peer, message);
+                else if (strncmp(message, TCH_FMQ_RELAY " ", tch_strlen(TCH_FMQ_RELAY) + 1) == 0) {
+                    tch_relays_insert(relays, name, message);
+                    tch_relays_check(relays, node);
+                }
             }
                 
             /*else if (streq (event, "EVASIVE"))
@@ -101,6 +388,8 @@ msg_actor(zsock_t *pipe, void *args)
         }
     }
     zpoller_destroy(&poller);
+    zhash_destroy(&holders);
+    zhash_destroy(&relays);
     zyre_stop(node);
     zclock_sleep(100);
     zyre_destroy(&node);
@@ -73,6 +73,9 @@ typedef struct tch_fmq_cs       tch_fmq_cs_t;
 #define TCH_FMQ_PORT    ":5670"         /* Build fmq client accept port */
 #define TCH_FMQ_TCP     "tcp://*:5670"  /* FMQ SERVICE bind local tcp port*/
 #define TCH_FMQ_SERVER  "FMQSERVER"     /* Notify fmq service setup complete */
+#define TCH_FMQ_HAVE    "FMQHAVE"       /* Announce a file the fmq service holds */
+#define TCH_FMQ_RELAY   "FMQRELAY"      /* Announce a node serves on what it receives */
+#define TCH_FMQ_FANOUT  4               /* Most relays one fmq service feeds */
 #define TCH_FMQ_SVPATH  "./fmq"         /* fmq server File Directory*/
 #define TCH_FMQ_CLPATH  "./clfmq"       /* fmq client File Directory*/
 
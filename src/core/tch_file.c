@@ -16,12 +16,20 @@
 static int tch_file_ls(int argc, char **argv);
 static int tch_file_send(int argc, char **argv);
 static int tch_file_recv(int argc, char **argv);
+static int tch_file_swarm(int argc, char **argv);
+static int tch_file_relay(int argc, char **argv);
+static int tch_file_subscribe(tch_lannode_t *node, tch_lannode_t *from, const char *clpath);
+static int tch_file_connect(tch_fmq_cs_t *cs, tch_lannode_t *from);
 static int tch_cattcp(char **tcp, const char *ip);
+static void tch_file_publish(const char *path);
+static void tch_file_announce(zfile_t *file, const char *name);
 
 tch_command_t filecmds[] = {
     {"ls",        "List files in the current directory.",     tch_file_ls},
     {"send",      "Send file (Select the file first)",        tch_file_send},
     {"recv",      "Client accepts file",                      tch_file_recv},
+    {"swarm",     "Fetch file from all nodes that hold it",   tch_file_swarm},
+    {"relay",     "Receive through relay tree, serve on",     tch_file_relay},
     {NULL,        NULL,                                       NULL}
 };
 
@@ -62,21 +70,135 @@ tch_file_send(int argc, char **argv)
 
     // make Directory
     tch_mkdir(server.fmq.svpath);
+    tch_file_publish(server.fmq.svpath);
+
+    /* Tell other nodes which files we hold, so they can swarm them */
+    zdir_t *dir = zdir_new(server.fmq.svpath, NULL);
+    if (dir) {
+        zfile_t **files = zdir_flatten(dir);
+        uint index;
+        for (index = 0; files[index]; index++)
+            tch_file_announce(files[index], zfile_filename(files[index], server.fmq.svpath));
+        zdir_flatten_free(&files);
+        zdir_destroy(&dir);
+    }
+    return 0;
+}
+
+/*
+ * Fetch a file from every node that announced it, a piece from each.
+ * Once we have it we serve it too, so later nodes have one more source.
+ */
+static int
+tch_file_swarm(int argc, char **argv)
+{
+    char        *digest = NULL, *sources = NULL, *event = NULL;
+    uint64_t     size = 0;
+    const char  *clpath = argc > 2 ? argv[2] : TCH_FMQ_CLPATH;
+    int          rc = TCH_ERROR;
+
+    if (argc < 2) {
+        TCHLOGE("usage: swarm <file> [path]");
+        return TCH_ERROR;
+    }
+    char *vpath = zsys_sprintf("%s%s", argv[1][0] == '/' ? "" : "/", argv[1]);
+
+    zstr_sendx(server.actor, "HOLDERS", vpath, NULL);
+    zsock_recv(server.actor, "ss8", &digest, &sources, &size);
+
+    zlist_t *list = zlist_new();
+    zlist_autofree(list);
+    char *line = sources;
+    while (line && *line) {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+        if (*line)
+            zlist_append(list, line);
+        line = end ? end + 1 : line + tch_strlen(line);
+    }
+    if (digest == NULL || *digest == '\0' || zlist_size(list) == 0) {
+        TCHLOGE("no node holds %s", vpath);
+        goto done;
+    }
+    if (tch_mkdir(clpath) == TCH_ERROR)
+        goto done;
+
+    /* Any source will do for the control connection */
+    char *endpoint = strdup((char*)zlist_first(list));
+    *strchr(endpoint, ' ') = '\0';
+    tch_fmq_client_t *client = fmq_client_new();
+    assert(client);
+    if (fmq_client_connect(client, endpoint, 1000) != 0
+    ||  fmq_client_set_inbox(client, clpath) != 0) {
+        TCHLOGE("fmq client connect error");
+    } else {
+        fmq_client_swarm(client, vpath + 1, digest, size, list);
+        zsock_recv(fmq_client_msgpipe(client), "s", &event);
+        if (event && tch_strcmp(event, "FILE UPDATED") == 0) {
+            TCHLOGI("%s/%s received from %zu nodes", clpath, vpath + 1, zlist_size(list));
+            if (server.fmq.sfg == 0) {
+                strncpy(server.fmq.svpath, clpath, sizeof(server.fmq.svpath) - 1);
+                tch_file_publish(server.fmq.svpath);
+            }
+            if (tch_strcmp(server.fmq.svpath, clpath) == 0) {
+                zfile_t *file = zfile_new(clpath, vpath + 1);
+                tch_file_announce(file, vpath + 1);
+                zfile_destroy(&file);
+            }
+            rc = TCH_OK;
+        } else {
+            TCHLOGE("swarm download of %s failed", vpath);
+        }
+        zstr_free(&event);
+    }
+    fmq_client_destroy(&client);
+    free(endpoint);
+
+done:
+    zlist_destroy(&list);
+    zstr_free(&digest);
+    zstr_free(&sources);
+    zstr_free(&vpath);
+    return rc;
+}
 
-    zstr_sendx(server.file_actor, "PUBLISH", server.fmq.svpath, "/", NULL);
+/* Serve path and tell other nodes the fmq service is up */
+static void
+tch_file_publish(const char *path)
+{
+    zstr_sendx(server.file_actor, "PUBLISH", path, "/", NULL);
     zstr_sendx(server.file_actor, "BIND", TCH_FMQ_TCP, NULL);
 
     /*Notify other nodes that the file transfer service node has been established*/
     zstr_sendx(server.actor, "SHOUT", TCH_FMQ_SERVER, NULL);
     server.fmq.sfg = 1;
-    return 0;
+}
+
+/* Tell other nodes we hold file, as "FMQHAVE <digest> <size> /<name>" */
+static void
+tch_file_announce(zfile_t *file, const char *name)
+{
+    size_t length = tch_strlen(name);
+
+    /* Files in transfer, their journals and digest caches aren't to share */
+    if ((length > 7 && tch_strcmp(name + length - 7, ".fmqtmp") == 0)
+    ||  (length > 8 && tch_strcmp(name + length - 8, ".fmqpart") == 0)
+    ||  (length > 11 && tch_strcmp(name + length - 11, ".fmqdigests") == 0))
+        return;
+
+    const char *digest = zfile_digest(file);
+    if (digest == NULL)
+        return;
+    char *text = zsys_sprintf("%s %s %llu /%s", TCH_FMQ_HAVE, digest,
+                              (unsigned long long)zfile_cursize(file), name);
+    zstr_sendx(server.actor, "SHOUT", text, NULL);
+    zstr_free(&text);
 }
 
 static int
 tch_file_recv(int argc, char **argv)
 {
-    tch_fmq_cs_t    *new_node;
-
     tch_lannode_t *node = tch_getselect_node();
     if (node == NULL) {
         TCHLOGE("please select node host by command 'select'.");
@@ -90,57 +212,92 @@ tch_file_recv(int argc, char **argv)
     if (tch_fmq_ishavenode(node->uname) == TCH_OK) {
         TCHLOGI("Node has been selected recv file.");
         return TCH_ERROR;
-    } else if (tch_strcmp(node->uname, "") != 0) {
-        new_node = tch_malloc(sizeof(tch_fmq_cs_t));
-        tch_memzero(new_node, sizeof(tch_fmq_cs_t));
-        tch_memzero(new_node->clpath, sizeof(new_node->clpath));
-        new_node->node = node;
-
-        if (argc < 2) {
-            if (tch_strcmp(new_node->clpath, "") == 0)
-                strncpy(new_node->clpath, TCH_FMQ_CLPATH, tch_strlen(TCH_FMQ_CLPATH)+1);
-        } else {
-            strncpy(new_node->clpath, argv[1], tch_strlen(argv[1])+1);
-        }
+    } else if (tch_strcmp(node->uname, "") == 0) {
+        TCHLOGE("create node failed.");
+        return TCH_ERROR;
+    }
 
-        // make Directory
-        if (tch_mkdir(new_node->clpath) == TCH_ERROR) {
-            goto tcherror;
-        }
+    return tch_file_subscribe(node, node, argc < 2 ? TCH_FMQ_CLPATH : argv[1]);
+}
 
-        // link tcp address : tcp://ip:5670
-        if (tch_cattcp(&new_node->tcp, node->ip) == -1) {
-            TCHLOGE("strcat ip error %s\n", node->ip);
-            goto tcherror;
-        }
+/*
+ * Receive the selected node's files from a node in its relay tree, and
+ * serve them on in turn. Each node feeds at most TCH_FMQ_FANOUT relays,
+ * so the publisher's egress stays the same however many nodes receive.
+ * The protocol has no end of sync, so we serve our inbox straight away;
+ * our fmq service offers files only once they are whole, so receivers
+ * below us get each file as soon as we have it.
+ */
+static int
+tch_file_relay(int argc, char **argv)
+{
+    const char  *clpath = argc > 1 ? argv[1] : TCH_FMQ_CLPATH;
+    char        *parent;
 
-        new_node->timeout = 1000;
-        new_node->client = fmq_client_new();
-        assert(new_node->client);
-    } else {
-        TCHLOGE("create node failed.");
+    tch_lannode_t *node = tch_getselect_node();
+    if (node == NULL) {
+        TCHLOGE("please select node host by command 'select'.");
+        return TCH_ERROR;
+    }
+    if (tch_fmq_ishavenode(node->uname) == TCH_OK) {
+        TCHLOGI("Node has been selected recv file.");
+        return TCH_ERROR;
+    }
+    if (server.fmq.sfg == 1 && tch_strcmp(server.fmq.svpath, clpath) != 0) {
+        TCHLOGE("fmq service already serves %s, cannot relay", server.fmq.svpath);
         return TCH_ERROR;
     }
 
-    if (fmq_client_connect(new_node->client, new_node->tcp, new_node->timeout) != 0) {
-        if (new_node->client)
-            fmq_client_destroy(&new_node->client);
-        TCHLOGE("fmq client connect error");
-        goto tcherror;
+    /* Ask which node in the tree has room for us */
+    zstr_sendx(server.actor, "PARENT", node->uname, NULL);
+    parent = zstr_recv(server.actor);
+    tch_lannode_t *from = parent ? tch_search_node(parent) : NULL;
+    if (from == NULL)
+        from = node;
+
+    if (tch_file_subscribe(node, from, clpath) == TCH_ERROR) {
+        zstr_free(&parent);
+        return TCH_ERROR;
     }
-    //  Set the clients storage location
-    if (fmq_client_set_inbox(new_node->client, new_node->clpath) != 0) {
-        TCHLOGE("fmq client set inbox error");
+    if (server.fmq.sfg == 0) {
+        strncpy(server.fmq.svpath, clpath, sizeof(server.fmq.svpath) - 1);
+        tch_file_publish(server.fmq.svpath);
+    }
+
+    /* Tell other nodes they may receive from us */
+    char *text = zsys_sprintf("%s %s %s", TCH_FMQ_RELAY, node->uname, from->uname);
+    zstr_sendx(server.actor, "SHOUT", text, NULL);
+    zstr_free(&text);
+
+    TCHLOGI("relaying files of %s from %s", node->uname, from->uname);
+    zstr_free(&parent);
+    return TCH_OK;
+}
+
+/*
+ * Receive node's files into clpath, connecting to from, which is node
+ * itself or one of its relays.
+ */
+static int
+tch_file_subscribe(tch_lannode_t *node, tch_lannode_t *from, const char *clpath)
+{
+    tch_fmq_cs_t    *new_node;
+
+    new_node = tch_malloc(sizeof(tch_fmq_cs_t));
+    tch_memzero(new_node, sizeof(tch_fmq_cs_t));
+    tch_memzero(new_node->clpath, sizeof(new_node->clpath));
+    new_node->node = node;
+    strncpy(new_node->clpath, clpath, sizeof(new_node->clpath) - 1);
+
+    // make Directory
+    if (tch_mkdir(new_node->clpath) == TCH_ERROR) {
         goto tcherror;
     }
-    //  Subscribe to the server's root
-    if (fmq_client_subscribe(new_node->client, "/") != 0) {
-        TCHLOGE("fmq client subscribe error");
+
+    new_node->timeout = 1000;
+    if (tch_file_connect(new_node, from) == TCH_ERROR) {
         goto tcherror;
     }
-    //  Get a reference to the msgpipe
-    new_node->msgpipe = fmq_client_msgpipe(new_node->client);
-    assert(new_node->msgpipe);
 
     tch_fmq_insertnode(new_node);
 
@@ -151,6 +308,69 @@ tcherror:
     return TCH_ERROR;
 }
 
+/*
+ * Connect cs's fmq client to from and subscribe to its root, receiving
+ * into cs->clpath.
+ */
+static int
+tch_file_connect(tch_fmq_cs_t *cs, tch_lannode_t *from)
+{
+    // link tcp address : tcp://ip:5670
+    if (tch_cattcp(&cs->tcp, from->ip) == -1) {
+        TCHLOGE("strcat ip error %s\n", from->ip);
+        return TCH_ERROR;
+    }
+
+    cs->client = fmq_client_new();
+    assert(cs->client);
+
+    if (fmq_client_connect(cs->client, cs->tcp, cs->timeout) != 0) {
+        fmq_client_destroy(&cs->client);
+        TCHLOGE("fmq client connect error");
+        return TCH_ERROR;
+    }
+    //  Set the clients storage location
+    if (fmq_client_set_inbox(cs->client, cs->clpath) != 0) {
+        TCHLOGE("fmq client set inbox error");
+        return TCH_ERROR;
+    }
+    //  Subscribe to the server's root
+    if (fmq_client_subscribe(cs->client, "/") != 0) {
+        TCHLOGE("fmq client subscribe error");
+        return TCH_ERROR;
+    }
+    //  Get a reference to the msgpipe
+    cs->msgpipe = fmq_client_msgpipe(cs->client);
+    assert(cs->msgpipe);
+
+    return TCH_OK;
+}
+
+/*
+ * Receive publisher's files from parent instead, as the relay we had
+ * left or has no room for us. Called from the message actor, which
+ * keeps the relay trees; the inbox stays, so we fetch only what we lack.
+ */
+int
+tch_file_reparent(const char *publisher, const char *parent)
+{
+    tch_fmq_cs_t *cs = (tch_fmq_cs_t*)zhash_lookup(server.fmqnodes, publisher);
+    tch_lannode_t *from = tch_search_node((char*)parent);
+    if (cs == NULL || from == NULL)
+        return TCH_ERROR;
+
+    if (cs->client)
+        fmq_client_destroy(&cs->client);
+    cs->msgpipe = NULL;
+    if (tch_file_connect(cs, from) == TCH_ERROR) {
+        if (cs->client)
+            fmq_client_destroy(&cs->client);
+        return TCH_ERROR;
+    }
+    TCHLOGI("relaying files of %s from %s", publisher, parent);
+    return TCH_OK;
+}
+
 static int
 tch_cattcp(char **tcp, const char *ip)
 {
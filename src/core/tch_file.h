@@ -36,6 +36,7 @@ int tch_fmq_insertnode(tch_fmq_cs_t *node);
 int tch_fmq_deletenode(const char *name);
 int tch_fmq_freenode(tch_fmq_cs_t *node);
 void tch_fmq_destroy();
+int tch_file_reparent(const char *publisher, const char *parent);
 extern tch_module_t tch_file_module;
 #endif
 
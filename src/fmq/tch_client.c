@@ -11,6 +11,18 @@
  *
  */
 #include <tch_client.h>
+#include <tch_auto_config.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#if (TCH_HAVE_FICLONE)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if (TCH_HAVE_IO_URING)
+#include <liburing.h>
+#endif
 
 //  State machine constants
 
@@ -82,6 +94,10 @@ typedef struct tch_client_s         tch_client_t;
 typedef struct tch_client_args_s    tch_client_args_t;
 typedef struct tch_sub_s            tch_sub_t;
 typedef struct tch_s_client_s       tch_s_client_t;
+typedef struct tch_stream_s         tch_stream_t;
+typedef struct tch_stripe_s         tch_stripe_t;
+typedef struct tch_write_s          tch_write_t;
+typedef struct tch_signed_s         tch_signed_t;
 //typedef struct tch_fmq_client_s     tch_fmq_client_t;
 
 struct tch_sub_s {
@@ -97,11 +113,102 @@ struct tch_client_s {
     fmq_msg_t       *message;       //  Message to/from server
     tch_client_args_t *args;        //  Arguments from methods
     size_t          credit;         //  Current credit pending
+    uint64_t        acked;          //  Last chunk we wrote, for next NOM
     zfile_t         *file;          //  File we're currently writing
+    char            *filename;      //  Name of that file, unless a delta
+    char            *failed;        //  File we gave up on, till its end
+    zhash_t         *parked;        //  Files server set aside, by name
+    fmq_manifest_t  *manifest;      //  Our inbox, while we resync it
     char            *inbox;         //  Path where files will be stored
     zlist_t         *subs;          //  Our subscriptions
     tch_sub_t       *sub;           //  Subscription we're sending
     int             timeouts;       //  Count the timeouts
+    size_t          window;         //  Credit we try to keep open
+    size_t          window_min;     //  Smallest credit window
+    size_t          window_max;     //  Largest credit window
+    int64_t         rtt;            //  Best round trip seen, usecs
+    int64_t         ping_at;        //  When we sent ICANHAZ or HUGZ
+    int64_t         sample_at;      //  Start of throughput sample
+    size_t          sample_bytes;   //  Bytes received in sample
+    int64_t         chunk_at;       //  When last chunk arrived
+    FILE            *journal;       //  Ranges received of current file
+    char            *journal_name;  //  Journal file name
+    size_t          delta_block;    //  Delta block size, 0 for whole files
+    bool            dedupe;         //  Copy content we have, don't fetch it
+    uint32_t        priority;       //  Priority we ask for subscriptions
+    uint64_t        rate;           //  Most bytes per second we ask for
+    char            *endpoint;      //  Server endpoint, for extra streams
+    uint32_t        stream_count;   //  Extra data streams to ask for
+    zlist_t         *streams;       //  Extra data streams, once opened
+    char            *session;       //  Session id our streams join
+    bool            subscribed;     //  Server has our first subscription
+    zhash_t         *stripes;       //  Files arriving over streams, by name
+    zlist_t         *swarm;         //  Streams fetching swarm downloads
+    int             swarm_timer;    //  zloop timer watching swarm streams
+    zactor_t        *writer;        //  Disk writer, NULL until started
+    size_t          writes;         //  Jobs the writer hasn't handed back
+    size_t          queued;         //  Bytes the writer hasn't written yet
+    fmq_msg_t       *nom;           //  NOM we send as the writer frees credit
+    zhash_t         *signed_files;  //  Signatures of inbox files, by name
+};
+
+/* Extra data stream to the server. It only carries chunks of large files
+ * the server stripes over all our streams, so it needs no state machine */
+struct tch_stream_s {
+    zsock_t         *dealer;        //  Socket to talk to server
+    fmq_msg_t       *message;       //  Message to/from server
+    size_t          credit;         //  Credit pending on this stream
+    bool            connected;      //  Server answered our OHAI
+    bool            joined;         //  We sent ICANHAZ for the session
+    int64_t         sent_at;        //  When we last sent anything
+    char            *filename;      //  Swarm: file we're fetching a range of
+    char            *vpath;         //  Swarm: path of file on its source
+    uint64_t        range_start;    //  Swarm: start of range we're fetching
+    uint64_t        range_end;      //  Swarm: end of range we're fetching
+    uint64_t        range_got;      //  Swarm: bytes of range we have
+    uint32_t        source;         //  Swarm: index of source we're using
+    uint32_t        tries;          //  Swarm: sources tried for the range
+    int64_t         heard_at;       //  Swarm: when source last spoke
+};
+
+/* Job for the disk writer: a chunk to write, or with no chunk, the end
+ * of the file. The job belongs to the writer until it hands it back; the
+ * end of file job owns the file and its journal, the others borrow them */
+struct tch_write_s {
+    zfile_t         *file;          //  File we're writing
+    FILE            *journal;       //  Ranges received of file, if any
+    char            *journal_name;  //  End of file: journal to remove
+    char            *filename;      //  End of file: name to report
+    char            *target;        //  End of file: where file goes
+    zchunk_t        *chunk;         //  Data to write, NULL at end of file
+    uint64_t        offset;         //  Where chunk goes, or size of file
+    uint64_t        sequence;       //  Chunk sequence, to acknowledge
+    bool            failed;         //  Writer couldn't write the chunk
+    bool            unsynced;       //  Written, but sync failed
+};
+
+/* Block signatures of an inbox file, which we take again only once the
+ * file changes */
+struct tch_signed_s {
+    uint64_t        size;           //  Size of file when we signed it
+    int64_t         mtime;          //  Modification time then, nsecs
+    size_t          block;          //  Block size we signed with
+    char            *signatures;    //  Signatures, as file_signatures
+};
+
+/* File arriving in chunks over several streams, in any order. A file
+ * the server set aside is kept in one too, with just its file and journal */
+struct tch_stripe_s {
+    zfile_t         *file;          //  File we're writing, NULL if we can't
+    FILE            *journal;       //  Ranges received of file
+    char            *journal_name;  //  Journal file name
+    uint64_t        received;       //  Bytes received so far
+    uint64_t        expected;       //  Bytes server sent, once we know
+    bool            eof;            //  Server sent end of file
+    zlist_t         *unsynced;      //  Ranges written, not yet on disk
+    uint64_t        unsynced_bytes; //  Bytes in those ranges
+    char            *digest;        //  Swarm: digest the file must have
+    zlist_t         *sources;       //  Swarm: "endpoint vpath" of each holder
 };
 //  These are the different method arguments we manage automatically
 struct tch_client_args_s {
@@ -183,6 +290,55 @@ static void signal_subscribe_success(tch_client_t *self);
 static void handle_subscribe_timeout(tch_client_t *self);
 static void process_the_patch(tch_client_t *self);
 static void refill_credit_as_needed (tch_client_t *self);
+static void measure_throughput (tch_client_t *self, size_t bytes);
+static zfile_t *inbox_temp_open (tch_client_t *self, const char *filename, bool fresh);
+static void file_preallocate (zfile_t *file, uint64_t size);
+static int file_commit (zfile_t *file, const char *target);
+static int file_clone (const char *source, zfile_t *file);
+static int inbox_clone (tch_client_t *self, const char *source, const char *filename);
+static void process_the_copy (tch_client_t *self, const char *filename);
+static zhash_t *collect_inbox_cache (tch_client_t *self);
+static tch_signed_t *file_signed (tch_client_t *self, const char *path, const char *name);
+static void signed_destroy (void *argument);
+static void resync_the_inbox (tch_client_t *self);
+static void journal_open (tch_client_t *self, const char *filename);
+static FILE *journal_start (zfile_t *file, const char *name, const char *digest, bool fresh);
+static void journal_close (tch_client_t *self, bool complete);
+static off_t journal_resume_offset (const char *name, char *digest);
+static zhash_t *collect_inbox_options (tch_client_t *self);
+static bool s_name_ends (const char *name, const char *suffix);
+static char *file_signatures (const char *name, size_t block);
+static void process_the_delta (tch_client_t *self, const char *filename);
+static void server_refetch (tch_client_t *self, const char *vpath);
+static void process_the_batch (tch_client_t *self);
+static void file_fail (tch_client_t *self, const char *filename);
+static const char *inbox_filename (tch_client_t *self, const char *filename);
+static size_t process_the_stripe (tch_client_t *self, fmq_msg_t *message, const char *filename);
+static void stripe_destroy (tch_stripe_t **self_p);
+static void stripe_sync (tch_stripe_t *self);
+static void file_park (tch_client_t *self);
+static void file_unpark (tch_client_t *self, const char *filename);
+static void streams_open (tch_client_t *self, zhash_t *options);
+static void streams_join (tch_client_t *self);
+static void streams_keepalive (tch_client_t *self, bool force);
+static void streams_close (tch_client_t *self);
+static void stream_refill (tch_client_t *self, tch_stream_t *stream);
+static void stream_destroy (tch_stream_t **self_p);
+static int s_client_handle_stream (zloop_t *loop, zsock_t *reader, void *argument);
+static void writer_post (tch_client_t *self, tch_write_t *job);
+static void writer_done (tch_client_t *self, tch_write_t *job);
+static void writer_sync (tch_client_t *self);
+static void writer_refill (tch_client_t *self);
+static int s_client_handle_writer (zloop_t *loop, zsock_t *reader, void *argument);
+static void s_writer (zsock_t *pipe, void *args);
+static void swarm_start (tch_client_t *self, const char *filename, const char *digest, uint64_t size, const char *sources);
+static void swarm_stream_open (tch_client_t *self, const char *filename, uint32_t source, uint64_t start, uint64_t end, uint32_t tries);
+static void swarm_stream_close (tch_client_t *self, tch_stream_t *stream);
+static void swarm_retry (tch_client_t *self, tch_stream_t *stream);
+static void swarm_check (tch_client_t *self, const char *filename);
+static void swarm_finish (tch_client_t *self, const char *filename, bool complete);
+static int s_client_handle_swarm (zloop_t *loop, zsock_t *reader, void *argument);
+static int s_client_handle_swarm_timer (zloop_t *loop, int timer_id, void *argument);
 static int s_client_handle_cmdpipe(zloop_t *loop, zsock_t *reader, void *argument);
 static int s_client_handle_msgpipe(zloop_t *loop, zsock_t *reader, void *argument);
 static int s_client_handle_protocol (zloop_t *loop, zsock_t *reader, void *argument);
@@ -190,9 +346,31 @@ static void log_invalid_message(tch_client_t *self);
 //static uint8_t fmq_client_destructor (tch_fmq_client_t *self);
 static int s_accept_reply (tch_fmq_client_t *self, ...);
 
-//  There's no point making these configurable
+//  Credit window starts at CREDIT_MINIMUM and follows the bandwidth-delay
+//  product between the bounds set by fmq_client_set_credit ()
 #define CREDIT_SLICE        1000000
 #define CREDIT_MINIMUM      (CREDIT_SLICE * 4) + 1
+#define CREDIT_MAXIMUM      (CREDIT_SLICE * 64)
+#define CREDIT_IDLE         1000000     //  Gap that ends a sample, usecs
+
+//  Sidecar journal kept beside each file we're receiving
+#define JOURNAL_SUFFIX      ".fmqpart"
+
+//  File we're receiving goes by this name until it's whole
+#define TEMP_SUFFIX         ".fmqtmp"
+
+//  Most time an extra stream stays silent, so server doesn't expire it
+#define STREAM_HUGZ         10000       //  msecs
+
+//  Most chunks the writer takes at once
+#define WRITER_BATCH        64
+
+//  Bytes of a striped file we write before we sync them and journal them
+#define STRIPE_SYNC         64000000
+
+//  We check swarm streams this often, and give up on a silent source
+#define SWARM_CHECK         1000        //  msecs
+#define SWARM_STALL         30000       //  msecs
 #define engine_set_timeout  engine_set_expiry
 
 static int 
@@ -203,6 +381,12 @@ client_initialize (tch_client_t *self)
     self->credit = 0;
     self->inbox = NULL;
     self->timeouts = 0;
+    self->window = CREDIT_MINIMUM;
+    self->window_min = CREDIT_MINIMUM;
+    self->window_max = CREDIT_MAXIMUM;
+    self->stripes = zhash_new();
+    self->parked = zhash_new();
+    self->swarm = zlist_new();
 
     return 0;
 }
@@ -219,6 +403,38 @@ client_terminate(tch_client_t *self)
     }
     zlist_destroy(&self->subs);
     zsys_debug("client_terminate: subscription list destroyed");
+    //  Let the writer finish what it has, before we close files under it
+    writer_sync(self);
+    if (self->writer) {
+        engine_handle_socket(self, (zsock_t *) self->writer, NULL);
+        zactor_destroy(&self->writer);
+    }
+    fmq_msg_destroy(&self->nom);
+    //  Keep any partial file and its journal, so we can resume it
+    journal_close(self, false);
+    zfile_destroy(&self->file);
+    zstr_free(&self->filename);
+    zstr_free(&self->failed);
+    tch_stripe_t *parked = (tch_stripe_t *) zhash_first(self->parked);
+    while (parked) {
+        stripe_destroy(&parked);
+        parked = (tch_stripe_t *) zhash_next(self->parked);
+    }
+    zhash_destroy(&self->parked);
+    zhash_destroy(&self->signed_files);
+    fmq_manifest_destroy(&self->manifest);
+    streams_close(self);
+    while (zlist_size(self->swarm))
+        swarm_stream_close(self, (tch_stream_t *) zlist_first(self->swarm));
+    zlist_destroy(&self->swarm);
+    tch_stripe_t *stripe = (tch_stripe_t *) zhash_first(self->stripes);
+    while (stripe) {
+        stripe_destroy(&stripe);
+        stripe = (tch_stripe_t *) zhash_next(self->stripes);
+    }
+    zhash_destroy(&self->stripes);
+    zstr_free(&self->endpoint);
+    zstr_free(&self->session);
     if (self->inbox) {
         free(self->inbox);
         zsys_debug("client_terminate: inbox freed");
@@ -649,6 +865,12 @@ s_client_execute(tch_s_client_t *self, event_t event)
                         zsys_debug ("%s:         $ stayin alive", self->log_prefix);
                     stayin_alive (&self->client);
                 }
+                if (!self->exception) {
+                    //  resync the inbox
+                    if (fmq_client_verbose)
+                        zsys_debug ("%s:         $ resync the inbox", self->log_prefix);
+                    resync_the_inbox (&self->client);
+                }
                 if (!self->exception) {
                     //  signal subscribe success
                     if (fmq_client_verbose)
@@ -780,6 +1002,19 @@ s_client_execute(tch_s_client_t *self, event_t event)
                         zsys_debug("%s:         $ refill credit as needed", self->log_prefix);
                     refill_credit_as_needed(&self->client);
                 }
+            } else if (self->event == icanhaz_ok_event) {
+                if (!self->exception) {
+                    //  stayin alive
+                    if (fmq_client_verbose)
+                        zsys_debug ("%s:         $ stayin alive", self->log_prefix);
+                    stayin_alive (&self->client);
+                }
+                if (!self->exception) {
+                    //  resync the inbox
+                    if (fmq_client_verbose)
+                        zsys_debug ("%s:         $ resync the inbox", self->log_prefix);
+                    resync_the_inbox (&self->client);
+                }
             } else if (self->event == destructor_event) {
                 if (!self->exception) {
                     //  send KTHXBAI
@@ -1170,6 +1405,9 @@ connect_to_server_endpoint(tch_client_t *self)
     if (zsock_connect(self->dealer, "%s", self->args->endpoint)) {
         engine_set_exception(self, connect_error_event);
         zsys_warning("could not connect to %s", self->args->endpoint);
+    } else {
+        zstr_free(&self->endpoint);
+        self->endpoint = strdup(self->args->endpoint);
     }
 }
 
@@ -1193,6 +1431,16 @@ static void
 stayin_alive(tch_client_t *self)
 {
     self->timeouts = 0;
+
+    //  Replies to ICANHAZ and HUGZ give us the round trip time
+    if (self->ping_at
+    && (fmq_msg_id(self->message) == FMQ_MSG_ICANHAZ_OK
+    ||  fmq_msg_id(self->message) == FMQ_MSG_HUGZ_OK)) {
+        int64_t rtt = zclock_usecs() - self->ping_at;
+        if (self->rtt == 0 || rtt < self->rtt)
+            self->rtt = rtt > 0? rtt: 1;
+        self->ping_at = 0;
+    }
 }
 
 /* log_access_denied */
@@ -1295,6 +1543,36 @@ format_icanhaz_command(tch_client_t *self)
     free (path);
 
     fmq_msg_set_path(self->message, self->sub->path);
+    zhash_t *options = collect_inbox_options(self);
+    streams_open(self, options);
+
+    //  Digest of our tree lets the server tell straight away if we're
+    //  up to date, and else walk down to what changed
+    zhash_t *cache = collect_inbox_cache(self);
+    fmq_manifest_destroy(&self->manifest);
+    self->manifest = fmq_manifest_new();
+    bool slashed = self->sub->path [strlen(self->sub->path) - 1] == '/';
+    const char *digest = cache? (const char *) zhash_first(cache): NULL;
+    while (digest) {
+        char *vpath = zsys_sprintf("%s%s%s", self->sub->path,
+                                   slashed? "": "/", zhash_cursor(cache));
+        fmq_manifest_add(self->manifest, vpath, digest);
+        zstr_free(&vpath);
+        digest = (const char *) zhash_next(cache);
+    }
+    fmq_manifest_seal(self->manifest);
+    char *vdir = zsys_sprintf("%s%s", self->sub->path, slashed? "": "/");
+    digest = fmq_manifest_digest(self->manifest, vdir);
+    zhash_update(options, "merkle", (void *) (digest? digest: ""));
+    zstr_free(&vdir);
+
+    fmq_msg_set_options(self->message, &options);
+    //  Server that can't walk its manifest with us asks for the cache
+    //  instead, so we send it up front only for dedupe
+    if (self->dedupe && cache)
+        fmq_msg_set_cache(self->message, &cache);
+    zhash_destroy(&cache);
+    self->ping_at = zclock_usecs();
 }
 
 static tch_sub_t *
@@ -1329,6 +1607,8 @@ handle_connected_timeout(tch_client_t *self)
         self->timeouts++;
     else
         engine_set_next_event(self, bombmsg_event);
+    self->ping_at = zclock_usecs();
+    streams_keepalive(self, true);
 }
 
 /* signal_subscribe_success */
@@ -1336,15 +1616,9 @@ static void
 signal_subscribe_success(tch_client_t *self)
 {
     zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
-    }
-    if (credit_to_send) {
-        fmq_msg_set_credit (self->message, credit_to_send);
-        engine_set_next_event (self, send_credit_event);
-    }
+    self->subscribed = true;
+    streams_join (self);
+    refill_credit_as_needed (self);
 }
 
 /* handle_subscribe_timeout */
@@ -1363,11 +1637,195 @@ handle_subscribe_timeout(tch_client_t *self)
 static void
 process_the_patch(tch_client_t *self)
 {
-    const char *filename = fmq_msg_filename(self->message);
+    const char *filename = inbox_filename(self, fmq_msg_filename(self->message));
+    if (!filename)
+        return;
+
+    //  Server may set a big file aside to send more urgent ones first,
+    //  and come back to it later
+    if (self->filename && !streq(self->filename, filename))
+        file_park(self);
+
+    //  Server starting over on a file we gave up on sends it afresh
+    if (self->failed && streq(self->failed, filename)
+    &&  fmq_msg_offset(self->message) == 0)
+        zstr_free(&self->failed);
+
+    zhash_t *headers = fmq_msg_headers(self->message);
+    if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_CREATE
+    &&  self->failed && streq(self->failed, filename)) {
+        //  Swallow the rest of it, up to its end
+        self->credit -= zchunk_size(fmq_msg_chunk(self->message));
+        writer_sync(self);
+        self->acked = fmq_msg_sequence(self->message);
+        if (zchunk_size(fmq_msg_chunk(self->message)) == 0)
+            zstr_free(&self->failed);
+    } else
+    if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_CREATE
+    &&  headers && zhash_lookup(headers, "source")) {
+        //  We have this content already, under another name
+        writer_sync(self);
+        self->acked = fmq_msg_sequence(self->message);
+        process_the_copy(self, filename);
+    } else
+    if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_CREATE
+    &&  headers && zhash_lookup(headers, "stripe")) {
+        //  Large file coming over all our streams
+        self->credit -= process_the_stripe(self, self->message, filename);
+        self->acked = fmq_msg_sequence(self->message);
+        streams_keepalive(self, false);
+    } else
+    if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_CREATE) {
+        if (self->file == NULL)
+            file_unpark(self, filename);
+        if (self->file == NULL) {
+            //zsys_debug("creating file object for %s/%s", self->inbox, filename);
+            self->file = inbox_temp_open(self, filename, fmq_msg_offset(self->message) == 0);
+            if (!self->file)
+                return;             //  File not writeable, skip patch
+            self->filename = strdup(filename);
+            journal_open(self, filename);
+            const char *size = headers? (const char *) zhash_lookup(headers, "size"): NULL;
+            if (size)
+                file_preallocate(self->file, strtoull(size, NULL, 10));
+        }
+        //  Writer writes the chunk, and journals it once it's written,
+        //  while we carry on taking in data; we acknowledge the chunk and
+        //  reuse its credit when the writer hands it back
+        tch_write_t *job = (tch_write_t *) zmalloc(sizeof(tch_write_t));
+        job->file = self->file;
+        job->journal = self->journal;
+        job->offset = fmq_msg_offset(self->message);
+        job->sequence = fmq_msg_sequence(self->message);
+        size_t size = zchunk_size(fmq_msg_chunk(self->message));
+        if (size > 0) {
+            //zsys_debug("writing chunk at offset %u of %s/%s",fmq_msg_offset(self->message), self->inbox, filename);
+            job->chunk = fmq_msg_get_chunk(self->message);
+            self->credit -= size;
+            measure_throughput(self, size);
+            //  Packed chunk cost us its packed size in credit, but the
+            //  writer holds it unpacked
+            const char *codec = headers? (const char *) zhash_lookup(headers, "codec"): NULL;
+            if (codec) {
+                //  Server packs no more than our window at a time
+                const char *raw = (const char *) zhash_lookup(headers, "raw");
+                unsigned long long raw_size = raw? strtoull(raw, NULL, 10): 0;
+                zchunk_t *chunk = raw_size <= self->window_max?
+                    fmq_msg_unpack(codec, job->chunk, (size_t) raw_size): NULL;
+                zchunk_destroy(&job->chunk);
+                if (!chunk) {
+                    zsys_warning("unable to unpack chunk of %s/%s, dropping it",
+                                 self->inbox, filename);
+                    free(job);
+                    file_fail(self, filename);
+                    return;
+                }
+                job->chunk = chunk;
+            }
+            self->queued += zchunk_size(job->chunk);
+        } else {
+            //  Zero-sized chunk means end of file; we report it back to
+            //  the caller once every chunk before it is written
+            //zsys_debug("file complete %s/%s", self->inbox, filename);
+            job->journal_name = self->journal_name;
+            job->filename = strdup(filename);
+            job->target = zsys_sprintf("%s/%s", self->inbox, filename);
+            self->file = NULL;
+            self->journal = NULL;
+            self->journal_name = NULL;
+            zstr_free(&self->filename);
+        }
+        writer_post(self, job);
+    } else if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_DELETE) {
+        writer_sync(self);
+        self->acked = fmq_msg_sequence(self->message);
+        tch_stripe_t *parked = (tch_stripe_t *) zhash_lookup(self->parked, filename);
+        if (parked) {
+            zhash_delete(self->parked, filename);
+            stripe_destroy(&parked);
+        }
+        zsys_debug("delete %s/%s", self->inbox, filename);
+        zfile_t *file = zfile_new(self->inbox, filename);
+        zfile_remove(file);
+        zfile_destroy(&file);
+
+        //  Report file deletion back to caller
+        //  Notify the caller of deletion
+        zsock_send(self->msgpipe, "sss", "FILE DELETED", self->inbox, filename);
+    } else if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_DELTA) {
+        writer_sync(self);
+        self->acked = fmq_msg_sequence(self->message);
+        process_the_delta(self, filename);
+    } else if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_BATCH)
+        process_the_batch(self);
+}
+
+/* Give up on file we're receiving: it doesn't go in our inbox, and we
+ * swallow whatever is left of it */
+static void
+file_fail(tch_client_t *self, const char *filename)
+{
+    writer_sync(self);
+    self->acked = fmq_msg_sequence(self->message);
+    journal_close(self, true);
+    zfile_remove(self->file);
+    zfile_destroy(&self->file);
+    zstr_free(&self->filename);
+    zstr_free(&self->failed);
+    self->failed = strdup(filename);
+}
+
+/* Server packed small files into one chunk, each of them whole, so each
+ * goes to the writer as its data and its end of file together */
+static void
+process_the_batch(tch_client_t *self)
+{
+    zchunk_t *batch = fmq_msg_chunk(self->message);
+    self->credit -= zchunk_size(batch);
+    measure_throughput(self, zchunk_size(batch));
+
+    bool posted = false;
+    size_t offset = 0;
+    char *vpath;
+    const byte *data;
+    size_t size;
+    while (fmq_msg_batch_next(batch, &offset, &vpath, &data, &size)) {
+        const char *filename = inbox_filename(self, vpath);
+        zfile_t *file = filename? inbox_temp_open(self, filename, true): NULL;
+        if (file) {
+            if (size > 0) {
+                tch_write_t *job = (tch_write_t *) zmalloc(sizeof(tch_write_t));
+                job->file = file;
+                job->sequence = fmq_msg_sequence(self->message);
+                job->chunk = zchunk_new(data, size);
+                self->queued += size;
+                writer_post(self, job);
+            }
+            tch_write_t *job = (tch_write_t *) zmalloc(sizeof(tch_write_t));
+            job->file = file;
+            job->offset = size;
+            job->sequence = fmq_msg_sequence(self->message);
+            job->filename = strdup(filename);
+            job->target = zsys_sprintf("%s/%s", self->inbox, filename);
+            writer_post(self, job);
+            posted = true;
+        }
+        zstr_free(&vpath);
+    }
+    if (!posted) {
+        writer_sync(self);
+        self->acked = fmq_msg_sequence(self->message);
+    }
+}
 
+/* Name of file in our inbox, from its path on the server, or NULL if
+ * it's not under any of our subscriptions */
+static const char *
+inbox_filename(tch_client_t *self, const char *filename)
+{
     if (*filename != '/') {
         zsys_error("filename did not start with a \'/\'");
-        return;
+        return NULL;
     }
 
     tch_sub_t *substr = (tch_sub_t *)zlist_first(self->subs);
@@ -1383,61 +1841,1347 @@ process_the_patch(tch_client_t *self)
     }
     if (!found) {
         zsys_debug("subscription not found for %s", filename);
-        return;
+        return NULL;
     }
 
     if ('/' == *filename) filename++;
+    return filename;
+}
 
-    if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_CREATE) {
-        if (self->file == NULL) {
-            //zsys_debug("creating file object for %s/%s", self->inbox, filename);
-            self->file = zfile_new(self->inbox, filename);
-            if (zfile_output(self->file)) {
-                zsys_warning("unable to write to file %s/%s", self->inbox, filename);
-                //  File not writeable, skip patch
-                zfile_destroy(&self->file);
-                return;
+/* Write chunk of file the server stripes over our streams. Chunks come
+ * in any order, and the end of file may beat the last of them, so we
+ * count bytes until we have as many as the server says it sent. Returns
+ * the bytes of credit the chunk used. */
+static size_t
+process_the_stripe(tch_client_t *self, fmq_msg_t *message, const char *filename)
+{
+    zhash_t *headers = fmq_msg_headers(message);
+    tch_stripe_t *stripe = (tch_stripe_t *) zhash_lookup(self->stripes, filename);
+    if (!stripe) {
+        stripe = (tch_stripe_t *) zmalloc(sizeof(tch_stripe_t));
+        const char *start = (const char *) zhash_lookup(headers, "stripe");
+        bool fresh = !start || atoll(start) == 0;
+        //  If we can't write the file, we swallow the rest of it
+        stripe->file = inbox_temp_open(self, filename, fresh);
+        if (stripe->file) {
+            const char *digest = (const char *) zhash_lookup(headers, "digest");
+            if (digest) {
+                stripe->journal_name = zsys_sprintf("%s/%s" JOURNAL_SUFFIX, self->inbox, filename);
+                stripe->journal = journal_start(stripe->file, stripe->journal_name,
+                                                digest, fresh);
+                if (!stripe->journal)
+                    zstr_free(&stripe->journal_name);
             }
+            const char *size = (const char *) zhash_lookup(headers, "size");
+            if (size)
+                file_preallocate(stripe->file, strtoull(size, NULL, 10));
         }
-        //  Try to write, ignore errors in this version
-        zchunk_t *chunk = fmq_msg_chunk(self->message);
-        if (zchunk_size(chunk) > 0) {
-            //zsys_debug("writing chunk at offset %u of %s/%s",fmq_msg_offset(self->message), self->inbox, filename);
-            zfile_write(self->file, chunk, fmq_msg_offset(self->message));
-            self->credit -= zchunk_size(chunk);
-        } else {
-            //  Zero-sized chunk means end of file, so report back to caller
-            //  Communicate back to caller via the msgpipe
-            //zsys_debug("file complete %s/%s", self->inbox, filename);
-            zsock_send(self->msgpipe, "sss", "FILE UPDATED", self->inbox, filename);
+        zhash_insert(self->stripes, filename, stripe);
+    }
+    zchunk_t *chunk = fmq_msg_chunk(message);
+    size_t size = zchunk_size(chunk);
+    if (fmq_msg_eof(message)) {
+        const char *bytes = (const char *) zhash_lookup(headers, "bytes");
+        stripe->expected = bytes? strtoull(bytes, NULL, 10): stripe->received;
+        stripe->eof = true;
+    } else if (size > 0) {
+        if (stripe->file) {
+            zfile_write(stripe->file, chunk, (off_t) fmq_msg_offset(message));
+            //  Journal ranges only once they're on disk, and sync now and
+            //  then rather than for every chunk
+            if (stripe->journal) {
+                if (!stripe->unsynced) {
+                    stripe->unsynced = zlist_new();
+                    zlist_autofree(stripe->unsynced);
+                }
+                char *range = zsys_sprintf("%llu %zu",
+                    (unsigned long long) fmq_msg_offset(message), size);
+                zlist_append(stripe->unsynced, range);
+                zstr_free(&range);
+                stripe->unsynced_bytes += size;
+                if (stripe->unsynced_bytes >= STRIPE_SYNC)
+                    stripe_sync(stripe);
+            }
+        }
+        stripe->received += size;
+        measure_throughput(self, size);
+    }
+    if (stripe->eof && stripe->received >= stripe->expected) {
+        if (stripe->file) {
+            if (stripe->journal) {
+                fclose(stripe->journal);
+                stripe->journal = NULL;
+                remove(stripe->journal_name);
+            }
+            writer_sync(self);
+            char *target = zsys_sprintf("%s/%s", self->inbox, filename);
+            if (file_commit(stripe->file, target) == 0)
+                zsock_send(self->msgpipe, "sss", "FILE UPDATED", self->inbox, filename);
+            zstr_free(&target);
+        }
+        stripe_destroy(&stripe);
+        zhash_delete(self->stripes, filename);
+    }
+    return size;
+}
+
+/* Set the file we're writing aside, with its journal, until the server
+ * comes back to it */
+static void
+file_park(tch_client_t *self)
+{
+    tch_stripe_t *parked = (tch_stripe_t *) zmalloc(sizeof(tch_stripe_t));
+    parked->file = self->file;
+    parked->journal = self->journal;
+    parked->journal_name = self->journal_name;
+    zhash_update(self->parked, self->filename, parked);
+    self->file = NULL;
+    self->journal = NULL;
+    self->journal_name = NULL;
+    zstr_free(&self->filename);
+}
+
+/* Carry on writing a file we set aside. If the server starts the file
+ * over, it's sending a newer version, so we start over too */
+static void
+file_unpark(tch_client_t *self, const char *filename)
+{
+    tch_stripe_t *parked = (tch_stripe_t *) zhash_lookup(self->parked, filename);
+    if (!parked)
+        return;
+    zhash_delete(self->parked, filename);
+    if (fmq_msg_offset(self->message) > 0) {
+        self->file = parked->file;
+        self->journal = parked->journal;
+        self->journal_name = parked->journal_name;
+        self->filename = strdup(filename);
+        free(parked);
+    } else {
+        //  Writer may still have chunks of it
+        writer_sync(self);
+        stripe_destroy(&parked);
+    }
+}
+
+/* Destroy stripe; keeps its journal, with what we wrote of it synced,
+ * unless we removed it already */
+static void
+stripe_destroy(tch_stripe_t **self_p)
+{
+    assert(self_p);
+    if (*self_p) {
+        tch_stripe_t *self = *self_p;
+        if (self->journal) {
+            if (self->unsynced)
+                stripe_sync(self);
+            fclose(self->journal);
+        }
+        zstr_free(&self->journal_name);
+        zstr_free(&self->digest);
+        zlist_destroy(&self->unsynced);
+        zlist_destroy(&self->sources);
+        zfile_destroy(&self->file);
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+/* Put what we wrote of striped file on disk, then journal it. A range in
+ * the journal must be on disk, or after a crash we'd resume past data
+ * that never made it */
+static void
+stripe_sync(tch_stripe_t *self)
+{
+    fflush(zfile_handle(self->file));
+    if (fdatasync(fileno(zfile_handle(self->file))))
+        return;                 //  Not on disk, so not in the journal
+    char *range;
+    while ((range = (char *) zlist_pop(self->unsynced))) {
+        fprintf(self->journal, "%s\n", range);
+        free(range);
+    }
+    fflush(self->journal);
+    self->unsynced_bytes = 0;
+}
+
+/* Rebuild file in place from delta: literal data, and block ranges to
+ * copy forward from our own copy. Ranges that didn't move aren't sent.
+ * At the end we cut the file to size and check we got the server's
+ * version; if not, our copy wasn't what we said, so drop it and get the
+ * whole file next time. */
+static void
+process_the_delta(tch_client_t *self, const char *filename)
+{
+    zhash_t *headers = fmq_msg_headers(self->message);
+    if (self->file == NULL) {
+        //  Delta may be against another of our files; start from a copy
+        const char *source = headers? (const char *) zhash_lookup(headers, "source"): NULL;
+        source = source? inbox_filename(self, source): NULL;
+        if (source && inbox_clone(self, source, filename))
+            zsys_warning("unable to copy %s/%s to %s", self->inbox, source, filename);
+        self->file = zfile_new(self->inbox, filename);
+        if (zfile_output(self->file)) {
+            zsys_warning("unable to write to file %s/%s", self->inbox, filename);
             zfile_destroy(&self->file);
+            return;
         }
-    } else if (fmq_msg_operation(self->message) == FMQ_MSG_FILE_DELETE) {
-        zsys_debug("delete %s/%s", self->inbox, filename);
+    }
+    zchunk_t *chunk = fmq_msg_chunk(self->message);
+    const char *copy = headers? (const char *) zhash_lookup(headers, "copy"): NULL;
+    uint64_t offset = fmq_msg_offset(self->message);
+
+    if (fmq_msg_eof(self->message)) {
+        const char *size = headers? (const char *) zhash_lookup(headers, "size"): NULL;
+        const char *digest = headers? (const char *) zhash_lookup(headers, "digest"): NULL;
+        FILE *handle = zfile_handle(self->file);
+        fflush(handle);
+        if (size && ftruncate(fileno(handle), (off_t) atoll(size)))
+            zsys_warning("unable to truncate %s/%s", self->inbox, filename);
+        zfile_destroy(&self->file);
+
         zfile_t *file = zfile_new(self->inbox, filename);
-        zfile_remove(file);
+        const char *actual = zfile_digest(file);
+        if (digest && (!actual || !streq(actual, digest))) {
+            zsys_warning("delta for %s/%s went wrong, fetching it whole", self->inbox, filename);
+            zfile_remove(file);
+            zsock_send(self->msgpipe, "sss", "FILE DELETED", self->inbox, filename);
+            server_refetch(self, fmq_msg_filename(self->message));
+        } else
+            zsock_send(self->msgpipe, "sss", "FILE UPDATED", self->inbox, filename);
         zfile_destroy(&file);
+    } else if (copy) {
+        //  Blocks only move forward, so copying front to back never reads
+        //  what we've just written
+        unsigned long long source, size, done;
+        if (sscanf(copy, "%llu %llu", &source, &size) != 2)
+            return;
+        for (done = 0; done < size; done += CREDIT_SLICE) {
+            size_t bytes = size - done < CREDIT_SLICE? (size_t) (size - done): CREDIT_SLICE;
+            zchunk_t *data = zfile_read(self->file, bytes, (off_t) (source + done));
+            if (data)
+                zfile_write(self->file, data, (off_t) (offset + done));
+            zchunk_destroy(&data);
+        }
+    } else if (zchunk_size(chunk) > 0) {
+        zfile_write(self->file, chunk, (off_t) offset);
+        self->credit -= zchunk_size(chunk);
+        measure_throughput(self, zchunk_size(chunk));
+    }
+}
 
-        //  Report file deletion back to caller
-        //  Notify the caller of deletion
-        zsock_send(self->msgpipe, "sss", "FILE DELETED", self->inbox, filename);
+/* Ask server for file again, whole: we don't have a good copy, so it
+ * forgets what it thought we held. This is a resync probe fetching it */
+static void
+server_refetch(tch_client_t *self, const char *vpath)
+{
+    fmq_msg_t *probe = fmq_msg_new();
+    zhash_t *options = zhash_new();
+    zhash_autofree(options);
+    zhash_insert(options, "resync", "1");
+    zhash_insert(options, "fetch/1", (void *) vpath);
+    fmq_msg_set_id(probe, FMQ_MSG_ICANHAZ);
+    fmq_msg_set_path(probe, "");
+    fmq_msg_set_options(probe, &options);
+    fmq_msg_send(probe, self->dealer);
+    fmq_msg_destroy(&probe);
+}
+
+/* Start fetching a file from several peers that hold it, a range from
+ * each; sources are "endpoint vpath" lines. Result goes to the caller
+ * as FILE UPDATED, or FILE DELETED if we couldn't get the file whole */
+static void
+swarm_start(tch_client_t *self, const char *filename, const char *digest,
+            uint64_t size, const char *sources)
+{
+    if (!self->inbox || zhash_lookup(self->stripes, filename)) {
+        zsys_warning("can't start swarm download of %s", filename);
+        zsock_send(self->msgpipe, "sss", "FILE DELETED", self->inbox? self->inbox: "", filename);
+        return;
+    }
+    tch_stripe_t *stripe = (tch_stripe_t *) zmalloc(sizeof(tch_stripe_t));
+    stripe->digest = strdup(digest);
+    stripe->expected = size;
+    stripe->eof = true;
+    stripe->sources = zlist_new();
+    zlist_autofree(stripe->sources);
+    const char *line = sources;
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        size_t length = end? (size_t) (end - line): strlen(line);
+        if (length) {
+            char *source = zsys_sprintf("%.*s", (int) length, line);
+            zlist_append(stripe->sources, source);
+            zstr_free(&source);
+        }
+        line += end? length + 1: length;
+    }
+    stripe->file = inbox_temp_open(self, filename, true);
+    zhash_insert(self->stripes, filename, stripe);
+    if (stripe->file)
+        file_preallocate(stripe->file, size);
+    if (zlist_size(stripe->sources) == 0 || !stripe->file
+    ||  ftruncate(fileno(zfile_handle(stripe->file)), (off_t) size)) {
+        zsys_warning("unable to swarm download %s/%s", self->inbox, filename);
+        swarm_finish(self, filename, false);
+        return;
+    }
+    //  Split file into one range per source, on credit slices
+    uint32_t count = (uint32_t) zlist_size(stripe->sources);
+    uint64_t share = (size / count + CREDIT_SLICE - 1) / CREDIT_SLICE * CREDIT_SLICE;
+    if (share == 0)
+        share = CREDIT_SLICE;
+    uint64_t start;
+    uint32_t source = 0;
+    for (start = 0; start < size; start += share, source++)
+        swarm_stream_open(self, filename, source, start,
+                          start + share < size? start + share: size, 0);
+    swarm_check(self, filename);
+}
+
+/* Open swarm stream to fetch range of file from the given source, or
+ * failing that the ones after it. Once every source has had its turn
+ * at the range, the download fails. */
+static void
+swarm_stream_open(tch_client_t *self, const char *filename, uint32_t source,
+                  uint64_t start, uint64_t end, uint32_t tries)
+{
+    tch_stripe_t *stripe = (tch_stripe_t *) zhash_lookup(self->stripes, filename);
+    if (!stripe)
+        return;
+    uint32_t count = (uint32_t) zlist_size(stripe->sources);
+    for (source %= count; tries < count; tries++, source = (source + 1) % count) {
+        const char *line = (const char *) zlist_first(stripe->sources);
+        uint32_t index;
+        for (index = 0; index < source; index++)
+            line = (const char *) zlist_next(stripe->sources);
+        const char *vpath = strchr(line, ' ');
+        if (!vpath)
+            continue;
+        char *endpoint = zsys_sprintf("%.*s", (int) (vpath - line), line);
+        tch_stream_t *stream = (tch_stream_t *) zmalloc(sizeof(tch_stream_t));
+        stream->dealer = zsock_new(ZMQ_DEALER);
+        stream->message = fmq_msg_new();
+        if (!stream->dealer || !stream->message
+        ||  zsock_connect(stream->dealer, "%s", endpoint)) {
+            zsys_warning("could not open swarm stream to %s", endpoint);
+            zstr_free(&endpoint);
+            stream_destroy(&stream);
+            continue;
+        }
+        zstr_free(&endpoint);
+        stream->filename = strdup(filename);
+        stream->vpath = strdup(vpath + 1);
+        stream->range_start = start;
+        stream->range_end = end;
+        stream->source = source;
+        stream->tries = tries;
+        engine_handle_socket(self, stream->dealer, s_client_handle_swarm);
+        fmq_msg_set_id(stream->message, FMQ_MSG_OHAI);
+        fmq_msg_send(stream->message, stream->dealer);
+        stream->sent_at = stream->heard_at = zclock_mono();
+        zlist_append(self->swarm, stream);
+        if (!self->swarm_timer)
+            self->swarm_timer = zloop_timer(((tch_s_client_t *) self)->loop,
+                                            SWARM_CHECK, 0, s_client_handle_swarm_timer, self);
+        return;
+    }
+    zsys_warning("no source left for %s", filename);
+    swarm_finish(self, filename, false);
+}
+
+/* Say goodbye on swarm stream and close it */
+static void
+swarm_stream_close(tch_client_t *self, tch_stream_t *stream)
+{
+    zlist_remove(self->swarm, stream);
+    if (stream->connected) {
+        fmq_msg_set_id(stream->message, FMQ_MSG_KTHXBAI);
+        fmq_msg_send(stream->message, stream->dealer);
+    }
+    engine_handle_socket(self, stream->dealer, NULL);
+    stream_destroy(&stream);
+    if (zlist_size(self->swarm) == 0 && self->swarm_timer) {
+        zloop_timer_end(((tch_s_client_t *) self)->loop, self->swarm_timer);
+        self->swarm_timer = 0;
+    }
+}
+
+/* Give up on stream's source, and fetch what's left of its range from
+ * the next one */
+static void
+swarm_retry(tch_client_t *self, tch_stream_t *stream)
+{
+    char *filename = strdup(stream->filename);
+    uint32_t source = stream->source + 1;
+    uint32_t tries = stream->tries + 1;
+    uint64_t start = stream->range_start + stream->range_got;
+    uint64_t end = stream->range_end;
+    swarm_stream_close(self, stream);
+    if (start < end)
+        swarm_stream_open(self, filename, source, start, end, tries);
+    else
+        swarm_check(self, filename);
+    zstr_free(&filename);
+}
+
+/* Finish swarm download once none of its streams are left */
+static void
+swarm_check(tch_client_t *self, const char *filename)
+{
+    tch_stripe_t *stripe = (tch_stripe_t *) zhash_lookup(self->stripes, filename);
+    if (!stripe)
+        return;
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->swarm);
+    while (stream) {
+        if (streq(stream->filename, filename))
+            return;
+        stream = (tch_stream_t *) zlist_next(self->swarm);
+    }
+    swarm_finish(self, filename, stripe->received >= stripe->expected);
+}
+
+/* End swarm download. A complete file must match the digest its holders
+ * told us before it goes into the inbox; else we throw it away, leave
+ * any older copy alone, and tell the caller with FILE DELETED */
+static void
+swarm_finish(tch_client_t *self, const char *filename, bool complete)
+{
+    char *name = strdup(filename);
+    tch_stripe_t *stripe = (tch_stripe_t *) zhash_lookup(self->stripes, name);
+    assert(stripe);
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->swarm);
+    while (stream) {
+        if (streq(stream->filename, name)) {
+            swarm_stream_close(self, stream);
+            stream = (tch_stream_t *) zlist_first(self->swarm);
+        } else
+            stream = (tch_stream_t *) zlist_next(self->swarm);
+    }
+    writer_sync(self);
+    if (stripe->file) {
+        zfile_close(stripe->file);
+        if (complete) {
+            const char *digest = zfile_digest(stripe->file);
+            complete = digest && streq(digest, stripe->digest);
+            if (!complete)
+                zsys_warning("swarm download of %s/%s has wrong digest", self->inbox, name);
+        }
+        char *target = zsys_sprintf("%s/%s", self->inbox, name);
+        if (complete)
+            complete = file_commit(stripe->file, target) == 0;
+        else
+            zfile_remove(stripe->file);
+        zstr_free(&target);
+    } else
+        complete = false;
+    zsock_send(self->msgpipe, "sss", complete? "FILE UPDATED": "FILE DELETED", self->inbox, name);
+    zhash_delete(self->stripes, name);
+    stripe_destroy(&stripe);
+    zstr_free(&name);
+}
+
+/* Hand job to the disk writer, starting it on first use */
+static void
+writer_post(tch_client_t *self, tch_write_t *job)
+{
+    if (!self->writer) {
+        self->writer = zactor_new(s_writer, NULL);
+        assert(self->writer);
+        self->nom = fmq_msg_new();
+        engine_handle_socket(self, (zsock_t *) self->writer, s_client_handle_writer);
+    }
+    zsock_send(self->writer, "sp", "JOB", job);
+    self->writes++;
+}
+
+/* Writer handed back a job. Jobs come back in the order we posted them,
+ * so at the end of a file, every chunk of it is written */
+static void
+writer_done(tch_client_t *self, tch_write_t *job)
+{
+    self->writes--;
+    self->acked = job->sequence;
+    if (job->chunk) {
+        self->queued -= zchunk_size(job->chunk);
+        if (job->failed)
+            zsys_warning("unable to write to file %s", zfile_filename(job->file, NULL));
+        zchunk_destroy(&job->chunk);
+    } else {
+        if (job->failed)
+            zsys_warning("unable to finish file %s", job->target);
+        else
+            zsock_send(self->msgpipe, "sss", "FILE UPDATED", self->inbox, job->filename);
+        zfile_destroy(&job->file);
+        zstr_free(&job->journal_name);
+        zstr_free(&job->filename);
+        zstr_free(&job->target);
+    }
+    free(job);
+}
+
+/* Wait for the writer to hand back every job we gave it */
+static void
+writer_sync(tch_client_t *self)
+{
+    while (self->writes) {
+        tch_write_t *job;
+        if (zsock_recv(self->writer, "p", &job) || !job)
+            break;              //  Interrupted
+        writer_done(self, job);
+    }
+}
+
+/* Credit the writer frees goes back to the server as soon as there's
+ * enough of it, without waiting for the next chunk */
+static void
+writer_refill(tch_client_t *self)
+{
+    if (!self->subscribed
+    ||  self->credit + self->queued + self->window / 4 > self->window)
+        return;
+    fmq_msg_set_id(self->nom, FMQ_MSG_NOM);
+    fmq_msg_set_credit(self->nom, self->window - self->credit - self->queued);
+    fmq_msg_set_sequence(self->nom, self->acked);
+    fmq_msg_send(self->nom, self->dealer);
+    self->credit = self->window - self->queued;
+}
+
+/* Write a run of adjacent chunks, carrying on from where a short write
+ * stopped. Returns 0 if every byte got written, else -1 */
+static int
+writer_run(int handle, struct iovec *iov, int count, off_t offset, size_t done)
+{
+    int index;
+    for (index = 0; index < count; index++) {
+        size_t size = iov [index].iov_len;
+        if (done >= size) {
+            done -= size;
+            offset += size;
+            continue;
+        }
+        while (done < size) {
+            ssize_t rc = pwrite(handle, (byte *) iov [index].iov_base + done,
+                                size - done, offset + done);
+            if (rc <= 0)
+                return -1;
+            done += (size_t) rc;
+        }
+        offset += size;
+        done = 0;
+    }
+    return 0;
+}
+
+/* Write chunks, one call per run of adjacent chunks of a file. With
+ * io_uring we submit every run at once; otherwise, or for whatever it
+ * leaves short, we write each run with pwritev. Then we journal what
+ * got written. */
+static void
+writer_write(tch_write_t **jobs, size_t count, void *ring)
+{
+    if (count == 0)
+        return;
+    struct iovec iov [WRITER_BATCH];
+    size_t runs [WRITER_BATCH + 1];
+    size_t done [WRITER_BATCH];
+    size_t run_count = 0;
+    size_t index;
+    for (index = 0; index < count; index++) {
+        iov [index].iov_base = zchunk_data(jobs [index]->chunk);
+        iov [index].iov_len = zchunk_size(jobs [index]->chunk);
+        if (index == 0
+        ||  jobs [index]->file != jobs [index - 1]->file
+        ||  jobs [index]->offset != jobs [index - 1]->offset + iov [index - 1].iov_len)
+            runs [run_count++] = index;
+    }
+    runs [run_count] = count;
+
+    size_t run;
+    for (run = 0; run < run_count; run++)
+        done [run] = 0;
+#if (TCH_HAVE_IO_URING)
+    if (ring) {
+        for (run = 0; run < run_count; run++) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe((struct io_uring *) ring);
+            tch_write_t *job = jobs [runs [run]];
+            io_uring_prep_writev(sqe, fileno(zfile_handle(job->file)), iov + runs [run],
+                                 (unsigned) (runs [run + 1] - runs [run]), job->offset);
+            io_uring_sqe_set_data(sqe, (void *) (uintptr_t) run);
+        }
+        io_uring_submit_and_wait((struct io_uring *) ring, (unsigned) run_count);
+        for (run = 0; run < run_count; run++) {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe((struct io_uring *) ring, &cqe))
+                break;
+            if (cqe->res > 0)
+                done [(uintptr_t) io_uring_cqe_get_data(cqe)] = (size_t) cqe->res;
+            io_uring_cqe_seen((struct io_uring *) ring, cqe);
+        }
+    }
+#endif
+    for (run = 0; run < run_count; run++) {
+        tch_write_t *job = jobs [runs [run]];
+        int handle = fileno(zfile_handle(job->file));
+        int chunks = (int) (runs [run + 1] - runs [run]);
+        if (done [run] == 0 && !ring) {
+            ssize_t rc = pwritev(handle, iov + runs [run], chunks, (off_t) job->offset);
+            done [run] = rc > 0? (size_t) rc: 0;
+        }
+        if (writer_run(handle, iov + runs [run], chunks, (off_t) job->offset, done [run])) {
+            for (index = runs [run]; index < runs [run + 1]; index++)
+                jobs [index]->failed = true;
+        }
+    }
+    //  Journal ranges only once they're on disk, syncing each file once
+    zfile_t *synced = NULL;
+    bool unsynced = false;
+    for (run = 0; run < run_count; run++) {
+        tch_write_t *job = jobs [runs [run]];
+        if (!job->journal)
+            continue;
+        if (job->file != synced) {
+            unsynced = fdatasync(fileno(zfile_handle(job->file))) != 0;
+            synced = job->file;
+        }
+        for (index = runs [run]; index < runs [run + 1]; index++)
+            jobs [index]->unsynced = unsynced;
+    }
+    for (index = 0; index < count; index++) {
+        tch_write_t *job = jobs [index];
+        if (job->journal && !job->failed && !job->unsynced)
+            fprintf(job->journal, "%llu %zu\n",
+                    (unsigned long long) job->offset, zchunk_size(job->chunk));
+        if (job->journal && (index + 1 == count || jobs [index + 1]->journal != job->journal))
+            fflush(job->journal);
+    }
+}
+
+/* Finish file: it's whole, so its journal goes, and it takes its place
+ * in the inbox. We cut off whatever we allocated beyond its end. */
+static void
+writer_finish(tch_write_t *job)
+{
+    if (ftruncate(fileno(zfile_handle(job->file)), (off_t) job->offset))
+        job->failed = true;
+    if (job->journal) {
+        fclose(job->journal);
+        job->journal = NULL;
+        remove(job->journal_name);
+    }
+    if (file_commit(job->file, job->target))
+        job->failed = true;
+}
+
+/* Disk writer: writes chunks so the client never waits on the disk. It
+ * takes every job that's waiting, up to a batch, writes them, and hands
+ * each back in order */
+static void
+s_writer(zsock_t *pipe, void *args)
+{
+    void *ring = NULL;
+#if (TCH_HAVE_IO_URING)
+    struct io_uring uring;
+    if (io_uring_queue_init(WRITER_BATCH, &uring, 0) == 0)
+        ring = &uring;
+#endif
+    zsock_signal(pipe, 0);
+    tch_write_t *jobs [WRITER_BATCH];
+    bool terminated = false;
+    while (!terminated) {
+        size_t count = 0;
+        while (count < WRITER_BATCH
+        &&    (count == 0 || (zsock_events(pipe) & ZMQ_POLLIN))) {
+            char *command = NULL;
+            tch_write_t *job = NULL;
+            if (zsock_recv(pipe, "sp", &command, &job)) {
+                terminated = true;      //  Interrupted
+                break;
+            }
+            terminated = streq(command, "$TERM");
+            zstr_free(&command);
+            if (terminated)
+                break;
+            jobs [count++] = job;
+        }
+        //  Write the chunks before each end of file, then finish it
+        size_t start = 0, index;
+        for (index = 0; index < count; index++) {
+            if (jobs [index]->chunk)
+                continue;
+            writer_write(jobs + start, index - start, ring);
+            writer_finish(jobs [index]);
+            start = index + 1;
+        }
+        writer_write(jobs + start, count - start, ring);
+        for (index = 0; index < count; index++)
+            zsock_send(pipe, "p", jobs [index]);
+    }
+#if (TCH_HAVE_IO_URING)
+    if (ring)
+        io_uring_queue_exit(&uring);
+#endif
+}
+
+/* Open extra data streams, if we want them and haven't yet; they join
+ * our session once the server has our first subscription. Tells the
+ * server about them in the ICANHAZ options. */
+static void
+streams_open(tch_client_t *self, zhash_t *options)
+{
+    if (self->stream_count == 0 || self->streams || !self->endpoint)
+        return;
+
+    //  Streams are named after our connection, which the server
+    //  shards on; the session is the connection name too
+    self->session = zsock_identity(self->dealer);
+    self->streams = zlist_new();
+    uint32_t index;
+    for (index = 0; index < self->stream_count; index++) {
+        tch_stream_t *stream = (tch_stream_t *) zmalloc(sizeof(tch_stream_t));
+        stream->dealer = zsock_new(ZMQ_DEALER);
+        stream->message = fmq_msg_new();
+        if (stream->dealer) {
+            char *identity = zsys_sprintf("%s-%u", self->session, index);
+            zsock_set_identity(stream->dealer, identity);
+            zstr_free(&identity);
+        }
+        if (!stream->dealer || !stream->message
+        ||  zsock_connect(stream->dealer, "%s", self->endpoint)) {
+            zsys_warning("could not open data stream to %s", self->endpoint);
+            stream_destroy(&stream);
+            break;
+        }
+        engine_handle_socket(self, stream->dealer, s_client_handle_stream);
+        fmq_msg_set_id(stream->message, FMQ_MSG_OHAI);
+        fmq_msg_send(stream->message, stream->dealer);
+        stream->sent_at = zclock_mono();
+        zlist_append(self->streams, stream);
+    }
+    if (zlist_size(self->streams)) {
+        char *count = zsys_sprintf("%zu", zlist_size(self->streams));
+        zhash_update(options, "streams", count);
+        zhash_update(options, "session", self->session);
+        zstr_free(&count);
+    }
+}
+
+/* Join streams the server has answered to our session */
+static void
+streams_join(tch_client_t *self)
+{
+    if (!self->subscribed)
+        return;
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->streams);
+    while (stream) {
+        if (stream->connected && !stream->joined) {
+            zhash_t *options = zhash_new();
+            zhash_autofree(options);
+            zhash_insert(options, "stream", self->session);
+            fmq_msg_set_id(stream->message, FMQ_MSG_ICANHAZ);
+            fmq_msg_set_path(stream->message, ((tch_sub_t *) zlist_first(self->subs))->path);
+            fmq_msg_set_options(stream->message, &options);
+            fmq_msg_send(stream->message, stream->dealer);
+            stream->sent_at = zclock_mono();
+            stream->joined = true;
+        }
+        stream = (tch_stream_t *) zlist_next(self->streams);
+    }
+}
+
+/* Send HUGZ on streams that have been quiet a while, or on all of them */
+static void
+streams_keepalive(tch_client_t *self, bool force)
+{
+    int64_t now = zclock_mono();
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->streams);
+    while (stream) {
+        if (stream->joined && (force || now - stream->sent_at > STREAM_HUGZ)) {
+            fmq_msg_set_id(stream->message, FMQ_MSG_HUGZ);
+            fmq_msg_send(stream->message, stream->dealer);
+            stream->sent_at = now;
+        }
+        stream = (tch_stream_t *) zlist_next(self->streams);
+    }
+}
+
+/* Say goodbye on all streams and close them */
+static void
+streams_close(tch_client_t *self)
+{
+    while (zlist_size(self->streams)) {
+        tch_stream_t *stream = (tch_stream_t *) zlist_pop(self->streams);
+        if (stream->connected) {
+            fmq_msg_set_id(stream->message, FMQ_MSG_KTHXBAI);
+            fmq_msg_send(stream->message, stream->dealer);
+        }
+        engine_handle_socket(self, stream->dealer, NULL);
+        stream_destroy(&stream);
+    }
+    zlist_destroy(&self->streams);
+}
+
+/* Keep stream's credit topped up, like the main connection's */
+static void
+stream_refill(tch_client_t *self, tch_stream_t *stream)
+{
+    if (stream->credit + self->window / 4 > self->window)
+        return;
+    uint64_t acked = fmq_msg_id(stream->message) == FMQ_MSG_CHEEZBURGER?
+                     fmq_msg_sequence(stream->message): 0;
+    fmq_msg_set_id(stream->message, FMQ_MSG_NOM);
+    fmq_msg_set_credit(stream->message, self->window - stream->credit);
+    fmq_msg_set_sequence(stream->message, acked);
+    fmq_msg_send(stream->message, stream->dealer);
+    stream->credit = self->window;
+    stream->sent_at = zclock_mono();
+}
+
+static void
+stream_destroy(tch_stream_t **self_p)
+{
+    assert(self_p);
+    if (*self_p) {
+        tch_stream_t *self = *self_p;
+        fmq_msg_destroy(&self->message);
+        zsock_destroy(&self->dealer);
+        zstr_free(&self->filename);
+        zstr_free(&self->vpath);
+        free(self);
+        *self_p = NULL;
     }
 }
 
-/* refill_credit_as_needed */
+/* Keep a window of credit open. We top it up as chunks are written,
+ * once a quarter of it is used, so the server gets more before it runs
+ * dry; the NOM acknowledges the last chunk we wrote */
 static void
 refill_credit_as_needed(tch_client_t *self)
 {
     //zsys_debug("refill credit as needed");
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
+    //  Bytes the writer holds count against the window, so a slow disk
+    //  holds the server back rather than filling our memory
+    if (self->credit + self->queued + self->window / 4 > self->window)
+        return;
+    fmq_msg_set_credit(self->message, self->window - self->credit - self->queued);
+    fmq_msg_set_sequence(self->message, self->acked);
+    self->credit = self->window - self->queued;
+    engine_set_next_event(self, send_credit_event);
+}
+
+/* Resize credit window from the bandwidth-delay product. We measure how
+ * fast chunks arrive over a couple of round trips and keep twice that
+ * many bytes in flight. While credit is what holds the server back, this
+ * doubles the window each sample; once the network is the limit, the
+ * window settles at twice the BDP. */
+static void
+measure_throughput(tch_client_t *self, size_t bytes)
+{
+    int64_t now = zclock_usecs();
+    if (self->sample_at == 0 || now - self->chunk_at > CREDIT_IDLE) {
+        //  Start new sample after idle time, between transfers
+        self->sample_at = now;
+        self->sample_bytes = 0;
+        self->chunk_at = now;
+        return;
+    }
+    self->chunk_at = now;
+    self->sample_bytes += bytes;
+
+    int64_t elapsed = now - self->sample_at;
+    if (self->rtt == 0 || elapsed < self->rtt * 2 || elapsed < 10000)
+        return;
+
+    uint64_t rate = (uint64_t) self->sample_bytes * 1000000 / elapsed;
+    size_t window = (size_t) (rate * self->rtt * 2 / 1000000);
+    if (window < self->window_min)
+        window = self->window_min;
+    if (window > self->window_max)
+        window = self->window_max;
+    if (fmq_client_verbose && window != self->window)
+        zsys_debug("credit window %zu -> %zu (rate=%lu rtt=%ldus)",
+                   self->window, window, (unsigned long) rate, (long) self->rtt);
+    self->window = window;
+    self->sample_at = now;
+    self->sample_bytes = 0;
+}
+
+/* Open file we receive filename into. It has a temporary name beside
+ * the real one until it's whole, so nobody reads it half written */
+static zfile_t *
+inbox_temp_open(tch_client_t *self, const char *filename, bool fresh)
+{
+    char *name = zsys_sprintf("%s" TEMP_SUFFIX, filename);
+    zfile_t *file = zfile_new(self->inbox, name);
+    zstr_free(&name);
+    if (zfile_output(file)
+    ||  (fresh && ftruncate(fileno(zfile_handle(file)), 0))) {
+        zsys_warning("unable to write to file %s/%s", self->inbox, filename);
+        zfile_destroy(&file);
+    }
+    return file;
+}
+
+/* Allocate the whole file up front, so that it lands in one piece rather
+ * than growing chunk by chunk. It's only a hint; if the filesystem can't
+ * do it, we carry on without */
+static void
+file_preallocate(zfile_t *file, uint64_t size)
+{
+#if (TCH_HAVE_POSIX_FALLOCATE)
+    if (size > 0)
+        (void) posix_fallocate(fileno(zfile_handle(file)), 0, (off_t) size);
+#endif
+}
+
+/* Put file we received in its place, over any older copy */
+static int
+file_commit(zfile_t *file, const char *target)
+{
+    zfile_close(file);
+    int rc = rename(zfile_filename(file, NULL), target);
+    if (rc)
+        zsys_warning("unable to rename %s to %s", zfile_filename(file, NULL), target);
+    return rc;
+}
+
+/* Copy source file into file, sharing its blocks where the filesystem
+ * can clone them. Returns 0 if OK */
+static int
+file_clone(const char *source, zfile_t *file)
+{
+    int handle = open(source, O_RDONLY);
+    if (handle == -1)
+        return -1;
+    int target = fileno(zfile_handle(file));
+    int rc = -1;
+#if (TCH_HAVE_FICLONE)
+    rc = ioctl(target, FICLONE, handle);
+#endif
+    if (rc) {
+        byte *buffer = (byte *) malloc(CREDIT_SLICE);
+        assert(buffer);
+        off_t offset = 0;
+        ssize_t bytes;
+        while ((bytes = read(handle, buffer, CREDIT_SLICE)) > 0) {
+            if (pwrite(target, buffer, (size_t) bytes, offset) != bytes)
+                break;
+            offset += bytes;
+        }
+        rc = bytes == 0? 0: -1;
+        free(buffer);
+    }
+    close(handle);
+    return rc;
+}
+
+/* Copy one inbox file over another. Returns 0 if OK */
+static int
+inbox_clone(tch_client_t *self, const char *source, const char *filename)
+{
+    zfile_t *file = inbox_temp_open(self, filename, true);
+    if (!file)
+        return -1;
+    char *path = zsys_sprintf("%s/%s", self->inbox, source);
+    char *target = zsys_sprintf("%s/%s", self->inbox, filename);
+    int rc = file_clone(path, file);
+    if (rc == 0)
+        rc = file_commit(file, target);
+    else
+        zfile_remove(file);
+    zstr_free(&path);
+    zstr_free(&target);
+    zfile_destroy(&file);
+    return rc;
+}
+
+/* Server says we hold this file's content already, under another name;
+ * copy that. If our copy doesn't match the digest any more, we fetch the
+ * file from the server after all, over a stream of its own */
+static void
+process_the_copy(tch_client_t *self, const char *filename)
+{
+    zhash_t *headers = fmq_msg_headers(self->message);
+    const char *digest = (const char *) zhash_lookup(headers, "digest");
+    const char *size = (const char *) zhash_lookup(headers, "size");
+    const char *source = inbox_filename(self, (const char *) zhash_lookup(headers, "source"));
+
+    bool copied = false;
+    if (source && digest) {
+        zfile_t *file = zfile_new(self->inbox, source);
+        const char *actual = zfile_is_regular(file)? zfile_digest(file): NULL;
+        copied = actual && streq(actual, digest)
+              && inbox_clone(self, source, filename) == 0;
+        zfile_destroy(&file);
+    }
+    if (copied)
+        zsock_send(self->msgpipe, "sss", "FILE UPDATED", self->inbox, filename);
+    else
+    if (digest && size && self->endpoint) {
+        zsys_warning("no good copy of %s/%s here, fetching it", self->inbox, filename);
+        char *line = zsys_sprintf("%s %s", self->endpoint, fmq_msg_filename(self->message));
+        swarm_start(self, filename, digest, strtoull(size, NULL, 10), line);
+        zstr_free(&line);
+    } else {
+        zsys_warning("unable to copy %s/%s", self->inbox, filename);
+        zsock_send(self->msgpipe, "sss", "FILE DELETED", self->inbox, filename);
+    }
+}
+
+/* Start journal for file we're starting to receive. A transfer from
+ * offset zero starts afresh; anything else resumes the existing one */
+static void
+journal_open(tch_client_t *self, const char *filename)
+{
+    zhash_t *headers = fmq_msg_headers(self->message);
+    const char *digest = headers? (const char *) zhash_lookup(headers, "digest"): NULL;
+    if (!digest)
+        return;                 //  Server can't resume without digest
+
+    self->journal_name = zsys_sprintf("%s/%s" JOURNAL_SUFFIX, self->inbox, filename);
+    self->journal = journal_start(self->file, self->journal_name, digest,
+                                  fmq_msg_offset(self->message) == 0);
+    if (!self->journal)
+        zstr_free(&self->journal_name);
+}
+
+/* Open journal 'name' for file. A fresh transfer empties the file and
+ * starts a new journal; otherwise we add to the existing one. */
+static FILE *
+journal_start(zfile_t *file, const char *name, const char *digest, bool fresh)
+{
+    FILE *journal;
+    if (fresh) {
+        //  Drop whatever an older version of the file left behind
+        if (ftruncate(fileno(zfile_handle(file)), 0))
+            zsys_warning("unable to truncate %s", zfile_filename(file, NULL));
+        journal = fopen(name, "w");
+        if (journal)
+            fprintf(journal, "%s\n", digest);
+    } else
+        journal = fopen(name, "a");
+    if (journal)
+        fflush(journal);
+    return journal;
+}
+
+/* Close journal; once the file is complete we don't need it any more */
+static void
+journal_close(tch_client_t *self, bool complete)
+{
+    if (self->journal) {
+        fclose(self->journal);
+        self->journal = NULL;
+        if (complete)
+            remove(self->journal_name);
+    }
+    zstr_free(&self->journal_name);
+}
+
+static int
+s_range_compare(const void *item1, const void *item2)
+{
+    const uint64_t *range1 = (const uint64_t *) item1;
+    const uint64_t *range2 = (const uint64_t *) item2;
+    return range1 [0] < range2 [0]? -1: range1 [0] > range2 [0]? 1: 0;
+}
+
+/* Load journal, return first offset we're missing and the digest of the
+ * file the journal is for. Digest must hold 41 characters. */
+static off_t
+journal_resume_offset(const char *name, char *digest)
+{
+    FILE *journal = fopen(name, "r");
+    if (!journal)
+        return 0;
+    if (fscanf(journal, "%40s", digest) != 1) {
+        fclose(journal);
+        return 0;
+    }
+    size_t count = 0, limit = 64;
+    uint64_t *ranges = (uint64_t *) malloc(limit * 2 * sizeof(uint64_t));
+    assert(ranges);
+    unsigned long long offset, size;
+    while (fscanf(journal, "%llu %llu", &offset, &size) == 2) {
+        if (count == limit) {
+            limit *= 2;
+            ranges = (uint64_t *) realloc(ranges, limit * 2 * sizeof(uint64_t));
+            assert(ranges);
+        }
+        ranges [count * 2] = offset;
+        ranges [count * 2 + 1] = offset + size;
+        count++;
+    }
+    fclose(journal);
+
+    //  Chunks may have landed out of order, so merge ranges from zero
+    qsort(ranges, count, 2 * sizeof(uint64_t), s_range_compare);
+    uint64_t resume = 0;
+    size_t index;
+    for (index = 0; index < count && ranges [index * 2] <= resume; index++)
+        if (ranges [index * 2 + 1] > resume)
+            resume = ranges [index * 2 + 1];
+    free(ranges);
+    return (off_t) resume;
+}
+
+/* Collect state of our inbox for the server: for partial files, how far
+ * we got, so it can pick up where it left off; and in delta mode, block
+ * signatures of whole files, so it can send only what changed */
+static zhash_t *
+collect_inbox_options(tch_client_t *self)
+{
+    //  Journals must be up to date before we read them
+    writer_sync(self);
+    zhash_t *options = zhash_new();
+    zhash_autofree(options);
+    if (self->delta_block) {
+        char *block = zsys_sprintf("%zu", self->delta_block);
+        zhash_insert(options, "delta", block);
+        zstr_free(&block);
+    }
+    if (self->dedupe)
+        zhash_insert(options, "dedupe", "1");
+    zhash_insert(options, "batch", "1");
+    if (self->priority) {
+        char *priority = zsys_sprintf("%u", self->priority);
+        zhash_insert(options, "priority", priority);
+        zstr_free(&priority);
+    }
+    if (self->rate) {
+        char *rate = zsys_sprintf("%llu", (unsigned long long) self->rate);
+        zhash_insert(options, "rate", rate);
+        zstr_free(&rate);
+    }
+    //  Server may pack chunks with any codec we have
+    if (*fmq_msg_codecs())
+        zhash_insert(options, "compress", (void *) fmq_msg_codecs());
+    zdir_t *inbox = zdir_new(self->inbox, NULL);
+    if (!inbox)
+        return options;
+
+    size_t suffix = strlen(JOURNAL_SUFFIX);
+    bool slashed = self->sub->path [strlen(self->sub->path) - 1] == '/';
+    //  Signatures of files that haven't changed since last time carry
+    //  over; those of files that went, go
+    zhash_t *signed_files = zhash_new();
+    zfile_t **files = zdir_flatten(inbox);
+    uint index;
+    for (index = 0; files [index]; index++) {
+        const char *name = zfile_filename(files [index], self->inbox);
+        size_t length = strlen(name);
+        if (s_name_ends(name, TEMP_SUFFIX))
+            continue;               //  Journal tells us what we have of it
+        if (!s_name_ends(name, JOURNAL_SUFFIX)) {
+            if (self->delta_block
+            &&  zfile_cursize(files [index]) >= (off_t) self->delta_block * 2) {
+                char *key = zsys_sprintf("delta%s%s%s", self->sub->path,
+                                         slashed? "": "/", name);
+                tch_signed_t *sigs = file_signed(self, zfile_filename(files [index], NULL), name);
+                if (sigs) {
+                    zhash_update(signed_files, name, sigs);
+                    zhash_freefn(signed_files, name, signed_destroy);
+                    if (strlen(key) < 256)
+                        zhash_update(options, key, sigs->signatures);
+                }
+                zstr_free(&key);
+            }
+            continue;
+        }
+        char digest [41];
+        off_t offset = journal_resume_offset(zfile_filename(files [index], NULL), digest);
+        if (offset > 0) {
+            char *key = zsys_sprintf("resume%s%s%.*s", self->sub->path,
+                                     slashed? "": "/", (int) (length - suffix), name);
+            char *value = zsys_sprintf("%s %llu", digest, (unsigned long long) offset);
+            if (strlen(key) < 256)
+                zhash_update(options, key, value);
+            zstr_free(&key);
+            zstr_free(&value);
+        }
+    }
+    zdir_flatten_free(&files);
+    zdir_destroy(&inbox);
+    zhash_destroy(&self->signed_files);
+    self->signed_files = signed_files;
+    return options;
+}
+
+/* Signatures of inbox file at path, called name in the inbox. We take
+ * them over from last time if the file hasn't changed since, else we
+ * read the file. Caller owns the result. */
+static tch_signed_t *
+file_signed(tch_client_t *self, const char *path, const char *name)
+{
+    struct stat stat_buf;
+    if (stat(path, &stat_buf))
+        return NULL;
+    int64_t mtime = (int64_t) stat_buf.st_mtim.tv_sec * 1000000000
+                  + stat_buf.st_mtim.tv_nsec;
+    tch_signed_t *sigs = self->signed_files?
+        (tch_signed_t *) zhash_lookup(self->signed_files, name): NULL;
+    if (sigs
+    &&  sigs->size == (uint64_t) stat_buf.st_size
+    &&  sigs->mtime == mtime
+    &&  sigs->block == self->delta_block) {
+        //  Take it out without freeing it, as it moves to the new table
+        zhash_freefn(self->signed_files, name, NULL);
+        zhash_delete(self->signed_files, name);
+        return sigs;
+    }
+    char *signatures = file_signatures(path, self->delta_block);
+    if (!signatures)
+        return NULL;
+    sigs = (tch_signed_t *) zmalloc(sizeof(tch_signed_t));
+    sigs->size = (uint64_t) stat_buf.st_size;
+    sigs->mtime = mtime;
+    sigs->block = self->delta_block;
+    sigs->signatures = signatures;
+    return sigs;
+}
+
+/* Destroy signatures of a file; zhash free function */
+static void
+signed_destroy(void *argument)
+{
+    tch_signed_t *self = (tch_signed_t *) argument;
+    zstr_free(&self->signatures);
+    free(self);
+}
+
+/* Does name end in suffix, and have more to it than that? */
+static bool
+s_name_ends(const char *name, const char *suffix)
+{
+    size_t length = strlen(name);
+    size_t tail = strlen(suffix);
+    return length > tail && streq(name + length - tail, suffix);
+}
+
+/* Digest of every whole file in our inbox, by name, so the server knows
+ * what content we have to copy from */
+static zhash_t *
+collect_inbox_cache(tch_client_t *self)
+{
+    zdir_t *inbox = zdir_new(self->inbox, NULL);
+    if (!inbox)
+        return NULL;
+    zhash_t *cache = zhash_new();
+    zhash_autofree(cache);
+    zfile_t **files = zdir_flatten(inbox);
+    uint index;
+    for (index = 0; files [index]; index++) {
+        const char *name = zfile_filename(files [index], self->inbox);
+        //  Files we're still receiving, and their journals, aren't
+        //  content we have; the journals go in the options instead
+        if (s_name_ends(name, TEMP_SUFFIX) || s_name_ends(name, JOURNAL_SUFFIX))
+            continue;
+        const char *digest = zfile_digest(files [index]);
+        if (digest && strlen(name) < 256)
+            zhash_update(cache, name, (void *) digest);
+    }
+    zdir_flatten_free(&files);
+    zdir_destroy(&inbox);
+    return cache;
+}
+
+/* Server sent the manifest of a directory, as it differs from ours. Ask
+ * for the files that differ, and probe on into directories that differ;
+ * each probe comes back with the next level down. We leave files the
+ * server doesn't have alone. A server that can't use its manifest asks
+ * for our cache instead, so it can send us what we lack. */
+static void
+resync_the_inbox(tch_client_t *self)
+{
+    zhash_t *entries = fmq_msg_headers(self->message);
+    const char *vdir = fmq_msg_path(self->message);
+    if (entries && vdir && !*vdir && zhash_lookup(entries, "cache") && self->sub) {
+        zhash_t *cache = collect_inbox_cache(self);
+        if (!cache) {
+            cache = zhash_new();
+            zhash_autofree(cache);
+        }
+        fmq_msg_t *probe = fmq_msg_new();
+        zhash_t *options = zhash_new();
+        zhash_insert(options, "resync", "1");
+        zhash_insert(options, "cache", "1");
+        fmq_msg_set_id(probe, FMQ_MSG_ICANHAZ);
+        fmq_msg_set_path(probe, self->sub->path);
+        fmq_msg_set_options(probe, &options);
+        fmq_msg_set_cache(probe, &cache);
+        fmq_msg_send(probe, self->dealer);
+        fmq_msg_destroy(&probe);
+        return;
+    }
+    if (!entries || !self->manifest || !vdir || !*vdir)
+        return;
+
+    zhash_t *ours = fmq_manifest_entries(self->manifest, vdir);
+    zhash_t *fetch = zhash_new();
+    zhash_autofree(fetch);
+    size_t fetches = 0;
+    const char *digest = (const char *) zhash_first(entries);
+    while (digest) {
+        const char *name = zhash_cursor(entries);
+        const char *mine = ours? (const char *) zhash_lookup(ours, name): NULL;
+        if (!mine || !streq(mine, digest)) {
+            char *vpath = zsys_sprintf("%s%s", vdir, name);
+            if (vpath [strlen(vpath) - 1] == '/') {
+                fmq_msg_t *probe = fmq_msg_new();
+                zhash_t *options = zhash_new();
+                zhash_insert(options, "resync", "1");
+                fmq_msg_set_id(probe, FMQ_MSG_ICANHAZ);
+                fmq_msg_set_path(probe, vpath);
+                fmq_msg_set_options(probe, &options);
+                fmq_msg_send(probe, self->dealer);
+                fmq_msg_destroy(&probe);
+            } else {
+                char *key = zsys_sprintf("fetch/%zu", ++fetches);
+                zhash_insert(fetch, key, vpath);
+                zstr_free(&key);
+            }
+            zstr_free(&vpath);
+        }
+        digest = (const char *) zhash_next(entries);
     }
-    if (credit_to_send) {
-        fmq_msg_set_credit(self->message, credit_to_send);
-        engine_set_next_event(self, send_credit_event);
+    if (fetches) {
+        fmq_msg_t *probe = fmq_msg_new();
+        zhash_insert(fetch, "resync", "1");
+        fmq_msg_set_id(probe, FMQ_MSG_ICANHAZ);
+        fmq_msg_set_path(probe, "");
+        fmq_msg_set_options(probe, &fetch);
+        fmq_msg_send(probe, self->dealer);
+        fmq_msg_destroy(&probe);
     }
+    zhash_destroy(&fetch);
+}
+
+/* Block signatures of a file: for each whole block, the weak sum as 8
+ * hex digits then the strong sum as 16 hex digits */
+static char *
+file_signatures(const char *name, size_t block)
+{
+    FILE *handle = fopen(name, "rb");
+    if (!handle)
+        return NULL;
+    byte *buffer = (byte *) malloc(block);
+    size_t limit = 24 * 64 + 1, length = 0;
+    char *signatures = (char *) malloc(limit);
+    assert(buffer && signatures);
+    while (fread(buffer, 1, block, handle) == block) {
+        if (length + 25 > limit) {
+            limit *= 2;
+            signatures = (char *) realloc(signatures, limit);
+            assert(signatures);
+        }
+        snprintf(signatures + length, 25, "%08x%016llx",
+                 (unsigned int) fmq_msg_weak_sum(buffer, block),
+                 (unsigned long long) fmq_msg_strong_sum(buffer, block));
+        length += 24;
+    }
+    signatures [length] = 0;
+    free(buffer);
+    fclose(handle);
+    return signatures;
 }
 
 /* Handle command pipe to/from calling API */
@@ -1467,6 +3211,45 @@ s_client_handle_cmdpipe(zloop_t *loop, zsock_t *reader, void *argument)
         zstr_free(&self->args.path);
         zsock_recv(self->cmdpipe, "s", &self->args.path);
         s_client_execute(self, subscribe_event);
+    } else if (streq(method, "SET CREDIT")) {
+        uint64_t window_min, window_max;
+        zsock_recv(self->cmdpipe, "88", &window_min, &window_max);
+        tch_client_t *client = &self->client;
+        client->window_min = window_min? (size_t) window_min: CREDIT_MINIMUM;
+        client->window_max = window_max > client->window_min?
+            (size_t) window_max: client->window_min;
+        if (client->window < client->window_min)
+            client->window = client->window_min;
+        if (client->window > client->window_max)
+            client->window = client->window_max;
+    } else if (streq(method, "SET DELTA")) {
+        uint32_t block;
+        zsock_recv(self->cmdpipe, "4", &block);
+        self->client.delta_block = block;
+    } else if (streq(method, "SET DEDUPE")) {
+        uint32_t dedupe;
+        zsock_recv(self->cmdpipe, "4", &dedupe);
+        self->client.dedupe = dedupe != 0;
+    } else if (streq(method, "SET PRIORITY")) {
+        uint32_t priority;
+        zsock_recv(self->cmdpipe, "4", &priority);
+        self->client.priority = priority;
+    } else if (streq(method, "SET RATE")) {
+        uint64_t rate;
+        zsock_recv(self->cmdpipe, "8", &rate);
+        self->client.rate = rate;
+    } else if (streq(method, "SET STREAMS")) {
+        uint32_t streams;
+        zsock_recv(self->cmdpipe, "4", &streams);
+        self->client.stream_count = streams;
+    } else if (streq(method, "SWARM")) {
+        char *filename, *digest, *sources;
+        uint64_t size;
+        zsock_recv(self->cmdpipe, "ss8s", &filename, &digest, &size, &sources);
+        swarm_start(&self->client, filename, digest, size, sources);
+        zstr_free(&filename);
+        zstr_free(&digest);
+        zstr_free(&sources);
     } else if (streq(method, "SET INBOX")) {
         zstr_free(&self->args.path);
         zsock_recv(self->cmdpipe, "s", &self->args.path);
@@ -1516,6 +3299,164 @@ s_client_handle_msgpipe (zloop_t *loop, zsock_t *reader, void *argument)
     return 0;
 }
 
+/* Handle a message on one of our extra data streams */
+static int
+s_client_handle_stream (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    tch_client_t *self = (tch_client_t *) argument;
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->streams);
+    while (stream && stream->dealer != reader)
+        stream = (tch_stream_t *) zlist_next(self->streams);
+    if (!stream)
+        return 0;
+
+    while (zsock_events(stream->dealer) & ZMQ_POLLIN) {
+        if (fmq_msg_recv(stream->message, stream->dealer))
+            return -1;              //  Interrupted; exit zloop
+
+        int id = fmq_msg_id(stream->message);
+        if (id == FMQ_MSG_OHAI_OK) {
+            stream->connected = true;
+            streams_join(self);
+        } else if (id == FMQ_MSG_ICANHAZ_OK)
+            stream_refill(self, stream);
+        else if (id == FMQ_MSG_CHEEZBURGER) {
+            const char *filename = inbox_filename(self, fmq_msg_filename(stream->message));
+            if (filename)
+                stream->credit -= process_the_stripe(self, stream->message, filename);
+            else
+                stream->credit -= zchunk_size(fmq_msg_chunk(stream->message));
+            stream_refill(self, stream);
+        } else if (id != FMQ_MSG_HUGZ_OK) {
+            //  Server won't have this stream; carry on without it
+            zsys_warning("data stream refused by server");
+            zlist_remove(self->streams, stream);
+            engine_handle_socket(self, stream->dealer, NULL);
+            stream_destroy(&stream);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Handle chunks the disk writer hands back */
+static int
+s_client_handle_writer (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    tch_client_t *self = (tch_client_t *) argument;
+    while (self->writes && (zsock_events(reader) & ZMQ_POLLIN)) {
+        tch_write_t *job;
+        if (zsock_recv(reader, "p", &job) || !job)
+            return -1;              //  Interrupted; exit zloop
+        writer_done(self, job);
+    }
+    writer_refill(self);
+    return 0;
+}
+
+/* Handle a message on one of our swarm streams. Each fetches one range
+ * of a file from one source; if that source can't give us the range,
+ * we ask the next one */
+static int
+s_client_handle_swarm (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    tch_client_t *self = (tch_client_t *) argument;
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->swarm);
+    while (stream && stream->dealer != reader)
+        stream = (tch_stream_t *) zlist_next(self->swarm);
+    if (!stream)
+        return 0;
+
+    while (zsock_events(stream->dealer) & ZMQ_POLLIN) {
+        if (fmq_msg_recv(stream->message, stream->dealer))
+            return -1;              //  Interrupted; exit zloop
+
+        stream->heard_at = zclock_mono();
+        int id = fmq_msg_id(stream->message);
+        tch_stripe_t *stripe = (tch_stripe_t *) zhash_lookup(self->stripes, stream->filename);
+        if (!stripe) {
+            //  Download ended without this stream
+            swarm_stream_close(self, stream);
+            break;
+        }
+        if (id == FMQ_MSG_OHAI_OK) {
+            stream->connected = true;
+            zhash_t *options = zhash_new();
+            zhash_autofree(options);
+            char *range = zsys_sprintf("%s %llu %llu %llu", stripe->digest,
+                (unsigned long long) stripe->expected,
+                (unsigned long long) (stream->range_start + stream->range_got),
+                (unsigned long long) stream->range_end);
+            zhash_insert(options, "range", range);
+            zstr_free(&range);
+            fmq_msg_set_id(stream->message, FMQ_MSG_ICANHAZ);
+            fmq_msg_set_path(stream->message, stream->vpath);
+            fmq_msg_set_options(stream->message, &options);
+            fmq_msg_send(stream->message, stream->dealer);
+            stream->sent_at = zclock_mono();
+        } else if (id == FMQ_MSG_ICANHAZ_OK)
+            stream_refill(self, stream);
+        else if (id == FMQ_MSG_CHEEZBURGER
+             &&  fmq_msg_operation(stream->message) == FMQ_MSG_FILE_CREATE) {
+            //  Source sends our range in order, then end of file
+            zchunk_t *chunk = fmq_msg_chunk(stream->message);
+            size_t size = zchunk_size(chunk);
+            uint64_t offset = fmq_msg_offset(stream->message);
+            stream->credit -= size;
+            if (size > 0
+            &&  offset == stream->range_start + stream->range_got
+            &&  offset + size <= stream->range_end) {
+                zfile_write(stripe->file, chunk, (off_t) offset);
+                stream->range_got += size;
+                stripe->received += size;
+                measure_throughput(self, size);
+            }
+            if (fmq_msg_eof(stream->message)) {
+                if (stream->range_start + stream->range_got < stream->range_end)
+                    swarm_retry(self, stream);
+                else {
+                    char *filename = strdup(stream->filename);
+                    swarm_stream_close(self, stream);
+                    swarm_check(self, filename);
+                    zstr_free(&filename);
+                }
+                break;
+            }
+            stream_refill(self, stream);
+        } else if (id != FMQ_MSG_HUGZ_OK) {
+            //  Source doesn't have the file, or won't talk to us
+            zsys_warning("swarm source can't send %s", stream->vpath);
+            swarm_retry(self, stream);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Keep swarm streams alive, and give up on sources that went quiet */
+static int
+s_client_handle_swarm_timer (zloop_t *loop, int timer_id, void *argument)
+{
+    tch_client_t *self = (tch_client_t *) argument;
+    int64_t now = zclock_mono();
+    tch_stream_t *stream = (tch_stream_t *) zlist_first(self->swarm);
+    while (stream) {
+        if (now - stream->heard_at > SWARM_STALL) {
+            zsys_warning("swarm source stalled on %s", stream->vpath);
+            swarm_retry(self, stream);
+            stream = (tch_stream_t *) zlist_first(self->swarm);
+            continue;
+        }
+        if (stream->connected && now - stream->sent_at > STREAM_HUGZ) {
+            fmq_msg_set_id(stream->message, FMQ_MSG_HUGZ);
+            fmq_msg_send(stream->message, stream->dealer);
+            stream->sent_at = now;
+        }
+        stream = (tch_stream_t *) zlist_next(self->swarm);
+    }
+    return 0;
+}
+
 /* Handle a message (a protocol reply) from the server */
 static int
 s_client_handle_protocol (zloop_t *loop, zsock_t *reader, void *argument)
@@ -1558,8 +3499,14 @@ s_client_new(zsock_t *cmdpipe, zsock_t *msgpipe)
         snprintf (self->log_prefix, sizeof (self->log_prefix),
             "%6d:%-33s", randof (1000000), "fmq_client");
         self->dealer = zsock_new(ZMQ_DEALER);
-        if (self->dealer)
+        if (self->dealer) {
+            //  Name the connection, so a sharded server keeps it and
+            //  our data streams on the same reactor
+            zuuid_t *uuid = zuuid_new();
+            zsock_set_identity(self->dealer, zuuid_str(uuid));
+            zuuid_destroy(&uuid);
             self->message = fmq_msg_new();
+        }
         if (self->message)
             self->loop = zloop_new();
         if (self->loop) {
@@ -1735,6 +3682,97 @@ fmq_client_set_inbox(tch_fmq_client_t *self, const char *path)
     return self->status;
 }
 
+/* Set bounds on the credit window, in bytes. The client sizes its window
+ * from measured throughput and round trip time, within these bounds. A
+ * zero minimum restores the default. Takes effect at the next refill. */
+void
+fmq_client_set_credit(tch_fmq_client_t *self, uint64_t window_min, uint64_t window_max)
+{
+    assert (self);
+    zsock_send (self->actor, "s88", "SET CREDIT", window_min, window_max);
+}
+
+/* Ask for changed files as deltas against our copies, using blocks of
+ * this many bytes; zero asks for whole files again. Applies to the next
+ * subscription. Large, mostly unchanged files, such as growing logs or
+ * disk images, then cost little more than their changes. */
+void
+fmq_client_set_delta(tch_fmq_client_t *self, uint32_t block)
+{
+    assert (self);
+    zsock_send (self->actor, "s4", "SET DELTA", block);
+}
+
+/* Copy files we have already rather than fetch them again. We tell the
+ * server what our files hold, and it points us at our own copy when a
+ * file it sends has the same content, or at a similar file to build a
+ * delta against. Applies to the next subscription. */
+void
+fmq_client_set_dedupe(tch_fmq_client_t *self, bool dedupe)
+{
+    assert (self);
+    zsock_send (self->actor, "s4", "SET DEDUPE", (uint32_t) dedupe);
+}
+
+/* Ask the server to send files of the next subscription at this
+ * priority, from 0, the default, to 7. Higher priorities get a bigger
+ * share of what the server sends us and of what it sends all clients,
+ * so urgent files get through while bulk transfers still move. */
+void
+fmq_client_set_priority(tch_fmq_client_t *self, uint32_t priority)
+{
+    assert (self);
+    zsock_send (self->actor, "s4", "SET PRIORITY", priority);
+}
+
+/* Ask the server to send us no more than this many bytes per second;
+ * zero, the default, asks for no cap. The server may cap us lower.
+ * Applies from the next subscription on. */
+void
+fmq_client_set_rate(tch_fmq_client_t *self, uint64_t rate)
+{
+    assert (self);
+    zsock_send (self->actor, "s8", "SET RATE", rate);
+}
+
+/* Open this many extra data streams to the server, for large files. The
+ * server stripes each large file over all our streams, so one transfer
+ * isn't limited to what a single TCP connection can carry. Applies to
+ * the first subscription; zero, the default, uses just the one. */
+void
+fmq_client_set_streams(tch_fmq_client_t *self, uint32_t streams)
+{
+    assert (self);
+    zsock_send (self->actor, "s4", "SET STREAMS", streams);
+}
+
+/* Fetch a file from several peers at once, each sending its share. The
+ * sources are "endpoint vpath" lines, one per peer holding a file with
+ * this digest and size. Goes into the inbox under filename; we report
+ * FILE UPDATED on the message pipe once it's whole and matches the
+ * digest, else FILE DELETED. */
+void
+fmq_client_swarm(tch_fmq_client_t *self, const char *filename, const char *digest,
+                 uint64_t size, zlist_t *sources)
+{
+    assert (self);
+    size_t length = 1;
+    const char *source = (const char *) zlist_first(sources);
+    while (source) {
+        length += strlen(source) + 1;
+        source = (const char *) zlist_next(sources);
+    }
+    char *lines = (char *) zmalloc(length);
+    source = (const char *) zlist_first(sources);
+    while (source) {
+        strcat(lines, source);
+        strcat(lines, "\n");
+        source = (const char *) zlist_next(sources);
+    }
+    zsock_send (self->actor, "ss8s", "SWARM", filename, digest, size, lines);
+    free(lines);
+}
+
 /* Return last received status */
 uint8_t 
 fmq_client_status (tch_fmq_client_t *self)
@@ -24,6 +24,13 @@ uint8_t fmq_client_destructor(tch_fmq_client_t *self);
 uint8_t fmq_client_connect(tch_fmq_client_t *self, const char *endpoint, uint32_t timeout);
 uint8_t fmq_client_subscribe(tch_fmq_client_t *self, const char *path);
 uint8_t fmq_client_set_inbox(tch_fmq_client_t *self, const char *path);
+void fmq_client_set_credit(tch_fmq_client_t *self, uint64_t window_min, uint64_t window_max);
+void fmq_client_set_delta(tch_fmq_client_t *self, uint32_t block);
+void fmq_client_set_dedupe(tch_fmq_client_t *self, bool dedupe);
+void fmq_client_set_priority(tch_fmq_client_t *self, uint32_t priority);
+void fmq_client_set_rate(tch_fmq_client_t *self, uint64_t rate);
+void fmq_client_set_streams(tch_fmq_client_t *self, uint32_t streams);
+void fmq_client_swarm(tch_fmq_client_t *self, const char *filename, const char *digest, uint64_t size, zlist_t *sources);
 uint8_t fmq_client_status(tch_fmq_client_t *self);
 const char *fmq_client_reason(tch_fmq_client_t *self);
 bool fmq_client_connected(tch_fmq_client_t *self);
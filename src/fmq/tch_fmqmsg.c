@@ -21,6 +21,25 @@
  *
  */
 #include <tch_fmqmsg.h>
+#include <tch_auto_config.h>
+
+#if (TCH_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if (TCH_HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+//  Codecs we can pack chunks with, best first
+#if (TCH_HAVE_ZSTD) && (TCH_HAVE_LZ4)
+#define FMQ_MSG_CODECS      "zstd,lz4"
+#elif (TCH_HAVE_ZSTD)
+#define FMQ_MSG_CODECS      "zstd"
+#elif (TCH_HAVE_LZ4)
+#define FMQ_MSG_CODECS      "lz4"
+#else
+#define FMQ_MSG_CODECS      ""
+#endif
 
 struct _fmq_msg_t {
     zframe_t    *routing_id;           //  Routing_id from ROUTER, if any
@@ -41,6 +60,10 @@ struct _fmq_msg_t {
     zhash_t     *headers;              //  File properties
     size_t      headers_bytes;         //  Size of hash content
     zchunk_t    *chunk;                //  Data chunk
+    void        *chunk_data;           //  Zero-copy data chunk, if any
+    size_t      chunk_data_size;       //  Size of zero-copy data chunk
+    zmq_free_fn *chunk_data_free;      //  Releases zero-copy data chunk
+    void        *chunk_data_hint;      //  Hint for zero-copy release
     char        reason [256];          //  Printable explanation, 255 characters
 };
 
@@ -213,6 +236,7 @@ fmq_msg_destroy (fmq_msg_t **self_p)
         free(self->filename);
         zhash_destroy(&self->headers);
         zchunk_destroy(&self->chunk);
+        fmq_msg_set_chunk_data(self, NULL, 0, NULL, NULL);
         //  Free object itself
         free(self);
         *self_p = NULL;
@@ -220,13 +244,15 @@ fmq_msg_destroy (fmq_msg_t **self_p)
 }
 
 /* Receive a fmq_msg from the socket. Returns 0 if OK, -1 if
- * there was an error. Blocks if there is no message waiting. */
+ * there was an error. Blocks if there is no message waiting. A PAIR
+ * socket carries a routing id just as a ROUTER does; that's how a
+ * server shard talks to clients through the front reactor. */
 int 
 fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
 {
     assert(input);
 
-    if (zsock_type(input) == ZMQ_ROUTER) {
+    if (zsock_type(input) == ZMQ_ROUTER || zsock_type(input) == ZMQ_PAIR) {
         zframe_destroy(&self->routing_id);
         self->routing_id = zframe_recv(input);
         if (!self->routing_id || !zsock_rcvmore(input)) {
@@ -311,6 +337,23 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
         }
         break;
     case FMQ_MSG_ICANHAZ_OK:
+        //  Older servers send no manifest
+        zhash_destroy(&self->headers);
+        if (self->needle < self->ceiling) {
+            GET_LONGSTR(self->path);
+            size_t hash_size;
+            GET_NUMBER4(hash_size);
+            self->headers = zhash_new();
+            zhash_autofree(self->headers);
+            while (hash_size--) {
+                char key[256];
+                char *value = NULL;
+                GET_STRING(key);
+                GET_LONGSTR(value);
+                zhash_insert(self->headers, key, value);
+                free(value);
+            }
+        }
         break;
     case FMQ_MSG_NOM:
         GET_NUMBER8(self->credit);
@@ -339,6 +382,20 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
         {
             size_t chunk_size;
             GET_NUMBER4(chunk_size);
+            if (self->needle == self->ceiling && chunk_size && zmq_msg_more(&frame)) {
+                //  Chunk was sent zero-copy, in a frame of its own
+                zmq_msg_t data;
+                zmq_msg_init(&data);
+                if (zmq_msg_recv(&data, zsock_resolve(input), 0) != (int) chunk_size) {
+                    zsys_warning("fmq_msg: chunk frame is wrong size");
+                    zmq_msg_close(&data);
+                    goto malformed;
+                }
+                zchunk_destroy(&self->chunk);
+                self->chunk = zchunk_new(zmq_msg_data(&data), chunk_size);
+                zmq_msg_close(&data);
+                break;
+            }
             if (self->needle + chunk_size > (self->ceiling)) {
                 zsys_warning("fmq_msg: chunk is missing data");
                 goto malformed;
@@ -382,7 +439,7 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
     assert(self);
     assert(output);
 
-    if (zsock_type(output) == ZMQ_ROUTER)
+    if (zsock_type(output) == ZMQ_ROUTER || zsock_type(output) == ZMQ_PAIR)
         zframe_send(&self->routing_id, output, ZFRAME_MORE + ZFRAME_REUSE);
 
     size_t frame_size = 2 + 1;  //  Signature and message ID
@@ -418,6 +475,22 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
         }
         frame_size += self->cache_bytes;
         break;
+    case FMQ_MSG_ICANHAZ_OK:
+        frame_size += 4;
+        if (self->path)
+            frame_size += strlen(self->path);
+        frame_size += 4;            //  Size is 4 octets
+        self->headers_bytes = 0;
+        if (self->headers) {
+            char *item = (char *)zhash_first(self->headers);
+            while (item) {
+                self->headers_bytes += 1 + strlen(zhash_cursor(self->headers));
+                self->headers_bytes += 4 + strlen(item);
+                item = (char *)zhash_next(self->headers);
+            }
+        }
+        frame_size += self->headers_bytes;
+        break;
     case FMQ_MSG_NOM:
         frame_size += 8;    //  credit
         frame_size += 8;    //  sequence
@@ -442,6 +515,9 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
         }
         frame_size += self->headers_bytes;
         frame_size += 4;            //  Size is 4 octets
+        if (self->chunk_data)
+            ;                       //  Goes out in its own frame
+        else
         if (self->chunk)
             frame_size += zchunk_size(self->chunk);
         break;
@@ -495,6 +571,24 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
             PUT_NUMBER4 (0);    //  Empty hash
         }
         break;
+    case FMQ_MSG_ICANHAZ_OK:
+        if (self->path) {
+            PUT_LONGSTR(self->path);
+        } else {
+            PUT_NUMBER4(0);    //  Empty string
+        }
+        if (self->headers) {
+            PUT_NUMBER4(zhash_size(self->headers));
+            char *item = (char *) zhash_first(self->headers);
+            while (item) {
+                PUT_STRING(zhash_cursor(self->headers));
+                PUT_LONGSTR(item);
+                item = (char *) zhash_next(self->headers);
+            }
+        } else {
+            PUT_NUMBER4(0);    //  Empty hash
+        }
+        break;
     case FMQ_MSG_NOM:
         PUT_NUMBER8(self->credit);
         PUT_NUMBER8(self->sequence);
@@ -519,6 +613,10 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
         } else {
             PUT_NUMBER4(0);    //  Empty hash
         }
+        if (self->chunk_data) {
+            PUT_NUMBER4(self->chunk_data_size);
+            nbr_frames++;
+        } else
         if (self->chunk) {
             PUT_NUMBER4(zchunk_size(self->chunk));
             memcpy(self->needle,
@@ -538,6 +636,19 @@ fmq_msg_send(fmq_msg_t *self, zsock_t *output)
     }
     //  Now send the data frame
     zmq_msg_send(&frame, zsock_resolve(output), --nbr_frames? ZMQ_SNDMORE: 0);
+
+    //  Now send the zero-copy chunk, ZeroMQ releases it once it's gone out
+    if (nbr_frames) {
+        zmq_msg_t data;
+        zmq_msg_init_data(&data, self->chunk_data, self->chunk_data_size,
+                          self->chunk_data_free, self->chunk_data_hint);
+        self->chunk_data = NULL;
+        self->chunk_data_size = 0;
+        self->chunk_data_free = NULL;
+        self->chunk_data_hint = NULL;
+        if (zmq_msg_send(&data, zsock_resolve(output), --nbr_frames? ZMQ_SNDMORE: 0) == -1)
+            zmq_msg_close(&data);
+    }
     return 0;
 }
 
@@ -583,6 +694,18 @@ fmq_msg_print (fmq_msg_t *self)
         break;
     case FMQ_MSG_ICANHAZ_OK:
         zsys_debug ("FMQ_MSG_ICANHAZ_OK:");
+        if (self->path)
+            zsys_debug ("    path='%s'", self->path);
+        else
+            zsys_debug ("    path=");
+        zsys_debug ("    headers=");
+        if (self->headers) {
+            char *item = (char *) zhash_first (self->headers);
+            while (item) {
+                zsys_debug ("        %s=%s", zhash_cursor (self->headers), item);
+                item = (char *) zhash_next (self->headers);
+            }
+        }
         break;
     case FMQ_MSG_NOM:
         zsys_debug ("FMQ_MSG_NOM:");
@@ -914,11 +1037,31 @@ fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p)
 {
     assert (self);
     assert (chunk_p);
+    fmq_msg_set_chunk_data (self, NULL, 0, NULL, NULL);
     zchunk_destroy (&self->chunk);
     self->chunk = *chunk_p;
     *chunk_p = NULL;
 }
 
+/* Set the chunk field to caller memory that is sent without copying.
+ * free_fn (data, hint) is called once ZeroMQ is done with the data, or
+ * when the chunk is replaced before being sent */
+void
+fmq_msg_set_chunk_data (fmq_msg_t *self, void *data, size_t size,
+                        zmq_free_fn *free_fn, void *hint)
+{
+    assert (self);
+    //  Release any chunk that never went out
+    if (self->chunk_data && self->chunk_data_free)
+        (self->chunk_data_free) (self->chunk_data, self->chunk_data_hint);
+    if (data)
+        zchunk_destroy (&self->chunk);
+    self->chunk_data = data;
+    self->chunk_data_size = size;
+    self->chunk_data_free = free_fn;
+    self->chunk_data_hint = hint;
+}
+
 /* Get/set the reason field */
 const char *
 fmq_msg_reason (fmq_msg_t *self)
@@ -936,4 +1079,319 @@ fmq_msg_set_reason (fmq_msg_t *self, const char *value)
         return;
     strncpy (self->reason, value, 255);
     self->reason [255] = 0;
-}
\ No newline at end of file
+}
+/* Block checksums for delta transfers. The weak sum is the rsync rolling
+ * checksum; roll it forward one byte with fmq_msg_weak_roll. The strong
+ * sum is the leading 8 bytes of the block's SHA-1 */
+uint32_t
+fmq_msg_weak_sum (const byte *data, size_t size)
+{
+    uint32_t a = 0, b = 0;
+    size_t index;
+    for (index = 0; index < size; index++) {
+        a += data [index];
+        b += (uint32_t) (size - index) * data [index];
+    }
+    return ((b & 0xffff) << 16) | (a & 0xffff);
+}
+
+uint32_t
+fmq_msg_weak_roll (uint32_t weak, size_t size, byte out, byte in)
+{
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t) size * out + a) & 0xffff;
+    return (b << 16) | a;
+}
+
+uint64_t
+fmq_msg_strong_sum (const byte *data, size_t size)
+{
+    zdigest_t *digest = zdigest_new ();
+    zdigest_update (digest, data, size);
+    const byte *sum = zdigest_data (digest);
+    uint64_t strong = 0;
+    int index;
+    for (index = 0; index < 8; index++)
+        strong = (strong << 8) | sum [index];
+    zdigest_destroy (&digest);
+    return strong;
+}
+
+/* Chunk compression. fmq_msg_codecs lists the codecs we have, best first,
+ * comma separated. fmq_msg_pack returns NULL if the codec is unknown or
+ * the data doesn't shrink by at least an eighth; fmq_msg_unpack returns
+ * NULL unless the chunk unpacks to exactly raw bytes */
+const char *
+fmq_msg_codecs (void)
+{
+    return FMQ_MSG_CODECS;
+}
+
+static void
+s_chunk_free (void **hint)
+{
+    free (*hint);
+}
+
+zchunk_t *
+fmq_msg_pack (const char *codec, const byte *data, size_t size)
+{
+    byte *packed = NULL;
+    size_t packed_size = 0;
+#if (TCH_HAVE_ZSTD)
+    if (streq (codec, "zstd")) {
+        size_t limit = ZSTD_compressBound (size);
+        packed = (byte *) malloc (limit);
+        assert (packed);
+        packed_size = ZSTD_compress (packed, limit, data, size, 1);
+        if (ZSTD_isError (packed_size))
+            packed_size = 0;
+    }
+#endif
+#if (TCH_HAVE_LZ4)
+    if (streq (codec, "lz4") && size <= LZ4_MAX_INPUT_SIZE) {
+        int limit = LZ4_compressBound ((int) size);
+        packed = (byte *) malloc (limit);
+        assert (packed);
+        int rc = LZ4_compress_default ((const char *) data, (char *) packed,
+                                       (int) size, limit);
+        packed_size = rc > 0? (size_t) rc: 0;
+    }
+#endif
+    if (packed_size == 0 || packed_size > size - size / 8) {
+        free (packed);
+        return NULL;
+    }
+    return zchunk_frommem (packed, packed_size, s_chunk_free, packed);
+}
+
+zchunk_t *
+fmq_msg_unpack (const char *codec, zchunk_t *chunk, size_t raw)
+{
+    byte *data = (byte *) malloc (raw? raw: 1);
+    assert (data);
+    bool unpacked = false;
+#if (TCH_HAVE_ZSTD)
+    if (streq (codec, "zstd")) {
+        size_t rc = ZSTD_decompress (data, raw, zchunk_data (chunk), zchunk_size (chunk));
+        unpacked = !ZSTD_isError (rc) && rc == raw;
+    }
+#endif
+#if (TCH_HAVE_LZ4)
+    if (streq (codec, "lz4") && raw <= INT_MAX && zchunk_size (chunk) <= INT_MAX) {
+        int rc = LZ4_decompress_safe ((const char *) zchunk_data (chunk), (char *) data,
+                                      (int) zchunk_size (chunk), (int) raw);
+        unpacked = rc >= 0 && (size_t) rc == raw;
+    }
+#endif
+    if (!unpacked) {
+        free (data);
+        return NULL;
+    }
+    return zchunk_frommem (data, raw, s_chunk_free, data);
+}
+
+/* Batch of small files. Each file is its filename, as a 2-byte length
+ * and text, then its size in 4 bytes and its data; numbers are in
+ * network order, as on the wire */
+size_t
+fmq_msg_batch_size (const char *filename, size_t size)
+{
+    return 2 + strlen (filename) + 4 + size;
+}
+
+int
+fmq_msg_batch_add (zchunk_t *batch, const char *filename, const byte *data, size_t size)
+{
+    size_t length = strlen (filename);
+    if (length > 0xFFFF || size > 0xFFFFFFFF
+    ||  zchunk_size (batch) + fmq_msg_batch_size (filename, size) > zchunk_max_size (batch))
+        return -1;
+    byte number [4];
+    number [0] = (byte) (length >> 8);
+    number [1] = (byte) length;
+    zchunk_append (batch, number, 2);
+    zchunk_append (batch, filename, length);
+    number [0] = (byte) (size >> 24);
+    number [1] = (byte) (size >> 16);
+    number [2] = (byte) (size >> 8);
+    number [3] = (byte) size;
+    zchunk_append (batch, number, 4);
+    zchunk_append (batch, data, size);
+    return 0;
+}
+
+bool
+fmq_msg_batch_next (zchunk_t *batch, size_t *offset, char **filename,
+                    const byte **data, size_t *size)
+{
+    const byte *needle = zchunk_data (batch) + *offset;
+    size_t left = zchunk_size (batch) - *offset;
+    if (left < 2)
+        return false;
+    size_t length = ((size_t) needle [0] << 8) + needle [1];
+    if (left < 2 + length + 4)
+        return false;
+    const byte *number = needle + 2 + length;
+    size_t file_size = ((size_t) number [0] << 24) + ((size_t) number [1] << 16)
+                     + ((size_t) number [2] << 8) + number [3];
+    if (left - 2 - length - 4 < file_size)
+        return false;           //  Malformed, file runs past the batch
+    *filename = (char *) malloc (length + 1);
+    assert (*filename);
+    memcpy (*filename, needle + 2, length);
+    (*filename) [length] = 0;
+    *data = number + 4;
+    *size = file_size;
+    *offset += 2 + length + 4 + file_size;
+    return true;
+}
+
+/* Merkle manifest of a tree of files. Each directory's digest is the
+ * SHA-1 of its sorted entries, "name digest" a line, where directories'
+ * names end in '/'. Two trees hold the same files under a directory
+ * exactly when its digests agree, so a resync only looks further into
+ * directories whose digests differ. */
+struct _fmq_manifest_t {
+    zhash_t     *dirs;                 //  Directory path -> entries
+    zhash_t     *digests;              //  Directory path -> digest
+};
+
+fmq_manifest_t *
+fmq_manifest_new (void)
+{
+    fmq_manifest_t *self = (fmq_manifest_t *) zmalloc (sizeof (fmq_manifest_t));
+    self->dirs = zhash_new ();
+    self->digests = zhash_new ();
+    zhash_autofree (self->digests);
+    return self;
+}
+
+void
+fmq_manifest_destroy (fmq_manifest_t **self_p)
+{
+    assert (self_p);
+    fmq_manifest_t *self = *self_p;
+    if (self) {
+        zhash_t *entries = (zhash_t *) zhash_first (self->dirs);
+        while (entries) {
+            zhash_destroy (&entries);
+            entries = (zhash_t *) zhash_next (self->dirs);
+        }
+        zhash_destroy (&self->dirs);
+        zhash_destroy (&self->digests);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Entries of directory, which we create if need be, along with entries
+//  in its parents that lead down to it
+static zhash_t *
+s_manifest_dir (fmq_manifest_t *self, const char *vdir)
+{
+    zhash_t *entries = (zhash_t *) zhash_lookup (self->dirs, vdir);
+    if (!entries) {
+        entries = zhash_new ();
+        zhash_autofree (entries);
+        zhash_insert (self->dirs, vdir, entries);
+        size_t length = strlen (vdir);
+        if (length > 1) {
+            //  Parent ends at the slash before our name
+            size_t parent = length - 1;
+            while (parent && vdir [parent - 1] != '/')
+                parent--;
+            char *name = strdup (vdir + parent);
+            char *up = strndup (vdir, parent);
+            zhash_update (s_manifest_dir (self, up), name, "");
+            free (name);
+            free (up);
+        }
+    }
+    return entries;
+}
+
+void
+fmq_manifest_add (fmq_manifest_t *self, const char *vpath, const char *digest)
+{
+    const char *name = strrchr (vpath, '/');
+    if (!name || !name [1] || !digest)
+        return;
+    char *vdir = strndup (vpath, name - vpath + 1);
+    zhash_update (s_manifest_dir (self, vdir), name + 1, (void *) digest);
+    free (vdir);
+}
+
+static int
+s_manifest_deeper (void *item1, void *item2)
+{
+    const char *left = (const char *) item1, *right = (const char *) item2;
+    size_t left_depth = 0, right_depth = 0;
+    for (; *left; left++)
+        left_depth += *left == '/';
+    for (; *right; right++)
+        right_depth += *right == '/';
+    return left_depth > right_depth? -1: left_depth < right_depth? 1: 0;
+}
+
+static int
+s_manifest_compare (void *item1, void *item2)
+{
+    return strcmp ((const char *) item1, (const char *) item2);
+}
+
+void
+fmq_manifest_seal (fmq_manifest_t *self)
+{
+    //  Children first, so each directory sees its subdirectories' digests
+    zlist_t *vdirs = zhash_keys (self->dirs);
+    zlist_sort (vdirs, s_manifest_deeper);
+    const char *vdir = (const char *) zlist_first (vdirs);
+    while (vdir) {
+        zhash_t *entries = (zhash_t *) zhash_lookup (self->dirs, vdir);
+        zlist_t *names = zhash_keys (entries);
+        zlist_sort (names, s_manifest_compare);
+        zdigest_t *digest = zdigest_new ();
+        const char *name = (const char *) zlist_first (names);
+        while (name) {
+            const char *value = (const char *) zhash_lookup (entries, name);
+            zdigest_update (digest, (const byte *) name, strlen (name));
+            zdigest_update (digest, (const byte *) " ", 1);
+            zdigest_update (digest, (const byte *) value, strlen (value));
+            zdigest_update (digest, (const byte *) "\n", 1);
+            name = (const char *) zlist_next (names);
+        }
+        zhash_update (self->digests, vdir, zdigest_string (digest));
+        zdigest_destroy (&digest);
+        zlist_destroy (&names);
+
+        size_t length = strlen (vdir);
+        if (length > 1) {
+            size_t parent = length - 1;
+            while (parent && vdir [parent - 1] != '/')
+                parent--;
+            char *up = strndup (vdir, parent);
+            zhash_t *above = (zhash_t *) zhash_lookup (self->dirs, up);
+            if (above)
+                zhash_update (above, vdir + parent,
+                              zhash_lookup (self->digests, vdir));
+            free (up);
+        }
+        vdir = (const char *) zlist_next (vdirs);
+    }
+    zlist_destroy (&vdirs);
+}
+
+const char *
+fmq_manifest_digest (fmq_manifest_t *self, const char *vdir)
+{
+    return (const char *) zhash_lookup (self->digests, vdir);
+}
+
+zhash_t *
+fmq_manifest_entries (fmq_manifest_t *self, const char *vdir)
+{
+    return (zhash_t *) zhash_lookup (self->dirs, vdir);
+}
@@ -33,6 +33,8 @@
         cache               hash        File SHA-1 signatures
 
     ICANHAZ_OK - Server confirms the subscription
+        path                longstr     Directory the manifest lists, if any
+        headers             hash        Manifest entries, name to digest
 
     NOM - Client sends credit to the server
         credit              number 8    Credit, in bytes
@@ -40,12 +42,12 @@
 
     CHEEZBURGER - The server sends a file chunk
         sequence            number 8    File offset in bytes
-        operation           number 1    Create=%d1 delete=%d2
+        operation           number 1    Create=%d1 delete=%d2 delta=%d3 batch=%d4
         filename            longstr     Relative name of file
         offset              number 8    File offset in bytes
         eof                 number 1    Last chunk in file?
         headers             hash        File properties
-        chunk               chunk       Data chunk
+        chunk               chunk       Data chunk, may follow in its own frame
 
     HUGZ - Client sends a heartbeat
 
@@ -67,6 +69,8 @@
 #define FMQ_MSG_VERSION                     2
 #define FMQ_MSG_FILE_CREATE                 1
 #define FMQ_MSG_FILE_DELETE                 2
+#define FMQ_MSG_FILE_DELTA                  3
+#define FMQ_MSG_FILE_BATCH                  4
 
 #define FMQ_MSG_OHAI                        1
 #define FMQ_MSG_OHAI_OK                     4
@@ -162,11 +166,52 @@ zchunk_t *fmq_msg_chunk (fmq_msg_t *self);
 zchunk_t *fmq_msg_get_chunk (fmq_msg_t *self);
 /* Set the chunk field, transferring ownership from caller */
 void fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p);
+/* Set the chunk field to caller memory that is sent without copying.
+ * free_fn (data, hint) is called once ZeroMQ is done with the data, or
+ * when the chunk is replaced before being sent */
+void fmq_msg_set_chunk_data (fmq_msg_t *self, void *data, size_t size,
+                             zmq_free_fn *free_fn, void *hint);
 
 /* Get/set the reason field */
 const char *fmq_msg_reason (fmq_msg_t *self);
 void fmq_msg_set_reason (fmq_msg_t *self, const char *value);
 
+/* Block checksums for delta transfers. The weak sum is the rsync rolling
+ * checksum; roll it forward one byte with fmq_msg_weak_roll. The strong
+ * sum is the leading 8 bytes of the block's SHA-1 */
+uint32_t fmq_msg_weak_sum (const byte *data, size_t size);
+uint32_t fmq_msg_weak_roll (uint32_t weak, size_t size, byte out, byte in);
+uint64_t fmq_msg_strong_sum (const byte *data, size_t size);
+
+/* Chunk compression. fmq_msg_codecs lists the codecs we have, best first,
+ * as the client offers them in ICANHAZ. A packed chunk goes out with
+ * "codec" and "raw" headers, raw being its unpacked size */
+const char *fmq_msg_codecs (void);
+zchunk_t *fmq_msg_pack (const char *codec, const byte *data, size_t size);
+zchunk_t *fmq_msg_unpack (const char *codec, zchunk_t *chunk, size_t raw);
+
+/* Batch of small files, whole, in one chunk, which a CHEEZBURGER carries
+ * with operation FMQ_MSG_FILE_BATCH. fmq_msg_batch_add returns -1 if the
+ * file doesn't fit in what's left of the chunk. fmq_msg_batch_next gets
+ * the file at *offset and moves past it, returning false at the end; the
+ * caller frees filename, and data points into the batch */
+size_t fmq_msg_batch_size (const char *filename, size_t size);
+int fmq_msg_batch_add (zchunk_t *batch, const char *filename, const byte *data, size_t size);
+bool fmq_msg_batch_next (zchunk_t *batch, size_t *offset, char **filename,
+                         const byte **data, size_t *size);
+
+/* Merkle manifest of files by virtual path, for resync. Add files with
+ * their SHA-1 digests, then seal it to work out directory digests.
+ * Directory paths end in '/'; their entries map names to digests, and
+ * subdirectories' names end in '/' too */
+typedef struct _fmq_manifest_t fmq_manifest_t;
+fmq_manifest_t *fmq_manifest_new (void);
+void fmq_manifest_destroy (fmq_manifest_t **self_p);
+void fmq_manifest_add (fmq_manifest_t *self, const char *vpath, const char *digest);
+void fmq_manifest_seal (fmq_manifest_t *self);
+const char *fmq_manifest_digest (fmq_manifest_t *self, const char *vdir);
+zhash_t *fmq_manifest_entries (fmq_manifest_t *self, const char *vdir);
+
 //  For backwards compatibility with old codecs
 #define fmq_msg_dump        fmq_msg_print
 
@@ -21,10 +21,54 @@
  *
  */
 #include <tch_server.h>
+#include <tch_auto_config.h>
+#include <sys/mman.h>
+#include <strings.h>
+#include <dirent.h>
 
-//  There's no point making these configurable
+#if (TCH_HAVE_INOTIFY)
+#include <sys/inotify.h>
+
+//  Events we watch for on every directory of a mount. IN_MODIFY catches
+//  writers that keep a file open, like log appenders, which never close
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO \
+                        | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+#endif
+
+//  Default chunk size, and smallest size of blocks in the chunk cache
 #define CHUNK_SIZE      1000000
 
+//  Smallest file we pack chunks of
+#define COMPRESS_MIN    4096
+
+//  Bytes a worker reads ahead when it rolls over a file it doesn't map
+#define WINDOW_SIZE     (4 * CHUNK_SIZE)
+
+//  Suffix of file next to a mount where we keep its digests
+#define DIGESTS_SUFFIX  ".fmqdigests"
+
+//  Files a client keeps in its inbox while receiving; when a relay
+//  serves its inbox on, they aren't to go any further
+#define JOURNAL_SUFFIX  ".fmqpart"
+#define TEMP_SUFFIX     ".fmqtmp"
+
+//  Least time between two saves of a mount's digests, msecs
+#define DIGESTS_SAVE    10000
+
+//  Priorities a subscription may ask for, higher ones go first
+#define PRIORITIES      8
+
+//  Bytes a client, or one of its priorities, sends per round for each
+//  unit of weight
+#define SHARE_QUANTUM   1000000
+
+//  Files smaller than this go ahead of a big file set aside in their queue
+#define SMALL_FILE      65536
+
+//  Bytes of routing id we pick a shard by; a client names its data
+//  streams after its connection, so they all land on the same shard
+#define SHARD_KEY       32
+
 /* State machine constants */
 typedef enum {
     start_state = 1,
@@ -82,6 +126,20 @@ typedef struct tch_svsub_s      tch_svsub_t;
 typedef struct tch_svclient_s   tch_svclient_t;
 typedef struct tch_mount_s      tch_mount_t;
 typedef struct tch_sv_client_s  tch_sv_client_t;
+typedef struct tch_svclients_s  tch_svclients_t;
+typedef struct tch_svmap_s      tch_svmap_t;
+typedef struct tch_svchunk_s    tch_svchunk_t;
+typedef struct tch_svsig_s      tch_svsig_t;
+typedef struct tch_svop_s       tch_svop_t;
+typedef struct tch_svjob_s      tch_svjob_t;
+typedef struct tch_svdigest_s   tch_svdigest_t;
+typedef struct tch_svnode_s     tch_svnode_t;
+typedef struct tch_svsnap_s     tch_svsnap_t;
+typedef struct tch_svshard_s    tch_svshard_t;
+typedef struct tch_svqueue_s    tch_svqueue_t;
+typedef struct tch_svscan_s     tch_svscan_t;
+typedef struct tch_svrecord_s   tch_svrecord_t;
+typedef struct tch_svwindow_s   tch_svwindow_t;
 
 /* This structure defines the context for each running server. Store
  * whatever properties and structures you need for the server. */
@@ -89,6 +147,44 @@ struct tch_server_s {
     zsock_t     *pipe;              //  Actor pipe back to caller
     zconfig_t   *config;            //  Current loaded configuration
     zlist_t     *mounts;            //  Mount points
+    tch_svnode_t *tree;             //  Mounts and subscriptions, by path
+    zhash_t     *maps;              //  Files mapped for sending, by key
+    zhash_t     *sigs;              //  Shared block signatures, by key
+    zlist_t     *workers;           //  Disk I/O workers, NULL until started
+    zlist_t     *idle;              //  Workers waiting for a job
+    zlist_t     *backlog;           //  Jobs waiting for a worker
+    zhash_t     *sessions;          //  Clients taking extra streams, by session
+    uint64_t    stalls;             //  Times clients ran out of credit
+    int64_t     stall_time;         //  Time clients waited for credit, usecs
+    uint64_t    packed_raw;         //  Bytes sent packed, before packing
+    uint64_t    packed_wire;        //  Bytes sent packed, after packing
+    uint64_t    deduped;            //  Bytes clients copied, not fetched
+    zlist_t     *shards;            //  Shard reactors, NULL unless sharded
+    zlistx_t    *turns;             //  Clients waiting for the next round
+    bool        round_due;          //  Next round is set to start
+    uint64_t    round;              //  Rounds so far
+    size_t      sharing;            //  Clients yet to use their share
+    uint64_t    egress;             //  Most bytes per second we send, or 0
+    int64_t     egress_tokens;      //  Bytes egress budget lets us send now
+    int64_t     egress_at;          //  When we last added tokens, usecs
+    size_t      active;             //  Clients admitted to send files
+    size_t      active_limit;       //  Most clients sending at once, or 0
+    zlistx_t    *admission;         //  Clients waiting to send, in order
+    bool        admit_due;          //  Admission is set to run
+};
+
+/* Patches of one priority waiting for a client, and the file of that
+ * priority we set aside when another queue took its turn mid-file */
+struct tch_svqueue_s {
+    zlistx_t        *patches;       //  Patches to send, oldest first
+    zhash_t         *queued;        //  Patch handles in patches, by vpath
+    zdir_patch_t    *patch;         //  Patch set aside, if any
+    zfile_t         *file;          //  Its file
+    tch_svmap_t     *map;           //  Its mapping, if any
+    tch_mount_t     *mount;         //  Mount it comes from
+    off_t           offset;         //  Offset of its next chunk
+    bool            compress;       //  Packing its chunks
+    int64_t         deficit;        //  Bytes queue may send this round
 };
 
 /* This structure defines the state for each client connection. It will
@@ -98,12 +194,66 @@ struct tch_svclient_s {
     fmq_msg_t       *message;       //  Message in and out
 
     //  Properties not generated by gsl
+    zlist_t         *subs;          //  Our subscriptions
     uint64_t        credit;         //  Credit remaining
-    zlist_t         *patches;       //  Patches to send
+    tch_svqueue_t   queues [PRIORITIES];    //  Patches to send, by priority
+    size_t          level;          //  Priority of current patch
     zdir_patch_t    *patch;         //  Current patch
     zfile_t         *file;          //  Current file we're sending
+    tch_svmap_t     *map;           //  Current file mapped, if any
+    tch_mount_t     *mount;         //  Mount current file comes from
     off_t           offset;         //  Offset of next read in file
     uint64_t        sequence;       //  Sequence number for chunck
+    size_t          chunk_size;     //  Chunk size for this client
+    size_t          chunk_min;      //  Smallest chunk size we'll use
+    size_t          chunk_max;      //  Largest chunk size we'll use
+    size_t          chunk_time;     //  Time a chunk should take, msecs
+    uint64_t        rate;           //  Client's intake, bytes per second
+    int64_t         nom_at;         //  Time of last NOM, usecs
+    uint64_t        acked;          //  Last chunk client says it wrote
+    uint64_t        stalls;         //  Times we ran out of credit
+    int64_t         stall_at;       //  When we ran out of credit, usecs
+    int64_t         stall_time;     //  Time spent waiting for credit, usecs
+    zhash_t         *resume;        //  Partial files, vpath to digest/offset
+    size_t          delta_block;    //  Delta block size, 0 if client has none
+    zhash_t         *sigs;          //  Signatures of client's files, by vpath
+    bool            delta;          //  Sending current file as delta
+    tch_svop_t      *ops;           //  Delta operations for current file
+    size_t          op_count;       //  Number of delta operations
+    size_t          op_index;       //  Operation we're sending
+    size_t          op_done;        //  Bytes of operation sent so far
+    tch_svchunk_t   *waiting;       //  Chunk we're waiting for, if any
+    char            *session;       //  Session our streams join, if any
+    size_t          stream_limit;   //  Most streams we take for session
+    zlist_t         *streams;       //  Extra data streams, if any
+    tch_svclient_t  *primary;       //  Client we're a stream of, if any
+    bool            striping;       //  Striping current file over streams
+    off_t           stripe_start;   //  Offset striping started at
+    uint64_t        stripe_bytes;   //  Bytes of file sent over all streams
+    bool            ranged;         //  Sending a range of the file only
+    off_t           range_start;    //  Start of range client asked for
+    off_t           range_end;      //  End of range client asked for
+    char            codec [8];      //  Codec client unpacks, or empty
+    bool            compress;       //  Packing chunks of current file
+    tch_svjob_t     *packing;       //  Chunk away being packed, if any
+    tch_svjob_t     *packed;        //  Chunk packed, waiting to go out
+    tch_svjob_t     *matching;      //  Delta away being worked out, if any
+    tch_svjob_t     *matched;       //  Delta worked out, waiting to start
+    bool            dedupe;         //  Client copies content it has
+    bool            batch;          //  Client takes small files in batches
+    zhash_t         *holds;         //  Digest of each file client has, by vpath
+    zhash_t         *held;          //  A file client has, by digest
+    char            *basis;         //  Client's file delta works on, if another
+    size_t          weight;         //  Share of server, in quanta per round
+    int64_t         share;          //  Bytes we may send this round
+    uint64_t        round;          //  Round we last got our share for
+    bool            sharing;        //  Sending on share, counted by server
+    void            *turn;          //  Our place waiting for next round
+    uint64_t        rate_cap;       //  Most bytes per second, 0 if no cap
+    int64_t         tokens;         //  Bytes the cap lets us send now
+    int64_t         tokens_at;      //  When we last added tokens, usecs
+    bool            admitted;       //  We hold one of the server's slots
+    void            *admission;     //  Our place waiting for a slot
 };
 
 /* Subscription object */
@@ -111,14 +261,191 @@ struct tch_svsub_s {
     tch_svclient_t  *client;        //  Always refers to live client
     char            *path;          //  Path client is subscribed to
     zhash_t         *cache;         //  Client's cache list
+    tch_svnode_t    *node;          //  Node of path tree we hang off
+    void            *handle;        //  Our place in the node's list
+    size_t          priority;       //  Priority of patches we queue
+};
+
+/* Node of the path tree, one per path segment. Mounts and subscriptions
+ * hang off the node for their path, so finding the mount for a path, or
+ * the subscribers to a patch, costs one step per segment plus one per
+ * subscription found, however many there are in all */
+struct tch_svnode_s {
+    tch_svnode_t    *parent;        //  Parent node, NULL for the root
+    char            *name;          //  Path segment, empty for the root
+    zhash_t         *children;      //  Child nodes by segment, or NULL
+    tch_mount_t     *mount;         //  Mount at this path, if any
+    zlistx_t        *subs;          //  Subscriptions to this path, or NULL
+    size_t          below;          //  Subscriptions here and below
+};
+
+/* File we're sending, shared by all clients sending it. It's mapped
+ * into memory if server/mmap is set, else we keep it open and read it.
+ * Every chunk in flight holds a reference, as do jobs, and the maps
+ * table while any client is still sending the file. ZeroMQ drops chunk
+ * references from its I/O thread, so the count is atomic; clients is
+ * server-side only */
+struct tch_svmap_s {
+    char            *key;           //  File name, size and mtime
+    byte            *data;          //  Mapped file contents, or NULL
+    int             handle;         //  File we read instead, or -1
+    size_t          size;           //  Size of file
+    size_t          clients;        //  Clients sending this file
+    volatile int    refs;           //  References to the mapping
+};
+
+/* Part of a file we roll over on a worker, for files we read rather
+ * than map. A window belongs to one worker, and lives for one job */
+struct tch_svwindow_s {
+    byte            *data;          //  Bytes of file we read
+    size_t          limit;          //  Bytes allocated
+    uint64_t        offset;         //  Offset of data in file
+    size_t          size;           //  Bytes of data we have
+};
+
+/* Chunk held in a mount's chunk cache. The cache holds one reference
+ * until the chunk is evicted, and every copy in flight holds another */
+struct tch_svchunk_s {
+    char            *key;           //  File name, size, mtime and offset
+    zchunk_t        *chunk;         //  Chunk as read from disk
+    off_t           offset;         //  Offset of chunk in file
+    void            *handle;        //  Position in LRU list, if cached
+    volatile int    refs;           //  References to the chunk
+    zlist_t         *waiters;       //  Clients waiting while chunk loads
+};
+
+/* Job for a disk I/O worker. The job and everything it points to belong
+ * to the worker until it hands the job back */
+struct tch_svjob_s {
+    tch_mount_t     *mount;         //  Mount the job is for
+    tch_svchunk_t   *chunk;         //  Chunk to load, or NULL
+    zfile_t         *file;          //  File to load chunk from
+    zchunk_t        *data;          //  Data loaded
+    zlist_t         *patches;       //  Patches being digested, or NULL
+    zlist_t         *digests;       //  Digests to take for the patches
+    tch_svclient_t  *client;        //  Client to pack chunk for, if any
+    tch_svmap_t     *map;           //  File to pack chunk from
+    zchunk_t        *raw;           //  Chunk as read, if it didn't pack
+    off_t           offset;         //  Offset of chunk to pack
+    size_t          size;           //  Size of chunk to load or pack
+    char            codec [8];      //  Codec to pack chunk with
+    tch_svsig_t     *sig;           //  Signatures to take, or match against
+    bool            match;          //  Match file against sig for delta
+    tch_svop_t      *ops;           //  Delta operations we matched
+    size_t          op_count;       //  Number of delta operations
+};
+
+/* Digest of one file in a mount. We hash a file again only when its
+ * inode, size or modification time changed since we last did */
+struct tch_svdigest_s {
+    char            *vpath;         //  Virtual path of file
+    char            *path;          //  Physical path, until hashed
+    uint64_t        inode;          //  Inode number of file
+    uint64_t        size;           //  Size of file, bytes
+    int64_t         mtime;          //  Modification time, nsecs
+    char            *digest;        //  SHA-1 digest, NULL if not taken
+};
+
+/* Block signatures of one version of a file, for delta transfers. We
+ * keep the signatures of what each delta client holds, and share them
+ * between clients that got the same version */
+struct tch_svsig_s {
+    char            *key;           //  Key in server table, if shared
+    zhash_t         *table;         //  Server table holding us, if shared
+    size_t          refs;           //  Clients holding these signatures
+    size_t          block;          //  Block size
+    size_t          count;          //  Number of whole blocks
+    uint32_t        *weak;          //  Rolling checksum of each block
+    uint64_t        *strong;        //  Strong checksum of each block
+    int32_t         *bucket;        //  First block for weak sum, or -1
+    int32_t         *chain;         //  Next block with same bucket, or -1
+    size_t          buckets;        //  Size of bucket table, power of two
+    bool            ready;          //  Sums are in, not still being taken
+};
+
+/* Delta operation: send literal data, or copy a block range the client
+ * already has. Ranges that stay where they are aren't sent at all */
+struct tch_svop_s {
+    uint64_t        offset;         //  Offset in new file
+    uint64_t        source;         //  Offset in client's copy, for copies
+    uint64_t        size;           //  Size of range
+    bool            literal;        //  Literal data, or copy
+};
+
+/* A mount's files and their digests as they stood when the front reactor
+ * sent a batch of patches. Nobody changes a snapshot once it's out; each
+ * shard drops its reference when the next one arrives, and the last one
+ * frees it. Entries are virtual path and digest pairs, sorted by path;
+ * the digest is NULL for a file the front hadn't digested yet */
+struct tch_svsnap_s {
+    char            **entries;      //  Path, digest, path, digest...
+    size_t          count;          //  Number of files
+    volatile int    refs;           //  Shards holding the snapshot
+    bool            partial;        //  Front hadn't digested every file
+};
+
+/* Snapshot of the files in a mount. Records are sorted by path relative
+ * to the mount, and each keeps only what its path doesn't share with the
+ * one before, so the whole scan packs into one buffer a few tens of bytes
+ * a file. A record is: shared prefix length, suffix length, suffix, size
+ * and mtime, numbers as varints. */
+struct tch_svscan_s {
+    byte            *data;          //  Packed records
+    size_t          size;           //  Bytes of records
+    size_t          limit;          //  Bytes allocated
+    size_t          count;          //  Number of files
+    char            last [PATH_MAX];    //  Path of last record added
+};
+
+/* Cursor reading a scan's records in order */
+struct tch_svrecord_s {
+    tch_svscan_t    *scan;          //  Scan we read, or NULL
+    size_t          offset;         //  Where the next record starts
+    bool            valid;          //  We're on a record
+    char            path [PATH_MAX];    //  Record's relative path
+    uint64_t        size;           //  Size of file, bytes
+    int64_t         mtime;          //  Modification time, nsecs
+};
+
+/* What a shard reactor starts from; valid until the shard signals */
+struct tch_svshard_s {
+    const char      *endpoint;      //  Link to front reactor
+    zconfig_t       *config;        //  Front's configuration, we copy it
+    bool            verbose;        //  Verbose logging enabled?
+    char            *log_prefix;    //  Default log prefix
 };
 
 /* Mount point in memory */
 struct tch_mount_s {
+    tch_server_t *server;          //  Parent server
     char        *location;         //  Physical location
     char        *alias;            //  Alias into our tree
-    zdir_t      *dir;              //  Directory snapshot
-    zlist_t     *subs;             //  Client subscriptions
+    tch_svnode_t *node;            //  Node of path tree for alias
+    tch_svscan_t *scan;            //  Files as of last rescan
+    int         watch;             //  inotify descriptor, -1 if polling
+    zhash_t     *watches;          //  Watch descriptor to directory path
+    zhash_t     *changes;          //  Pending changes, path to operation
+    zhash_t     *notified;         //  Virtual paths sent since last rescan
+    bool        rescan;            //  Watcher lost track, rescan tree
+    bool        overflow;          //  Kernel dropped events, trust nothing
+    size_t      interval;          //  Consistency rescan interval, msecs
+    int64_t     rescan_at;         //  Time of next consistency rescan
+    zhash_t     *chunks;           //  Cached chunks, by key
+    zlistx_t    *chunk_lru;        //  Cached chunks, least recent first
+    size_t      chunk_bytes;       //  Bytes held in chunk cache
+    size_t      chunk_limit;       //  Chunk cache limit, 0 disables
+    size_t      chunk_block;       //  Size of blocks in chunk cache
+    bool        digesting;         //  Patches are out being digested
+    zhash_t     *digests;          //  File digests, by virtual path
+    char        *digests_file;     //  Where we keep digests, or NULL
+    bool        digests_dirty;     //  Digests changed since last save
+    int64_t     digests_save_at;   //  Earliest time of next save
+    bool        replica;           //  Shard's copy of a front mount
+    tch_svsnap_t *snap;            //  Digests from the front, if replica
+    bool        seeding;           //  Files we mounted with need digests
+    fmq_manifest_t *manifest;      //  Merkle manifest, NULL until asked for
+    bool        manifest_dirty;    //  Digests changed since we built it
+    bool        snap_dirty;        //  Digests changed since shards heard
 };
 
 /* Context for the whole server task. This embeds the application-level
@@ -131,12 +458,16 @@ struct tch_s_server_s {
     int             port;              //  Server port bound to
     zloop_t         *loop;             //  Reactor for server sockets
     fmq_msg_t       *message;          //  Message received or sent
-    zhash_t         *clients;          //  Clients we're connected to
+    tch_svclients_t *clients;          //  Clients we're connected to
     zconfig_t       *config;           //  Configuration tree
     uint            client_id;         //  Client identifier counter
     size_t          timeout;           //  Default client expiry timeout
     bool            verbose;           //  Verbose logging enabled?
     char            *log_prefix;       //  Default log prefix
+    zsock_t         **links;           //  Link to each shard, if sharded
+    size_t          link_count;        //  Number of shards
+    uint64_t        messages;          //  Protocol messages handled
+    int64_t         started;           //  When we started, usecs
 };
 
 /* Context for each connected client. This embeds the application-level
@@ -145,7 +476,7 @@ struct tch_s_server_s {
 struct tch_sv_client_s{
     tch_svclient_t  client;             //  Application-level client context
     tch_s_server_t  *server;            //  Parent server context
-    char            *hashkey;           //  Key into server->clients hash
+    uint32_t        hash;               //  Hash of routing_id, in server->clients
     zframe_t        *routing_id;        //  Routing_id back to client
     uint            unique_id;          //  Client identifier in server
     state_t         state;              //  Current state
@@ -158,19 +489,36 @@ struct tch_sv_client_s{
     char            log_prefix [41];    //  Log prefix string
 };
 
+/* Clients by routing id. This is open addressing with linear probing,
+ * keyed on the routing id bytes, so finding the sender of a message
+ * allocates nothing. Slots of removed clients are marked deleted, and
+ * cleaned out when the table is rebuilt */
+struct tch_svclients_s {
+    tch_sv_client_t **slots;        //  Client in each slot, or NULL
+    size_t          size;           //  Number of slots, power of two
+    size_t          count;          //  Clients in table
+    size_t          used;           //  Slots in use, counting deleted ones
+};
+
+//  Marks slot of a client we removed, so probes carry on past it
+static char s_client_deleted;
+#define CLIENT_DELETED  ((tch_sv_client_t *) &s_client_deleted)
+
 static int server_initialize(tch_server_t *self);
 static void server_terminate (tch_server_t *self);
 static zmsg_t *server_method (tch_server_t *self, const char *method, zmsg_t *msg);
 static int monitor_the_server(zloop_t *loop, int timer_id, void *arg);
-static void sub_patch_add(tch_svsub_t *self, zdir_patch_t *patch);
+static void sub_patch_add(tch_svsub_t *self, zdir_patch_t *patch, const char *digest);
 static void sub_destroy (tch_svsub_t **self_p);
 static void engine_set_monitor(tch_server_t *server, size_t interval, zloop_timer_fn monitor);
+static void engine_set_alarm (tch_server_t *server, size_t delay, zloop_timer_fn handler);
 static void engine_broadcast_event(tch_server_t *server, tch_svclient_t *client, event_t event);
 static void engine_set_next_event (tch_svclient_t *client, event_t event);
 static void engine_set_exception (tch_svclient_t *client, event_t event);
 static void engine_set_wakeup_event (tch_svclient_t *client, size_t delay, event_t event);
 static void engine_send_event (tch_svclient_t *client, event_t event);
 static void engine_handle_socket (tch_server_t *server, void *sock, zloop_reader_fn handler);
+static void engine_handle_fd (tch_server_t *server, int fd, zloop_fn handler, void *arg);
 static void engine_set_log_prefix (tch_svclient_t *client, const char *string);
 static void engine_configure (tch_server_t *server, const char *path, const char *value);
 static bool engine_verbose (tch_server_t *server);
@@ -178,16 +526,145 @@ static event_t s_protocol_event (fmq_msg_t *message);
 static tch_sv_client_t *s_client_new (tch_s_server_t *server, zframe_t *routing_id);
 static void s_client_execute(tch_sv_client_t *self, event_t event);
 static void s_client_destroy (tch_sv_client_t **self_p);
-static void s_client_free (void *argument);
+static tch_svclients_t *s_clients_new (size_t size);
+static void s_clients_destroy (tch_svclients_t **self_p);
+static tch_sv_client_t *s_clients_lookup (tch_svclients_t *self, zframe_t *routing_id, uint32_t hash);
+static void s_clients_insert (tch_svclients_t *self, tch_sv_client_t *client);
+static void s_clients_delete (tch_svclients_t *self, tch_sv_client_t *client);
+static void s_clients_rebuild (tch_svclients_t *self, size_t size);
+static uint32_t s_routing_id_hash (zframe_t *routing_id);
+static uint32_t s_fnv_hash (const byte *data, size_t size);
 static int s_client_handle_wakeup (zloop_t *loop, int timer_id, void *argument);
 static int s_client_handle_ticket (zloop_t *loop, int timer_id, void *argument);
 static void store_client_subscription (tch_svclient_t *self);
 static void store_client_credit (tch_svclient_t *self);
-static tch_mount_t *mount_new (char *location, char *alias);
-static bool mount_refresh(tch_mount_t *self, tch_server_t *server);
-static void mount_sub_store (tch_mount_t *self, tch_svclient_t *client, fmq_msg_t *request);
-static void mount_sub_purge (tch_mount_t *self, tch_svclient_t *client);
+static tch_mount_t *mount_new (tch_server_t *server, char *location, char *alias);
+static bool mount_refresh (tch_mount_t *self, tch_server_t *server);
+static zlist_t *mount_rescan (tch_mount_t *self);
+static void mount_watch_start (tch_mount_t *self);
+static void mount_watch_stop (tch_mount_t *self);
+#if (TCH_HAVE_INOTIFY)
+static int mount_watch_tree (tch_mount_t *self, const char *path);
+static void mount_watch_forget (tch_mount_t *self, const char *path);
+static int mount_watch_handle (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+static zlist_t *mount_watch_patches (tch_mount_t *self);
+#endif
+static bool mount_subscribed (tch_mount_t *self);
+static void client_sub_store (tch_svclient_t *self, fmq_msg_t *request);
+static tch_svnode_t *node_new (tch_svnode_t *parent, const char *name);
+static void node_destroy (tch_svnode_t **self_p);
+static tch_svnode_t *node_require (tch_svnode_t *self, const char *path);
+static void node_count (tch_svnode_t *self, int delta);
+static void node_prune (tch_svnode_t *self);
+static const char *s_path_next (const char *path, char *name);
+static bool s_path_covers (const char *path, const char *vpath);
+static bool s_path_private (const char *vpath);
+static void mount_patches_filter (zlist_t *patches);
+static void mount_sub_catchup (tch_mount_t *self, tch_svsub_t *sub);
+static void client_sub_catchup (tch_svclient_t *self, tch_svsub_t *sub);
+static zdir_patch_t *mount_patch (tch_mount_t *self, const char *vpath);
+static void mount_digests_seed (tch_mount_t *self, zlist_t *digests);
+static bool mount_digests_complete (tch_mount_t *self);
+static zdir_patch_t *mount_file_patch (tch_mount_t *self, const char *name, int op);
+static tch_svscan_t *mount_scan (tch_mount_t *self, zlist_t *patches);
+static void mount_scan_walk (tch_mount_t *self, tch_svscan_t *scan, char *path, size_t length, tch_svrecord_t *old, zlist_t *patches);
+static void mount_scan_file (tch_mount_t *self, tch_svscan_t *scan, const char *path, struct stat *stat_buf, tch_svrecord_t *old, zlist_t *patches);
+static tch_svscan_t *scan_new (void);
+static void scan_destroy (tch_svscan_t **self_p);
+static void scan_append (tch_svscan_t *self, const char *path, uint64_t size, int64_t mtime);
+static bool scan_first (tch_svscan_t *self, tch_svrecord_t *record);
+static bool scan_next (tch_svrecord_t *record);
+static void s_varint_put (tch_svscan_t *scan, uint64_t value);
+static uint64_t s_varint_get (tch_svrecord_t *record);
+static void mount_digest_check (tch_mount_t *self, const char *vpath, const char *path, bool deleted, zlist_t *digests);
+static fmq_manifest_t *mount_manifest (tch_mount_t *self);
+static tch_mount_t *mount_sole (tch_server_t *server, const char *path);
+static void client_manifest (tch_svclient_t *self, tch_mount_t *mount, const char *path, const char *digest);
+static void client_resync (tch_svclient_t *self, const char *path, zhash_t *options);
 static void mount_destroy (tch_mount_t **self_p);
+static tch_mount_t *mount_replica (tch_server_t *server, char *location, char *alias, tch_svsnap_t *snap);
+static tch_mount_t *mount_replica_lookup (tch_server_t *server, const char *location, const char *alias);
+static void mount_replicate (tch_mount_t *self, zactor_t *shard);
+static void mount_publish (tch_mount_t *self, zlist_t *patches);
+static tch_svsnap_t *snap_new (tch_mount_t *mount, int refs);
+static const char *snap_lookup (tch_svsnap_t *self, const char *vpath);
+static void snap_release (tch_svsnap_t **self_p);
+static int s_snap_compare (const void *item1, const void *item2);
+static void *s_msg_popptr (zmsg_t *msg);
+static tch_mount_t *mount_lookup (tch_server_t *server, const char *vpath);
+static tch_svchunk_t *mount_chunk (tch_mount_t *self, tch_svclient_t *client, zfile_t *file, off_t offset);
+static void mount_chunk_loaded (tch_mount_t *self, tch_svjob_t *job);
+static bool mount_distribute (tch_mount_t *self, zlist_t *patches);
+static void mount_chunks_drop (tch_mount_t *self, const char *path);
+static size_t mount_chunk_block (tch_server_t *server);
+static void mount_chunk_evict (tch_mount_t *self, tch_svchunk_t *chunk);
+static void chunk_release (void *data, void *hint);
+static zlist_t *mount_digests_check (tch_mount_t *self, zlist_t *patches);
+static void mount_digests_store (tch_mount_t *self, zlist_t **digests_p);
+static const char *mount_digest (tch_mount_t *self, const char *vpath);
+static void mount_digests_load (tch_mount_t *self);
+static void mount_digests_save (tch_mount_t *self);
+static void digest_take (tch_svdigest_t *self);
+static void digest_destroy (void *argument);
+static zhash_t *client_patch_headers (tch_svclient_t *self);
+static const char *client_patch_digest (tch_svclient_t *self);
+static size_t client_chunk_limit (tch_svclient_t *self);
+static off_t client_resume_offset (tch_svclient_t *self);
+static void client_delta_match (tch_svclient_t *self, tch_svsig_t *sig);
+static void client_delta_start (tch_svclient_t *self);
+static void client_file_start (tch_svclient_t *self);
+static void s_delta_match (tch_svsig_t *sig, tch_svmap_t *map, tch_svop_t **ops_p, size_t *count_p);
+static void client_delta_send (tch_svclient_t *self);
+static size_t client_file_slice (tch_svclient_t *self, tch_svclient_t *sender, off_t offset, size_t size);
+static void client_file_sent (tch_svclient_t *self);
+static void client_stripe_start (tch_svclient_t *self);
+static bool client_stripe_ready (tch_svclient_t *self);
+static bool client_stripe_send (tch_svclient_t *self, tch_svclient_t *sender);
+static void client_streams_attach (tch_svclient_t *self, zhash_t *options);
+static void client_streams_detach (tch_svclient_t *self);
+static void client_range_start (tch_svclient_t *self, const char *vpath, const char *value);
+static void client_codec_pick (tch_svclient_t *self, const char *offered);
+static void client_holds (tch_svclient_t *self, const char *vpath, const char *digest);
+static bool client_dedupe (tch_svclient_t *self);
+static tch_svsig_t *client_delta_basis (tch_svclient_t *self);
+static bool client_compressible (tch_svclient_t *self);
+static tch_svjob_t *client_pack (tch_svclient_t *self, size_t size);
+static void client_pack_headers (tch_svclient_t *self, zchunk_t *packed, size_t raw);
+static size_t client_priority (zhash_t *options);
+static void client_queue (tch_svclient_t *self, size_t level, zdir_patch_t *patch);
+static void client_unqueue (tch_svclient_t *self, const char *vpath);
+static bool client_pending (tch_svclient_t *self);
+static void client_schedule (tch_svclient_t *self);
+static bool client_preemptible (tch_svclient_t *self);
+static void client_park (tch_svclient_t *self);
+static void client_unpark (tch_svclient_t *self, tch_svqueue_t *queue);
+static void client_charge (tch_svclient_t *self, uint64_t bytes);
+static bool client_turn (tch_svclient_t *self);
+static void client_wait (tch_svclient_t *self, size_t delay);
+static bool client_admitted (tch_svclient_t *self);
+static void client_release (tch_svclient_t *self);
+static int server_next_round (zloop_t *loop, int timer_id, void *arg);
+static void client_share_done (tch_svclient_t *self);
+static size_t client_weight (tch_svclient_t *self);
+static int server_admit (zloop_t *loop, int timer_id, void *arg);
+static void server_budget (tch_server_t *self);
+static size_t s_bucket_fill (int64_t *tokens, int64_t *filled_at, uint64_t rate);
+static void queue_clear (tch_svqueue_t *self, tch_server_t *server);
+static void client_patch_send (tch_svclient_t *self);
+static bool client_batch_send (tch_svclient_t *self);
+static tch_svsig_t *sig_new (size_t block, size_t count);
+static tch_svsig_t *sig_parse (const char *value, size_t block);
+static tch_svsig_t *sig_require (tch_server_t *server, tch_svmap_t *map, size_t block);
+static void sig_index (tch_svsig_t *self);
+static void sig_fill (tch_svsig_t *self, tch_svmap_t *map);
+static int64_t sig_match (tch_svsig_t *self, uint32_t weak, const byte *data, uint64_t offset);
+static void sig_release (void *argument);
+static size_t server_workers (tch_server_t *self);
+static void server_workers_stop (tch_server_t *self);
+static void job_destroy (tch_svjob_t *job);
+static void server_job_post (tch_server_t *self, tch_svjob_t *job);
+static int server_job_done (zloop_t *loop, zsock_t *reader, void *argument);
+static void s_worker (zsock_t *pipe, void *args);
 static void check_for_client_data (tch_svclient_t *self);
 static int client_initialize (tch_svclient_t *self);
 static void client_terminate (tch_svclient_t *self);
@@ -198,10 +675,21 @@ static void s_server_destroy (tch_s_server_t **self_p);
 static void s_server_config_service (tch_s_server_t *self);
 static int s_server_handle_pipe (zloop_t *loop, zsock_t *reader, void *argument);
 static int s_server_handle_protocol (zloop_t *loop, zsock_t *reader, void *argument);
+static int s_server_handle_link (zloop_t *loop, zsock_t *reader, void *argument);
+static int s_frames_forward (zsock_t *from, zsock_t *to);
+static void s_server_shards_start (tch_s_server_t *self);
+static void s_shard (zsock_t *pipe, void *args);
 static int s_watch_server_config (zloop_t *loop, int timer_id, void *argument);
 static void s_satisfy_pedantic_compilers (void);
 static void get_next_patch_for_client (tch_svclient_t *self);
+static tch_svmap_t *map_open (tch_server_t *server, zfile_t *file);
+static void map_close (tch_server_t *server, tch_svmap_t **self_p);
+static const byte *map_window (tch_svmap_t *self, tch_svwindow_t *window, uint64_t offset, size_t want, size_t *have);
+static zchunk_t *map_read (tch_svmap_t *self, uint64_t offset, size_t size);
+static void s_pack (tch_svjob_t *job);
+static void map_release (void *data, void *hint);
 static tch_svsub_t *sub_new(tch_svclient_t *client, const char *path, zhash_t *cache);
+static void sub_cache_add (tch_svsub_t *self, zhash_t *cache);
 
 
 /* Allocate properties and structures for a new server instance.
@@ -212,6 +700,13 @@ server_initialize (tch_server_t *self)
     //  Construct properties here
     // zsys_notice("starting filemq service");
     self->mounts = zlist_new();
+    self->tree = node_new (NULL, "");
+    self->maps = zhash_new();
+    self->sigs = zhash_new();
+    self->sessions = zhash_new();
+    self->turns = zlistx_new ();
+    self->admission = zlistx_new ();
+    server_budget (self);
     /* Register with the engine a function that will be called
      * every second by the engine.*/
     engine_set_monitor (self, 1000, monitor_the_server);
@@ -230,12 +725,25 @@ engine_set_monitor (tch_server_t *server, size_t interval, zloop_timer_fn monito
     }
 }
 
+/* Register handler to call once, after 'delay' msecs; handler gets the
+ * server as argument */
+static void
+engine_set_alarm (tch_server_t *server, size_t delay, zloop_timer_fn handler)
+{
+    if (server) {
+        tch_s_server_t *self = (tch_s_server_t *) server;
+        int rc = zloop_timer (self->loop, delay, 1, handler, self);
+        assert (rc >= 0);
+    }
+}
+
 /* Monitor the servers published directories for changes */
 static int
 monitor_the_server (zloop_t *loop, int timer_id, void *arg)
 {
     tch_server_t *self = (tch_server_t *)arg;
     bool activity = false;
+    server_budget (self);
     tch_mount_t *mount = (tch_mount_t *)zlist_first(self->mounts);
     while (mount) {
         if (mount_refresh(mount, self))
@@ -253,44 +761,88 @@ static bool
 mount_refresh (tch_mount_t *self, tch_server_t *server)
 {
     //zsys_debug("mount_refresh: checking for changes to mount point");
-    bool activity = false;
+    zlist_t *patches;
 
-    //  Get latest snapshot and build a patches list for any changes
-    //  Load the server local path, no parent dir.
-    zdir_t *latest = zdir_new(self->location, NULL);
-    //zsys_debug("mount_refresh: old dir");
-    //zdir_print(self->dir, 2);
-    //zsys_debug("mount_refresh: new dir");
-    //zdir_print(latest, 2);
-    
-    //  Get list of patches using old and new dir with location as seen by
-    //  the client.
-    zlist_t *patches = zdir_diff(self->dir, latest, self->alias);
-
-    //  Go through the patches just received and print information about them
-    zdir_patch_t *tmppatch = (zdir_patch_t *)zlist_first(patches);
-    while (tmppatch) {
-        //zsys_debug("--- patch=%s, vpath=%s, op=%d", zdir_patch_path(tmppatch),
-        //    zdir_patch_vpath(tmppatch), zdir_patch_op(tmppatch));
-        //zfile_t *tmpfile = zdir_patch_file(tmppatch);
-        //zsys_debug("----- file name=%s", zfile_filename(tmpfile, NULL));
-        tmppatch = (zdir_patch_t *)zlist_next(patches);
-    }
-
-    //  Drop old directory and replace with latest version
-    zdir_destroy(&self->dir);
-    self->dir = latest;
-
-    //  Copy new patches to clients' patches list
-    tch_svsub_t *sub = (tch_svsub_t *)zlist_first(self->subs);
-    while (sub) {
-        zdir_patch_t *patch = (zdir_patch_t *)zlist_first(patches);
-        while (patch) {
-            sub_patch_add(sub, patch);
-            patch = (zdir_patch_t *)zlist_next(patches);
-            activity = true;
+    //  A replica changes only when the front reactor sends patches
+    if (self->replica)
+        return false;
+    //  Keep patches in order; pick up changes once digests are back
+    if (self->digesting)
+        return false;
+    if (self->digests_dirty && self->digests_file
+    &&  zclock_mono () >= self->digests_save_at)
+        mount_digests_save (self);
+
+#if (TCH_HAVE_INOTIFY)
+    //  While the watcher is healthy it already knows what changed, so
+    //  we only walk the whole tree now and then as a consistency check.
+    if (self->watch != -1 && !self->rescan && zclock_mono () < self->rescan_at)
+        patches = mount_watch_patches (self);
+    else
+#endif
+        patches = mount_rescan (self);
+    mount_patches_filter (patches);
+
+    //  Have a worker take the digests we don't have yet, so a big file
+    //  doesn't hold up the reactor; we hand out the patches when they come
+    //  back. Without subscribers nobody needs the digests yet.
+    zlist_t *digests = mount_digests_check (self, patches);
+    bool subscribed = mount_subscribed (self);
+    //  Files we don't take digests of now, we take when someone subscribes
+    if (zlist_size (digests) && !subscribed)
+        self->seeding = true;
+    if (self->seeding && subscribed)
+        mount_digests_seed (self, digests);
+    if (zlist_size (digests) && subscribed && server_workers (server)) {
+        tch_svjob_t *job = (tch_svjob_t *) zmalloc (sizeof (tch_svjob_t));
+        job->mount = self;
+        job->patches = patches;
+        job->digests = digests;
+        self->digesting = true;
+        server_job_post (server, job);
+        return false;
+    }
+    if (subscribed) {
+        tch_svdigest_t *digest = (tch_svdigest_t *) zlist_first (digests);
+        while (digest) {
+            digest_take (digest);
+            digest = (tch_svdigest_t *) zlist_next (digests);
+        }
+    }
+    mount_digests_store (self, &digests);
+    return mount_distribute (self, patches);
+}
+
+/* Copy new patches to clients' patches lists, and destroy them. Returns
+ * true if any client got patches. */
+static bool
+mount_distribute (tch_mount_t *self, zlist_t *patches)
+{
+    bool activity = false;
+    if (self->server->shards)
+        mount_publish (self, patches);
+    zdir_patch_t *patch = (zdir_patch_t *)zlist_first(patches);
+    while (patch) {
+        //  Walk down the patch's path; every subscription on the way
+        //  covers it, and we stop where nobody subscribes any deeper
+        const char *vpath = zdir_patch_vpath (patch);
+        const char *digest = mount_digest (self, vpath);
+        mount_chunks_drop (self, zfile_filename (zdir_patch_file (patch), NULL));
+        tch_svnode_t *node = self->server->tree;
+        char name [256];
+        while (node && node->below) {
+            tch_svsub_t *sub = node->subs?
+                (tch_svsub_t *) zlistx_first (node->subs): NULL;
+            while (sub) {
+                sub_patch_add (sub, patch, digest);
+                activity = true;
+                sub = (tch_svsub_t *) zlistx_next (node->subs);
+            }
+            vpath = s_path_next (vpath, name);
+            node = vpath && node->children?
+                (tch_svnode_t *) zhash_lookup (node->children, name): NULL;
         }
-        sub = (tch_svsub_t *)zlist_next(self->subs);
+        patch = (zdir_patch_t *)zlist_next(patches);
     }
 
     //  Destroy patches, they've all been copied
@@ -302,57 +854,492 @@ mount_refresh (tch_mount_t *self, tch_server_t *server)
     return activity;
 }
 
-/* Add patch to sub client patches list */
+/* Take a fresh snapshot of the mount and return the patches that turn
+ * the previous snapshot into it. Changes the watcher has published since
+ * the last rescan are dropped, unless the kernel lost events meanwhile. */
+static zlist_t *
+mount_rescan (tch_mount_t *self)
+{
+    //  Get latest snapshot, and patches for what changed since the last
+    //  one as we walk the tree
+    zlist_t *patches = zlist_new ();
+    tch_svscan_t *latest = mount_scan (self, patches);
+
+    //  Go through the patches just received and drop those the watcher
+    //  already delivered to subscribers
+    zdir_patch_t *patch = (zdir_patch_t *)zlist_first(patches);
+    while (patch) {
+        //zsys_debug("--- patch=%s, vpath=%s, op=%d", zdir_patch_path(patch),
+        //    zdir_patch_vpath(patch), zdir_patch_op(patch));
+        zdir_patch_t *next = (zdir_patch_t *)zlist_next(patches);
+        if (!self->overflow && zhash_lookup (self->notified, zdir_patch_vpath (patch))) {
+            zlist_remove (patches, patch);
+            zdir_patch_destroy (&patch);
+        }
+        patch = next;
+    }
+
+    //  Drop old snapshot and replace with latest version
+    scan_destroy (&self->scan);
+    self->scan = latest;
+
+    //  Snapshot now covers everything the watcher told us so far
+    zhash_destroy (&self->changes);
+    self->changes = zhash_new ();
+    zhash_autofree (self->changes);
+    zhash_destroy (&self->notified);
+    self->notified = zhash_new ();
+    self->rescan = false;
+    self->overflow = false;
+    self->rescan_at = zclock_mono () + self->interval;
+    return patches;
+}
+
+/* Walk the mount's tree into a new scan. With a patches list, we merge
+ * the old scan in as we go, in step with the walk, and add patches for
+ * files that were created, changed or deleted since. */
+static tch_svscan_t *
+mount_scan (tch_mount_t *self, zlist_t *patches)
+{
+    tch_svscan_t *scan = scan_new ();
+    tch_svrecord_t old;
+    if (patches)
+        scan_first (self->scan, &old);
+    else
+        old.valid = false;
+    char path [PATH_MAX] = "";
+    mount_scan_walk (self, scan, path, 0, &old, patches);
+    //  Whatever is left of the old scan is gone now
+    while (old.valid) {
+        zdir_patch_t *patch = mount_file_patch (self, old.path, patch_delete);
+        if (patch)
+            zlist_append (patches, patch);
+        scan_next (&old);
+    }
+    return scan;
+}
+
+//  Entry of directory we're walking, sorted so that we walk files in
+//  the same order as plain paths sort: a directory "a" comes after a file
+//  "a.txt", as "a/" does
+typedef struct {
+    char *name;                 //  Name, with '/' after a directory
+    struct stat stat_buf;       //  What stat told us
+} s_scan_entry_t;
+
+static int
+s_scan_entry_compare (const void *item1, const void *item2)
+{
+    return strcmp (((const s_scan_entry_t *) item1)->name,
+                   ((const s_scan_entry_t *) item2)->name);
+}
+
+/* Walk directory at path, relative to the mount, of length bytes, into
+ * scan. We hold only one directory's entries at each level. */
+static void
+mount_scan_walk (tch_mount_t *self, tch_svscan_t *scan, char *path, size_t length,
+                 tch_svrecord_t *old, zlist_t *patches)
+{
+    char *directory = zsys_sprintf ("%s/%s", self->location, path);
+    DIR *handle = opendir (directory);
+    if (!handle) {
+        zstr_free (&directory);
+        return;
+    }
+    s_scan_entry_t *entries = NULL;
+    size_t count = 0, limit = 0;
+    struct dirent *entry;
+    while ((entry = readdir (handle))) {
+        //  Hidden files and directories aren't published, as with zdir
+        if (entry->d_name [0] == '.')
+            continue;
+        if (count == limit) {
+            limit = limit? limit * 2: 64;
+            entries = (s_scan_entry_t *) realloc (entries, limit * sizeof (s_scan_entry_t));
+            assert (entries);
+        }
+        char *fullname = zsys_sprintf ("%s/%s", directory, entry->d_name);
+        if (stat (fullname, &entries [count].stat_buf) == 0
+        && (S_ISREG (entries [count].stat_buf.st_mode)
+        ||  S_ISDIR (entries [count].stat_buf.st_mode))) {
+            entries [count].name = zsys_sprintf ("%s%s", entry->d_name,
+                S_ISDIR (entries [count].stat_buf.st_mode)? "/": "");
+            count++;
+        }
+        zstr_free (&fullname);
+    }
+    closedir (handle);
+    zstr_free (&directory);
+    qsort (entries, count, sizeof (s_scan_entry_t), s_scan_entry_compare);
+
+    size_t index;
+    for (index = 0; index < count; index++) {
+        size_t name_length = strlen (entries [index].name);
+        if (length + name_length < PATH_MAX) {
+            memcpy (path + length, entries [index].name, name_length + 1);
+            if (S_ISDIR (entries [index].stat_buf.st_mode))
+                mount_scan_walk (self, scan, path, length + name_length, old, patches);
+            else
+                mount_scan_file (self, scan, path, &entries [index].stat_buf, old, patches);
+            path [length] = 0;
+        }
+        zstr_free (&entries [index].name);
+    }
+    free (entries);
+}
+
+/* Add file we walked to scan; and merge old scan up to it, which gives
+ * us the files that went away before it, and whether it's new or
+ * changed */
+static void
+mount_scan_file (tch_mount_t *self, tch_svscan_t *scan, const char *path,
+                 struct stat *stat_buf, tch_svrecord_t *old, zlist_t *patches)
+{
+    int64_t mtime = (int64_t) stat_buf->st_mtim.tv_sec * 1000000000
+                  + stat_buf->st_mtim.tv_nsec;
+    scan_append (scan, path, (uint64_t) stat_buf->st_size, mtime);
+    if (!patches)
+        return;
+    while (old->valid && strcmp (old->path, path) < 0) {
+        zdir_patch_t *patch = mount_file_patch (self, old->path, patch_delete);
+        if (patch)
+            zlist_append (patches, patch);
+        scan_next (old);
+    }
+    bool same = old->valid && streq (old->path, path)
+             && old->size == (uint64_t) stat_buf->st_size && old->mtime == mtime;
+    if (old->valid && streq (old->path, path))
+        scan_next (old);
+    if (!same) {
+        zdir_patch_t *patch = mount_file_patch (self, path, patch_create);
+        if (patch)
+            zlist_append (patches, patch);
+    }
+}
+
+/* Create empty scan */
+static tch_svscan_t *
+scan_new (void)
+{
+    return (tch_svscan_t *) zmalloc (sizeof (tch_svscan_t));
+}
+
+/* Destroy scan */
+static void
+scan_destroy (tch_svscan_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free ((*self_p)->data);
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+/* Add record to scan; paths must come in sorted order */
+static void
+scan_append (tch_svscan_t *self, const char *path, uint64_t size, int64_t mtime)
+{
+    size_t shared = 0;
+    while (self->last [shared] && self->last [shared] == path [shared])
+        shared++;
+    size_t suffix = strlen (path + shared);
+    s_varint_put (self, shared);
+    s_varint_put (self, suffix);
+    if (self->size + suffix > self->limit) {
+        self->limit = (self->size + suffix) * 2;
+        self->data = (byte *) realloc (self->data, self->limit);
+        assert (self->data);
+    }
+    memcpy (self->data + self->size, path + shared, suffix);
+    self->size += suffix;
+    s_varint_put (self, size);
+    s_varint_put (self, (uint64_t) mtime);
+    strcpy (self->last, path);
+    self->count++;
+}
+
+/* Start reading scan, which may be NULL; returns true if it has a record */
+static bool
+scan_first (tch_svscan_t *self, tch_svrecord_t *record)
+{
+    record->scan = self;
+    record->offset = 0;
+    record->path [0] = 0;
+    return scan_next (record);
+}
+
+/* Move on to next record; returns false at end of scan */
+static bool
+scan_next (tch_svrecord_t *record)
+{
+    tch_svscan_t *scan = record->scan;
+    record->valid = scan && record->offset < scan->size;
+    if (!record->valid)
+        return false;
+    size_t shared = (size_t) s_varint_get (record);
+    size_t suffix = (size_t) s_varint_get (record);
+    memcpy (record->path + shared, scan->data + record->offset, suffix);
+    record->path [shared + suffix] = 0;
+    record->offset += suffix;
+    record->size = s_varint_get (record);
+    record->mtime = (int64_t) s_varint_get (record);
+    return true;
+}
+
+//  Varints hold seven bits a byte, low bits first; the top bit says
+//  more bytes follow
+static void
+s_varint_put (tch_svscan_t *scan, uint64_t value)
+{
+    if (scan->size + 10 > scan->limit) {
+        scan->limit = scan->limit? scan->limit * 2: 4096;
+        scan->data = (byte *) realloc (scan->data, scan->limit);
+        assert (scan->data);
+    }
+    while (value >= 0x80) {
+        scan->data [scan->size++] = (byte) (value | 0x80);
+        value >>= 7;
+    }
+    scan->data [scan->size++] = (byte) value;
+}
+
+static uint64_t
+s_varint_get (tch_svrecord_t *record)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    byte octet;
+    do {
+        octet = record->scan->data [record->offset++];
+        value |= (uint64_t) (octet & 0x7f) << shift;
+        shift += 7;
+    } while (octet & 0x80);
+    return value;
+}
+
+/* Start watching the mount with inotify, if the server is configured to
+ * do so and the kernel supports it. Falls back to polling on error. */
+static void
+mount_watch_start (tch_mount_t *self)
+{
+    self->watch = -1;
+    self->interval = atoi (zconfig_resolve (self->server->config, "server/rescan", "60000"));
+#if (TCH_HAVE_INOTIFY)
+    if (strneq (zconfig_resolve (self->server->config, "server/watch", "inotify"), "inotify"))
+        return;
+
+    self->watch = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (self->watch == -1) {
+        zsys_warning ("inotify_init1 failed (%s), polling %s", strerror (errno), self->location);
+        return;
+    }
+    if (mount_watch_tree (self, self->location)) {
+        zsys_warning ("cannot watch %s, polling instead", self->location);
+        mount_watch_stop (self);
+        return;
+    }
+    engine_handle_fd (self->server, self->watch, mount_watch_handle, self);
+#endif
+}
+
+/* Stop watching the mount, it goes back to being polled */
+static void
+mount_watch_stop (tch_mount_t *self)
+{
+#if (TCH_HAVE_INOTIFY)
+    if (self->watch != -1) {
+        engine_handle_fd (self->server, self->watch, NULL, NULL);
+        close (self->watch);
+        self->watch = -1;
+    }
+#endif
+}
+
+#if (TCH_HAVE_INOTIFY)
+/* Add a watch on directory 'path' and on every directory below it.
+ * Returns 0 if OK, -1 if we ran out of watches. */
+static int
+mount_watch_tree (tch_mount_t *self, const char *path)
+{
+    int wd = inotify_add_watch (self->watch, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        //  Directory may have gone away already, that's not an error
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;
+        zsys_warning ("inotify_add_watch %s failed (%s)", path, strerror (errno));
+        return -1;
+    }
+    char key [16];
+    snprintf (key, sizeof (key), "%d", wd);
+    zhash_update (self->watches, key, (void *) path);
+
+    DIR *handle = opendir (path);
+    if (!handle)
+        return 0;
+    int rc = 0;
+    struct dirent *entry;
+    while (rc == 0 && (entry = readdir (handle)) != NULL) {
+        //  Ignore hidden entries, like zdir does
+        if (entry->d_name [0] == '.' || entry->d_type != DT_DIR)
+            continue;
+        char *subdir = zsys_sprintf ("%s/%s", path, entry->d_name);
+        rc = mount_watch_tree (self, subdir);
+        zstr_free (&subdir);
+    }
+    closedir (handle);
+    return rc;
+}
+
+/* Drop the watches on directory 'path' and everything below it */
+static void
+mount_watch_forget (tch_mount_t *self, const char *path)
+{
+    size_t length = strlen (path);
+    zlist_t *keys = zhash_keys (self->watches);
+    char *key = (char *) zlist_first (keys);
+    while (key) {
+        const char *dirpath = (const char *) zhash_lookup (self->watches, key);
+        if (strncmp (dirpath, path, length) == 0
+        && (dirpath [length] == 0 || dirpath [length] == '/')) {
+            inotify_rm_watch (self->watch, atoi (key));
+            zhash_delete (self->watches, key);
+        }
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+}
+
+/* zloop callback when the kernel reports changes under the mount. We just
+ * record them, mount_refresh turns them into patches on its next tick. */
+static int
+mount_watch_handle (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    tch_mount_t *self = (tch_mount_t *) arg;
+    char buffer [4096]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    bool exhausted = false;
+
+    ssize_t length;
+    while ((length = read (self->watch, buffer, sizeof (buffer))) > 0) {
+        char *needle = buffer;
+        while (needle < buffer + length) {
+            struct inotify_event *event = (struct inotify_event *) needle;
+            needle += sizeof (struct inotify_event) + event->len;
+
+            char key [16];
+            snprintf (key, sizeof (key), "%d", event->wd);
+            if (event->mask & IN_Q_OVERFLOW) {
+                zsys_warning ("inotify queue overflow on %s, rescanning", self->location);
+                self->rescan = true;
+                self->overflow = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                zhash_delete (self->watches, key);
+                continue;
+            }
+            const char *dirpath = (const char *) zhash_lookup (self->watches, key);
+            if (!dirpath || event->len == 0 || event->name [0] == '.')
+                continue;
+
+            char *path = zsys_sprintf ("%s/%s", dirpath, event->name);
+            if (event->mask & IN_ISDIR) {
+                //  Directory contents aren't reported, so pick them up
+                //  with a rescan on the next tick
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    if (mount_watch_tree (self, path))
+                        exhausted = true;
+                } else if (event->mask & IN_MOVED_FROM)
+                    mount_watch_forget (self, path);
+                self->rescan = true;
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO))
+                //  Changes are by path, so however many writes a file
+                //  gets, it makes one patch per tick
+                zhash_update (self->changes, path, "create");
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                zhash_update (self->changes, path, "delete");
+            zstr_free (&path);
+        }
+    }
+    //  Out of watches or no way to read events, go back to polling
+    if (length == -1 && errno != EAGAIN && errno != EINTR)
+        zsys_warning ("inotify read failed (%s), polling %s", strerror (errno), self->location);
+    else if (!exhausted)
+        return 0;
+    mount_watch_stop (self);
+    self->rescan = true;
+    return 0;
+}
+
+/* Turn the changes the watcher collected into a list of patches */
+static zlist_t *
+mount_watch_patches (tch_mount_t *self)
+{
+    zlist_t *patches = zlist_new ();
+    char *operation = (char *) zhash_first (self->changes);
+    while (operation) {
+        const char *path = zhash_cursor (self->changes);
+        zfile_t *file = zfile_new (NULL, path);
+        int op = streq (operation, "create")? patch_create: patch_delete;
+        //  File may have been deleted again, or replaced by a directory
+        if (op == patch_create && (!zfile_is_regular (file) || !zfile_is_readable (file)))
+            op = patch_delete;
+
+        zdir_patch_t *patch = zdir_patch_new (self->location, file, op, self->alias);
+        if (patch) {
+            zhash_insert (self->notified, zdir_patch_vpath (patch), self);
+            zlist_append (patches, patch);
+        }
+        zfile_destroy (&file);
+        operation = (char *) zhash_next (self->changes);
+    }
+    zhash_destroy (&self->changes);
+    self->changes = zhash_new ();
+    zhash_autofree (self->changes);
+    return patches;
+}
+#endif
+
+/* Add patch to sub client patches list; digest is that of the file the
+ * patch creates, or NULL if we don't know it */
 static void
-sub_patch_add (tch_svsub_t *self, zdir_patch_t *patch)
+sub_patch_add (tch_svsub_t *self, zdir_patch_t *patch, const char *digest)
 {
     //  Debug print where we are and information on the incoming patch
     //zsys_debug("@@ sub_patch_add, incoming patch info below");
     //zsys_debug("path=%s, op=%d, vpath=%s", zdir_patch_path (patch), zdir_patch_op (patch), zdir_patch_vpath (patch));
 
     //  Skip file creation if client already has identical file
-    //  Populate the digest for the associated patch
-    zdir_patch_digest_set(patch);
-    if (zdir_patch_op(patch) == patch_create) {
-        char *digest = (char *)zhash_lookup(self->cache,
-                        zdir_patch_vpath(patch) + strlen(self->path) + 1);
-        if (digest && streq(digest, zdir_patch_digest(patch))) {
+    if (zdir_patch_op(patch) == patch_create && digest) {
+        char *cached = (char *)zhash_lookup(self->cache, zdir_patch_vpath(patch));
+        if (cached && streq(cached, digest)) {
             //zsys_debug ("sub_patch_add: skipping patch");
             return;             //  Just skip patch for this client
         }
     }
 
-    //  Remove any previous patches for the same file
-    zdir_patch_t *existing = (zdir_patch_t *)zlist_first(self->client->patches);
-    while (existing) {
-        if (streq (zdir_patch_vpath (patch), zdir_patch_vpath (existing))) {
-            //zsys_debug ("!!! removing patch !!!");
-            //zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (existing),
-            //    zdir_patch_op (existing), zdir_patch_vpath (existing));
-            zlist_remove (self->client->patches, existing);
-            zdir_patch_destroy (&existing);
-            break;
-        }
-        existing = (zdir_patch_t *) zlist_next (self->client->patches);
-    }
-    if (zdir_patch_op (patch) == patch_create) {
+    //  Remove any previous patch for the same file
+    const char *vpath = zdir_patch_vpath (patch);
+    client_unqueue (self->client, vpath);
+    //  Cache is what the client will have once it has this patch
+    if (zdir_patch_op (patch) == patch_create && digest) {
         //zsys_debug ("---> inserting patch <---");
         //zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
         //    zdir_patch_op (patch), zdir_patch_vpath (patch));
-        zhash_insert (self->cache,
-            zdir_patch_digest (patch), (void *) zdir_patch_vpath (patch));
+        zhash_update (self->cache, vpath, (void *) digest);
     }
+    else
+        zhash_delete (self->cache, vpath);
     //zsys_debug ("+++ adding following patch to client list +++");
     //zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
     //    zdir_patch_op (patch), zdir_patch_vpath (patch));
 
     //  Track that we've queued patch for client, so we don't do it twice
     zdir_patch_t *patch_add = zdir_patch_dup (patch);
-    if (patch_add) {
-        int rc = zlist_append (self->client->patches, (void *) patch_add);
-        if (rc != 0)
-            zsys_error ("unable to append new patch +++");
-    } else {
+    if (patch_add)
+        client_queue (self->client, self->priority, patch_add);
+    else {
         zsys_error ("unable to duplicate patch");
     }
 }
@@ -365,15 +1352,15 @@ engine_broadcast_event (tch_server_t *server, tch_svclient_t *client, event_t ev
 {
     if (server) {
         tch_s_server_t *self = (tch_s_server_t *)server;
-        zlist_t *keys = zhash_keys(self->clients);
-        char *key = (char *)zlist_first(keys);
-        while (key) {
-            tch_sv_client_t *target = (tch_sv_client_t *)zhash_lookup(self->clients, key);
-            if (target != (tch_sv_client_t *)client)
+        //  Clients may go away as we go, but none come in, so the slots
+        //  stay where they are
+        size_t index;
+        for (index = 0; index < self->clients->size; index++) {
+            tch_sv_client_t *target = self->clients->slots [index];
+            if (target && target != CLIENT_DELETED
+            &&  target != (tch_sv_client_t *)client)
                 s_client_execute (target, event);
-            key = (char *)zlist_next (keys);
         }
-        zlist_destroy(&keys);
     }
 }
 
@@ -440,6 +1427,24 @@ engine_handle_socket (tch_server_t *server, void *sock, zloop_reader_fn handler)
     }
 }
 
+//  Poll a file descriptor for input, invoke handler on activity. Handler
+//  must be a CZMQ zloop_fn function and receives 'arg'. Pass a NULL
+//  handler to stop polling the descriptor.
+static void
+engine_handle_fd (tch_server_t *server, int fd, zloop_fn handler, void *arg)
+{
+    if (server) {
+        tch_s_server_t *self = (tch_s_server_t *) server;
+        zmq_pollitem_t item = { NULL, fd, ZMQ_POLLIN, 0 };
+        if (handler != NULL) {
+            int rc = zloop_poller (self->loop, &item, handler, arg);
+            assert (rc == 0);
+        }
+        else
+            zloop_poller_end (self->loop, &item);
+    }
+}
+
 //  Set log file prefix; this string will be added to log data, to make
 //  log data more searchable. The string is truncated to ~20 chars.
 static void
@@ -514,7 +1519,7 @@ s_client_new (tch_s_server_t *server, zframe_t *routing_id)
     assert ((tch_sv_client_t *) &self->client == self);
 
     self->server = server;
-    self->hashkey = zframe_strhex (routing_id);
+    self->hash = s_routing_id_hash (routing_id);
     self->routing_id = zframe_dup (routing_id);
     self->unique_id = server->client_id++;
     engine_set_log_prefix (&self->client, server->log_prefix);
@@ -546,20 +1551,136 @@ s_client_destroy (tch_sv_client_t **self_p)
         //  Provide visual clue if application misuses client reference
         engine_set_log_prefix (&self->client, "*** TERMINATED ***");
         client_terminate (&self->client);
-        free (self->hashkey);
         free (self);
         *self_p = NULL;
     }
 }
 
-//  Callback when we remove client from 'clients' hash table
+//  Create table of clients with 'size' slots, a power of two
+static tch_svclients_t *
+s_clients_new (size_t size)
+{
+    tch_svclients_t *self = (tch_svclients_t *) zmalloc (sizeof (tch_svclients_t));
+    assert (self);
+    self->slots = (tch_sv_client_t **) zmalloc (size * sizeof (tch_sv_client_t *));
+    assert (self->slots);
+    self->size = size;
+    return self;
+}
+
+//  Destroy table of clients, and all clients in it
+static void
+s_clients_destroy (tch_svclients_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        tch_svclients_t *self = *self_p;
+        size_t index;
+        for (index = 0; index < self->size; index++) {
+            tch_sv_client_t *client = self->slots [index];
+            if (client && client != CLIENT_DELETED)
+                s_client_destroy (&client);
+        }
+        free (self->slots);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Find client with routing id, whose hash is 'hash'; NULL if none
+static tch_sv_client_t *
+s_clients_lookup (tch_svclients_t *self, zframe_t *routing_id, uint32_t hash)
+{
+    size_t mask = self->size - 1;
+    size_t index = hash & mask;
+    tch_sv_client_t *client;
+    while ((client = self->slots [index])) {
+        if (client != CLIENT_DELETED
+        &&  client->hash == hash
+        &&  zframe_eq (client->routing_id, routing_id))
+            return client;
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+//  Add new client to table, rebuilding the table first if it's getting
+//  full: bigger if it's mostly clients, else just without deleted slots
+static void
+s_clients_insert (tch_svclients_t *self, tch_sv_client_t *client)
+{
+    if ((self->used + 1) * 4 > self->size * 3)
+        s_clients_rebuild (self, self->count * 2 >= self->size? self->size * 2: self->size);
+
+    size_t mask = self->size - 1;
+    size_t index = client->hash & mask;
+    while (self->slots [index] && self->slots [index] != CLIENT_DELETED)
+        index = (index + 1) & mask;
+    if (!self->slots [index])
+        self->used++;
+    self->slots [index] = client;
+    self->count++;
+}
+
+//  Remove client from table and destroy it
 static void
-s_client_free (void *argument)
+s_clients_delete (tch_svclients_t *self, tch_sv_client_t *client)
 {
-    tch_sv_client_t *client = (tch_sv_client_t *) argument;
+    size_t mask = self->size - 1;
+    size_t index = client->hash & mask;
+    while (self->slots [index] != client) {
+        assert (self->slots [index]);
+        index = (index + 1) & mask;
+    }
+    self->slots [index] = CLIENT_DELETED;
+    self->count--;
     s_client_destroy (&client);
 }
 
+//  Move clients into a fresh table of 'size' slots
+static void
+s_clients_rebuild (tch_svclients_t *self, size_t size)
+{
+    tch_sv_client_t **slots = self->slots;
+    size_t old_size = self->size;
+    self->slots = (tch_sv_client_t **) zmalloc (size * sizeof (tch_sv_client_t *));
+    assert (self->slots);
+    self->size = size;
+    self->used = self->count;
+
+    size_t mask = size - 1;
+    size_t index;
+    for (index = 0; index < old_size; index++) {
+        tch_sv_client_t *client = slots [index];
+        if (client && client != CLIENT_DELETED) {
+            size_t slot = client->hash & mask;
+            while (self->slots [slot])
+                slot = (slot + 1) & mask;
+            self->slots [slot] = client;
+        }
+    }
+    free (slots);
+}
+
+//  Hash of routing id bytes
+static uint32_t
+s_routing_id_hash (zframe_t *routing_id)
+{
+    return s_fnv_hash (zframe_data (routing_id), zframe_size (routing_id));
+}
+
+//  FNV-1a hash of some bytes
+static uint32_t
+s_fnv_hash (const byte *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    while (size--) {
+        hash ^= *data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 /* Execute state machine as long as we have events */
 static void
 s_client_execute (tch_sv_client_t *self, event_t event)
@@ -889,7 +2010,7 @@ s_client_execute (tch_sv_client_t *self, event_t event)
 
         if (self->next_event == terminate_event) {
             //  Automatically calls s_client_destroy
-            zhash_delete (self->server->clients, self->hashkey);
+            s_clients_delete (self->server->clients, self);
             break;
         } else if (self->server->verbose) {
             zsys_debug ("%s:         > %s", self->log_prefix, s_state_name [self->state]);
@@ -901,63 +2022,532 @@ s_client_execute (tch_sv_client_t *self, event_t event)
 static void
 store_client_subscription (tch_svclient_t *self)
 {
-    //  Find mount point with longest match to subscription
     const char *path = fmq_msg_path (self->message);
+    //  ICANHAZ_OK carries a manifest only if we decide it needs one
+    zhash_t *manifest = NULL;
+    fmq_msg_set_headers (self->message, &manifest);
+
+    //  Resync probe walks down the manifest a directory at a time, and
+    //  fetches files the client found differ; it doesn't subscribe
+    zhash_t *options = fmq_msg_options (self->message);
+    const char *value = options? (const char *) zhash_lookup (options, "resync"): NULL;
+    if (value) {
+        client_resync (self, path, options);
+        return;
+    }
 
-    tch_mount_t *check = (tch_mount_t *)zlist_first(self->server->mounts);
-    tch_mount_t *mount = check;
-    while (check) {
-        //  If check->alias is prefix of path and alias is
-        //  longer than current mount then we have a new mount
-        //zsys_debug ("path=%s, check->alias=%s, mount->alias=%s",
-        //    path, check->alias, mount->alias);
-        if (strncmp (path, check->alias, strlen (check->alias)) == 0
-        &&  strlen (check->alias) > strlen (mount->alias)) {
-            //zsys_debug ("prefix match, alias is longer");
-            mount = check;
+    //  Remember files the client has part of, so we can resume them,
+    //  and signatures of files it has, so we can send only the changes
+    value = options? (const char *) zhash_lookup (options, "delta"): NULL;
+    if (value && atoi (zconfig_resolve (self->server->config, "server/delta", "1")))
+        self->delta_block = (size_t) atoi (value);
+    value = options? (const char *) zhash_first (options): NULL;
+    while (value) {
+        const char *key = zhash_cursor (options);
+        if (strncmp (key, "resume/", 7) == 0)
+            zhash_update (self->resume, key + 6, (void *) value);
+        else
+        if (strncmp (key, "delta/", 6) == 0 && self->delta_block) {
+            tch_svsig_t *sig = sig_parse (value, self->delta_block);
+            if (sig) {
+                zhash_update (self->sigs, key + 5, sig);
+                zhash_freefn (self->sigs, key + 5, sig_release);
+            }
         }
-        check = (tch_mount_t *) zlist_next (self->server->mounts);
+        value = (const char *) zhash_next (options);
     }
-    //  If subscription matches nothing, discard it
-    if (mount) {
-        //zsys_debug ("new subscription being stored");
-        mount_sub_store (mount, self, self->message);
+    //  Extra data streams carry chunks only, they don't subscribe
+    client_streams_attach (self, options);
+    if (self->primary)
+        return;
+
+    //  Pack chunks with the best codec the client can unpack
+    value = options? (const char *) zhash_lookup (options, "compress"): NULL;
+    if (value && atoi (zconfig_resolve (self->server->config, "server/compress", "1")))
+        client_codec_pick (self, value);
+
+    //  Client may ask for a bandwidth cap, and we may impose one
+    uint64_t rate = (uint64_t) atoll (zconfig_resolve (self->server->config, "server/rate", "0"));
+    value = options? (const char *) zhash_lookup (options, "rate"): NULL;
+    if (value && strtoull (value, NULL, 10)
+    &&  (!rate || strtoull (value, NULL, 10) < rate))
+        rate = strtoull (value, NULL, 10);
+    if (rate != self->rate_cap) {
+        self->rate_cap = rate;
+        self->tokens = (int64_t) rate / 4;
+        self->tokens_at = zclock_usecs ();
     }
-}
 
-/* Store subscription for mount point */
+    //  Client that dedupes tells us what it has, so when it needs the same
+    //  content again under another name, it copies its own file
+    value = options? (const char *) zhash_lookup (options, "dedupe"): NULL;
+    if (value && atoi (value)
+    &&  atoi (zconfig_resolve (self->server->config, "server/dedupe", "1"))) {
+        self->dedupe = true;
+        zhash_t *cache = fmq_msg_cache (self->message);
+        const char *digest = cache? (const char *) zhash_first (cache): NULL;
+        while (digest) {
+            const char *name = zhash_cursor (cache);
+            char *vpath = *name == '/'? strdup (name):
+                zsys_sprintf ("%s%s%s", path,
+                              path [strlen (path) - 1] == '/'? "": "/", name);
+            if (strlen (digest) == 40)
+                client_holds (self, vpath, digest);
+            zstr_free (&vpath);
+            digest = (const char *) zhash_next (cache);
+        }
+    }
+
+    //  Client that takes batches gets small files many to a chunk, rather
+    //  than a chunk and an end of file each
+    value = options? (const char *) zhash_lookup (options, "batch"): NULL;
+    self->batch = value && atoi (value)
+               && atoi (zconfig_resolve (self->server->config, "server/batch", "1"));
+
+    //  Range request fetches part of one file for a swarm download, and
+    //  doesn't subscribe either
+    value = options? (const char *) zhash_lookup (options, "range"): NULL;
+    if (value) {
+        client_range_start (self, path, value);
+        return;
+    }
+
+    //  Subscription covers whatever mounts lie under its path, now or
+    //  when they're published
+    client_sub_store (self, self->message);
+}
+
+/* Store subscription in the path tree. Coalesce it with the client's
+ * other subscriptions, so that one patch never reaches it twice */
 static void
-mount_sub_store (tch_mount_t *self, tch_svclient_t *client, fmq_msg_t *request)
+client_sub_store (tch_svclient_t *self, fmq_msg_t *request)
 {
-    assert(self);
-    assert(self->subs);
-
-    //  Store subscription along with any previous ones
-    //  Coalesce subscriptions that are on same path
     const char *path = fmq_msg_path(request);
     tch_svsub_t *sub = (tch_svsub_t *)zlist_first(self->subs);
     while (sub) {
-        if (client == sub->client) {
-            //  If old subscription is superset/same as new, ignore new
-            if (strncmp (path, sub->path, strlen (sub->path)) == 0) {
-                zsys_debug ("new subscription already exists");
-                return;
-            } else if (strncmp (sub->path, path, strlen (path)) == 0) {
-                //  If new subscription is superset of old one, remove old
-                zsys_debug ("superset, sub->path=%s, path=%s", sub->path, path);
-                zlist_remove (self->subs, sub);
-                sub_destroy (&sub);
-                sub = (tch_svsub_t *) zlist_first (self->subs);
-            } else {
-                sub = (tch_svsub_t *) zlist_next (self->subs);
-            }
+        //  If old subscription is superset/same as new, ignore new
+        if (s_path_covers (sub->path, path)) {
+            zsys_debug ("new subscription already exists");
+            return;
+        } else if (s_path_covers (path, sub->path)) {
+            //  If new subscription is superset of old one, remove old
+            zsys_debug ("superset, sub->path=%s, path=%s", sub->path, path);
+            zlist_remove (self->subs, sub);
+            sub_destroy (&sub);
+            sub = (tch_svsub_t *) zlist_first (self->subs);
         } else {
             sub = (tch_svsub_t *) zlist_next (self->subs);
         }
     }
-    //  New subscription for this client, append to our list
-    sub = sub_new(client, path, fmq_msg_cache (request));
+    //  New subscription for this client, hang it off its path
+    sub = sub_new(self, path, fmq_msg_cache (request));
+    sub->priority = client_priority (fmq_msg_options (request));
+    sub->node = node_require (self->server->tree, path);
+    if (!sub->node->subs)
+        sub->node->subs = zlistx_new ();
+    sub->handle = zlistx_add_end (sub->node->subs, sub);
+    node_count (sub->node, 1);
     zlist_append(self->subs, sub);
+    self->weight = client_weight (self);
+
+    //  Client that sends the digest of its tree walks down our manifest
+    //  to find what differs; that works when one mount holds the path
+    zhash_t *options = fmq_msg_options (request);
+    const char *digest = options? (const char *) zhash_lookup (options, "merkle"): NULL;
+    tch_mount_t *mount = digest
+        && atoi (zconfig_resolve (self->server->config, "server/merkle", "1"))?
+        mount_sole (self->server, path): NULL;
+    //  Until we have digests of every file, our manifest would miss some
+    if (mount
+    &&  (mount->replica? mount->snap && !mount->snap->partial:
+                         mount_digests_complete (mount))) {
+        client_manifest (self, mount, path, digest);
+        return;
+    }
+    //  Client that has files and walks manifests sends us its cache only
+    //  when we ask, so as not to send it every time; catch-up waits for it
+    zhash_t *cache = fmq_msg_cache (request);
+    if (digest && *digest && (!cache || zhash_size (cache) == 0)) {
+        zhash_t *ask = zhash_new ();
+        zhash_insert (ask, "cache", "1");
+        fmq_msg_set_path (self->message, "");
+        fmq_msg_set_headers (self->message, &ask);
+        return;
+    }
+    client_sub_catchup (self, sub);
+}
+
+/* Client gets what the mounts under its subscription hold already, less
+ * what it has */
+static void
+client_sub_catchup (tch_svclient_t *self, tch_svsub_t *sub)
+{
+    tch_mount_t *mount = (tch_mount_t *) zlist_first (self->server->mounts);
+    while (mount) {
+        if (s_path_covers (sub->path, mount->alias) || s_path_covers (mount->alias, sub->path))
+            mount_sub_catchup (mount, sub);
+        mount = (tch_mount_t *) zlist_next (self->server->mounts);
+    }
+}
+
+/* Queue create patches for the files of the mount the subscription
+ * takes in. A replica knows its files from the front's snapshot, which
+ * lists the files it has no digest for yet too. */
+static void
+mount_sub_catchup (tch_mount_t *self, tch_svsub_t *sub)
+{
+    if (self->replica) {
+        size_t index;
+        for (index = 0; self->snap && index < self->snap->count; index++) {
+            const char *vpath = self->snap->entries [2 * index];
+            if (!s_path_covers (sub->path, vpath) || s_path_private (vpath))
+                continue;
+            zdir_patch_t *patch = mount_patch (self, vpath);
+            if (patch)
+                sub_patch_add (sub, patch, self->snap->entries [2 * index + 1]);
+            zdir_patch_destroy (&patch);
+        }
+        return;
+    }
+    tch_svrecord_t record;
+    bool valid = scan_first (self->scan, &record);
+    while (valid) {
+        zdir_patch_t *patch = mount_file_patch (self, record.path, patch_create);
+        if (patch
+        &&  s_path_covers (sub->path, zdir_patch_vpath (patch))
+        &&  !s_path_private (zdir_patch_vpath (patch)))
+            sub_patch_add (sub, patch, mount_digest (self, zdir_patch_vpath (patch)));
+        zdir_patch_destroy (&patch);
+        valid = scan_next (&record);
+    }
+}
+
+/* Create patch for file at vpath in mount */
+static zdir_patch_t *
+mount_patch (tch_mount_t *self, const char *vpath)
+{
+    size_t prefix = strlen (self->alias);
+    while (prefix && self->alias [prefix - 1] == '/')
+        prefix--;
+    if (strlen (vpath) <= prefix + 1)
+        return NULL;
+    return mount_file_patch (self, vpath + prefix + 1, patch_create);
+}
+
+/* Create patch for file with name relative to the mount's location */
+static zdir_patch_t *
+mount_file_patch (tch_mount_t *self, const char *name, int op)
+{
+    zfile_t *file = zfile_new (self->location, name);
+    zdir_patch_t *patch = zdir_patch_new (self->location, file, op, self->alias);
+    zfile_destroy (&file);
+    return patch;
+}
+
+/* The mount that holds everything under path, or NULL if path takes in
+ * more than one mount */
+static tch_mount_t *
+mount_sole (tch_server_t *server, const char *path)
+{
+    tch_mount_t *found = mount_lookup (server, path);
+    tch_mount_t *mount = (tch_mount_t *) zlist_first (server->mounts);
+    while (mount) {
+        if (mount != found && s_path_covers (path, mount->alias))
+            return NULL;
+        mount = (tch_mount_t *) zlist_next (server->mounts);
+    }
+    return found;
+}
+
+/* Merkle manifest of the files we have digests for, which we rebuild
+ * only when asked for after the digests change */
+static fmq_manifest_t *
+mount_manifest (tch_mount_t *self)
+{
+    if (self->manifest && !self->manifest_dirty)
+        return self->manifest;
+    fmq_manifest_destroy (&self->manifest);
+    self->manifest = fmq_manifest_new ();
+    if (self->replica) {
+        size_t index;
+        for (index = 0; self->snap && index < self->snap->count; index++)
+            if (self->snap->entries [2 * index + 1]
+            &&  !s_path_private (self->snap->entries [2 * index]))
+                fmq_manifest_add (self->manifest, self->snap->entries [2 * index],
+                                  self->snap->entries [2 * index + 1]);
+    }
+    else {
+        tch_svdigest_t *digest = (tch_svdigest_t *) zhash_first (self->digests);
+        while (digest) {
+            if (digest->digest && !s_path_private (digest->vpath))
+                fmq_manifest_add (self->manifest, digest->vpath, digest->digest);
+            digest = (tch_svdigest_t *) zhash_next (self->digests);
+        }
+    }
+    fmq_manifest_seal (self->manifest);
+    self->manifest_dirty = false;
+    return self->manifest;
+}
+
+/* Answer a client's digest of its tree under path. If ours differs, the
+ * ICANHAZ_OK lists what we have in that directory, and the client probes
+ * on into the entries that differ; else there's nothing to send. */
+static void
+client_manifest (tch_svclient_t *self, tch_mount_t *mount, const char *path, const char *digest)
+{
+    char *vdir = zsys_sprintf ("%s%s", path,
+                               path [strlen (path) - 1] == '/'? "": "/");
+    fmq_manifest_t *manifest = mount_manifest (mount);
+    const char *ours = fmq_manifest_digest (manifest, vdir);
+    if (!digest || !streq (digest, ours? ours: "")) {
+        zhash_t *entries = fmq_manifest_entries (manifest, vdir);
+        entries = entries? zhash_dup (entries): zhash_new ();
+        fmq_msg_set_path (self->message, vdir);
+        fmq_msg_set_headers (self->message, &entries);
+    }
+    zstr_free (&vdir);
+}
+
+/* Resync probe: queue the files the client asks for, "fetch/<n>" options
+ * naming them, which it found differ from the manifest we sent or failed
+ * to rebuild from a delta; and list the directory at path if it names one.
+ * A probe with the "cache" option brings the cache we asked for, and
+ * starts catch-up of the subscription at path. */
+static void
+client_resync (tch_svclient_t *self, const char *path, zhash_t *options)
+{
+    if (zhash_lookup (options, "cache") && *path) {
+        tch_svsub_t *sub = (tch_svsub_t *) zlist_first (self->subs);
+        while (sub && !streq (sub->path, path))
+            sub = (tch_svsub_t *) zlist_next (self->subs);
+        if (sub) {
+            sub_cache_add (sub, fmq_msg_cache (self->message));
+            client_sub_catchup (self, sub);
+        }
+        return;
+    }
+    const char *vpath = (const char *) zhash_first (options);
+    while (vpath) {
+        if (strncmp (zhash_cursor (options), "fetch/", 6) == 0
+        &&  *vpath == '/' && !s_path_private (vpath)) {
+            tch_svsub_t *sub = (tch_svsub_t *) zlist_first (self->subs);
+            while (sub && !s_path_covers (sub->path, vpath))
+                sub = (tch_svsub_t *) zlist_next (self->subs);
+            tch_mount_t *mount = sub? mount_lookup (self->server, vpath): NULL;
+            //  Client has no good copy, so whatever we thought it held is
+            //  gone, and the file goes out whole
+            if (sub) {
+                zhash_delete (self->sigs, vpath);
+                zhash_delete (sub->cache, vpath);
+                if (self->dedupe)
+                    client_holds (self, vpath, NULL);
+            }
+            zdir_patch_t *patch = mount? mount_patch (mount, vpath): NULL;
+            if (patch)
+                sub_patch_add (sub, patch, mount_digest (mount, vpath));
+            zdir_patch_destroy (&patch);
+        }
+        vpath = (const char *) zhash_next (options);
+    }
+    tch_mount_t *mount = *path? mount_sole (self->server, path): NULL;
+    if (mount)
+        client_manifest (self, mount, path, NULL);
+}
+
+/* Take digests of the files that were there when we mounted, now that
+ * someone subscribes; catch-up and resync need them */
+static void
+mount_digests_seed (tch_mount_t *self, zlist_t *digests)
+{
+    tch_svrecord_t record;
+    bool valid = scan_first (self->scan, &record);
+    while (valid) {
+        zdir_patch_t *patch = mount_file_patch (self, record.path, patch_create);
+        if (patch && !s_path_private (zdir_patch_vpath (patch)))
+            mount_digest_check (self, zdir_patch_vpath (patch),
+                                zfile_filename (zdir_patch_file (patch), NULL),
+                                false, digests);
+        zdir_patch_destroy (&patch);
+        valid = scan_next (&record);
+    }
+    self->seeding = false;
+}
+
+/* Do we have a current digest of every file in the mount? Not while
+ * we're seeding or have digests out with a worker, nor for files that
+ * came or changed while nobody was subscribed, which have none */
+static bool
+mount_digests_complete (tch_mount_t *self)
+{
+    if (self->seeding || self->digesting)
+        return false;
+    size_t length = strlen (self->alias);
+    const char *slash = length && self->alias [length - 1] == '/'? "": "/";
+    tch_svrecord_t record;
+    bool valid = scan_first (self->scan, &record);
+    while (valid) {
+        char *vpath = zsys_sprintf ("%s%s%s", self->alias, slash, record.path);
+        bool current = s_path_private (vpath)
+                    || mount_digest (self, vpath) != NULL;
+        zstr_free (&vpath);
+        if (!current)
+            return false;
+        valid = scan_next (&record);
+    }
+    return true;
+}
+
+/* Drop patches for files we don't publish */
+static void
+mount_patches_filter (zlist_t *patches)
+{
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        zdir_patch_t *next = (zdir_patch_t *) zlist_next (patches);
+        if (s_path_private (zdir_patch_vpath (patch))) {
+            zlist_remove (patches, patch);
+            zdir_patch_destroy (&patch);
+        }
+        patch = next;
+    }
+}
+
+/* Is anyone subscribed to anything in this mount? */
+static bool
+mount_subscribed (tch_mount_t *self)
+{
+    //  Clients of a sharded server subscribe on the shards
+    if (self->node->below || self->server->shards)
+        return true;
+    tch_svnode_t *node = self->node->parent;
+    while (node) {
+        if (node->subs && zlistx_size (node->subs))
+            return true;
+        node = node->parent;
+    }
+    return false;
+}
+
+/* Create node of path tree */
+static tch_svnode_t *
+node_new (tch_svnode_t *parent, const char *name)
+{
+    tch_svnode_t *self = (tch_svnode_t *) zmalloc (sizeof (tch_svnode_t));
+    self->parent = parent;
+    self->name = strdup (name);
+    if (parent) {
+        if (!parent->children)
+            parent->children = zhash_new ();
+        zhash_insert (parent->children, name, self);
+    }
+    return self;
+}
+
+/* Destroy node and everything under it. Subscriptions belong to their
+ * clients, and are gone by the time we destroy the tree */
+static void
+node_destroy (tch_svnode_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        tch_svnode_t *self = *self_p;
+        if (self->children) {
+            tch_svnode_t *child = (tch_svnode_t *) zhash_first (self->children);
+            while (child) {
+                child->parent = NULL;
+                node_destroy (&child);
+                child = (tch_svnode_t *) zhash_next (self->children);
+            }
+            zhash_destroy (&self->children);
+        }
+        zlistx_destroy (&self->subs);
+        free (self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+/* Node for path, creating it and any parents as needed */
+static tch_svnode_t *
+node_require (tch_svnode_t *self, const char *path)
+{
+    char name [256];
+    while ((path = s_path_next (path, name))) {
+        tch_svnode_t *child = self->children?
+            (tch_svnode_t *) zhash_lookup (self->children, name): NULL;
+        self = child? child: node_new (self, name);
+    }
+    return self;
+}
+
+/* Count subscriptions added to or removed from node, in the node and
+ * everything above it */
+static void
+node_count (tch_svnode_t *self, int delta)
+{
+    while (self) {
+        self->below += delta;
+        self = self->parent;
+    }
+}
+
+/* Drop node, and its parents in turn, once nothing hangs off it */
+static void
+node_prune (tch_svnode_t *self)
+{
+    while (self->parent && !self->below && !self->mount
+    &&    (!self->children || zhash_size (self->children) == 0)) {
+        tch_svnode_t *parent = self->parent;
+        zhash_delete (parent->children, self->name);
+        self->parent = NULL;
+        node_destroy (&self);
+        self = parent;
+    }
+}
+
+/* Copy next segment of path into name, which holds 256 bytes. Returns
+ * the rest of the path after the segment, or NULL if there are no more
+ * segments */
+static const char *
+s_path_next (const char *path, char *name)
+{
+    while (*path == '/')
+        path++;
+    if (*path == 0)
+        return NULL;
+    size_t length = strcspn (path, "/");
+    size_t copy = length < 255? length: 255;
+    memcpy (name, path, copy);
+    name [copy] = 0;
+    return path + length;
+}
+
+/* Does subscription to path take in vpath? Only whole segments match,
+ * so /doc takes in /doc/a but not /docs/a */
+static bool
+s_path_covers (const char *path, const char *vpath)
+{
+    size_t length = strlen (path);
+    while (length && path [length - 1] == '/')
+        length--;
+    return strncmp (vpath, path, length) == 0
+        && (vpath [length] == 0 || vpath [length] == '/');
+}
+
+/* Is vpath a file we keep for ourselves: one a client is still
+ * receiving, its journal, or a digests cache? */
+static bool
+s_path_private (const char *vpath)
+{
+    const char *suffixes [] = { JOURNAL_SUFFIX, TEMP_SUFFIX, DIGESTS_SUFFIX, NULL };
+    size_t length = strlen (vpath);
+    int index;
+    for (index = 0; suffixes [index]; index++) {
+        size_t suffix = strlen (suffixes [index]);
+        if (length > suffix && streq (vpath + length - suffix, suffixes [index]))
+            return true;
+    }
+    return false;
 }
 
 /* Destructor for the sub (a.k.a subscription) class */
@@ -967,6 +2557,11 @@ sub_destroy (tch_svsub_t **self_p)
     assert (self_p);
     if (*self_p) {
         tch_svsub_t *self = *self_p;
+        if (self->node) {
+            zlistx_delete (self->node->subs, self->handle);
+            node_count (self->node, -1);
+            node_prune (self->node);
+        }
         zhash_destroy (&self->cache);
         free (self->path);
         free (self);
@@ -984,10 +2579,29 @@ check_for_client_data (tch_svclient_t *self)
         return;
     }
 
-    if (zlist_size (self->patches) == 0 && self->patch == NULL) {
+    if (self->primary) {
+        //  Stream sends whatever is left of the file its primary stripes
+        engine_set_next_event (self, client_stripe_ready (self->primary)
+                               && client_turn (self)?
+                               send_chunk_event: finished_event);
+        return;
+    }
+    if (!client_pending (self)) {
         //zsys_debug ("^^^ client has no patches, finished event ^^^");
+        //  Client coming back from idle starts with a full share
+        self->weight = client_weight (self);
+        self->share = (int64_t) self->weight * SHARE_QUANTUM;
+        client_share_done (self);
+        client_release (self);
         engine_set_next_event (self, finished_event);
-    } else {
+    } else
+    if (!client_admitted (self)) {
+        client_share_done (self);
+        engine_set_next_event (self, finished_event);
+    } else
+    if (!client_turn (self))
+        engine_set_next_event (self, finished_event);
+    else {
         //zsys_debug ("^^^ client has patches, send chunk event ^^^");
         engine_set_next_event (self, send_chunk_event);
     }
@@ -1010,99 +2624,2191 @@ static void
 store_client_credit (tch_svclient_t *self)
 {
     self->credit += fmq_msg_credit (self->message);
+    self->acked = fmq_msg_sequence (self->message);
+
+    //  The client sends credit as fast as it takes in data, so the credit
+    //  rate tells us how big a chunk it can swallow in chunk_time
+    int64_t now = zclock_usecs ();
+    if (self->stall_at) {
+        self->stall_time += now - self->stall_at;
+        self->stall_at = 0;
+    }
+    int64_t elapsed = now - self->nom_at;
+    if (self->nom_at && elapsed > 0 && elapsed < 1000000) {
+        uint64_t rate = fmq_msg_credit (self->message) * 1000000 / elapsed;
+        self->rate = self->rate? (self->rate * 7 + rate) / 8: rate;
+        self->chunk_size = self->rate * self->chunk_time / 1000;
+        if (self->chunk_size < self->chunk_min)
+            self->chunk_size = self->chunk_min;
+        if (self->chunk_size > self->chunk_max)
+            self->chunk_size = self->chunk_max;
+    }
+    self->nom_at = now;
 }
 
-/* get_next_patch_for_client */
+/* get_next_patch_for_client. We raise finished, no_credit and
+ * next_patch as exceptions, never as next events: a next event lets the
+ * state machine go on and send the CHEEZBURGER it already holds, and
+ * since chunks go out zero-copy that message may be left with an empty
+ * chunk, which the client takes for end of file */
 static void
 get_next_patch_for_client (tch_svclient_t *self)
 {
     //zsys_debug ("@@ get_next_patch_for_client");
-    //  Get next patch for client if we're not doing one already
-    if (self->patch == NULL) {
-        self->patch = (zdir_patch_t *) zlist_pop (self->patches);
-        if (self->patch) {
-            //zsys_debug ("~~~ just popped following patch ~~~");
-            //zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
-            //    zdir_patch_path (self->patch), zdir_patch_op (self->patch),
-            //    zdir_patch_vpath (self->patch));
-        }
-    } else {
-        //zsys_debug ("~~~ current patch ~~~");
-        //zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
-        //    zdir_patch_path (self->patch), zdir_patch_op (self->patch),
-        //    zdir_patch_vpath (self->patch));
+    //  What we send is charged to our share of the server, and to the
+    //  queue we send it from
+    uint64_t credit = self->credit;
+    if (self->primary) {
+        if (!client_stripe_ready (self->primary))
+            engine_set_exception (self, finished_event);
+        else
+        if (!client_chunk_limit (self))
+            engine_set_exception (self, no_credit_event);
+        else
+        if (!client_stripe_send (self->primary, self))
+            engine_set_exception (self, self->waiting? no_credit_event: finished_event);
     }
+    else {
+        //  Get next patch, or set this one aside for another queue's turn
+        client_schedule (self);
+        client_patch_send (self);
+        client_release (self);
+    }
+    client_charge (self, credit - self->credit);
+}
+
+/* Send next chunk of current patch */
+static void
+client_patch_send (tch_svclient_t *self)
+{
     if (self->patch == NULL) {
         //zsys_debug ("~~~ no patch ~~~");
-        engine_set_next_event (self, finished_event);
+        engine_set_exception (self, finished_event);
         return;
     }
 
     //  Get virtual path from patch
     fmq_msg_set_filename (self->message, zdir_patch_vpath (self->patch));
 
+    zhash_t *headers = client_patch_headers (self);
+    fmq_msg_set_headers (self->message, &headers);
+
     //  We can process a delete patch right away
     if (zdir_patch_op (self->patch) == patch_delete) {
         //zsys_debug ("~~~ current patch is delete ~~~");
         fmq_msg_set_sequence (self->message, self->sequence++);
         fmq_msg_set_operation (self->message, FMQ_MSG_FILE_DELETE);
         fmq_msg_set_eof (self->message, 0);
+        zhash_delete (self->sigs, zdir_patch_vpath (self->patch));
+        if (self->dedupe)
+            client_holds (self, zdir_patch_vpath (self->patch), NULL);
 
         //  No reliability in this version, assume patch delivered safely
         zdir_patch_destroy (&self->patch);
     } else if (zdir_patch_op (self->patch) == patch_create) {
         //zsys_debug ("~~~ current patch is create ~~~");
         //  Create patch refers to file, open that for input if needed
+        if (self->file == NULL && self->batch && !self->ranged
+        &&  client_batch_send (self))
+            return;
         if (self->file == NULL) {
             //zsys_debug ("~~~ client's file is NULL ~~~");
             self->file = zfile_dup (zdir_patch_file (self->patch));
             if (zfile_input (self->file)) {
                 //  File no longer available, skip it
                 //zsys_debug ("~~~ file no longer available ~~~");
+                self->ranged = false;
                 zdir_patch_destroy (&self->patch);
                 zfile_destroy (&self->file);
-                engine_set_next_event (self, next_patch_event);
+                engine_set_exception (self, next_patch_event);
                 return;
             }
-            self->offset = 0;
+            self->offset = self->ranged? self->range_start: client_resume_offset (self);
+            if (self->dedupe && self->offset == 0 && !self->ranged && client_dedupe (self))
+                return;
+            //  Deltas, striping and packing share the file between clients,
+            //  mapped if server/mmap is set, else open for workers to read
+            self->map = map_open (self->server, self->file);
+            self->mount = mount_lookup (self->server, zdir_patch_vpath (self->patch));
+
+            //  If we know what the client has of this file, send only
+            //  what changed
+            tch_svsig_t *sig = (tch_svsig_t *) zhash_lookup (self->sigs,
+                zdir_patch_vpath (self->patch));
+            if (sig && !sig->ready)
+                sig = NULL;         //  Still taking them; send file whole
+            if (!sig && self->dedupe && self->map && self->map->size >= CHUNK_SIZE)
+                sig = client_delta_basis (self);
+            if (sig && self->map && self->offset == 0 && !self->ranged)
+                client_delta_match (self, sig);
+            else
+                client_file_start (self);
+        }
+        //  Delta is being worked out by a worker; we start once it's back
+        if (self->matching) {
+            engine_set_exception (self, no_credit_event);
+            return;
+        }
+        if (self->matched) {
+            client_delta_start (self);
+            client_file_start (self);
+        }
+        //  Range ends short of the file, so we send end of file ourselves
+        if (self->ranged && self->offset >= self->range_end) {
+            zchunk_t *chunk = zchunk_new (NULL, 0);
+            fmq_msg_set_chunk (self->message, &chunk);
+            fmq_msg_set_sequence (self->message, self->sequence++);
+            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+            fmq_msg_set_offset (self->message, self->offset);
+            fmq_msg_set_eof (self->message, 1);
+            self->ranged = false;
+            map_close (self->server, &self->map);
+            zfile_destroy (&self->file);
+            zdir_patch_destroy (&self->patch);
+            return;
+        }
+        if (self->delta) {
+            client_delta_send (self);
+            return;
+        }
+        //  Large file goes out over all our streams at once; we send our
+        //  share, then the end of file once every byte has gone
+        if (self->striping) {
+            if (client_stripe_ready (self)) {
+                if (!client_chunk_limit (self) || self->waiting) {
+                    engine_set_exception (self, no_credit_event);
+                    return;
+                }
+                if (client_stripe_send (self, self))
+                    return;
+                if (self->waiting) {
+                    engine_set_exception (self, no_credit_event);
+                    return;
+                }
+                //  File ended early, so that's the end of the stripe
+            }
+            char *bytes = zsys_sprintf ("%llu", (unsigned long long) self->stripe_bytes);
+            char *start = zsys_sprintf ("%jd", (intmax_t) self->stripe_start);
+            headers = fmq_msg_get_headers (self->message);
+            zhash_update (headers, "stripe", start);
+            zhash_update (headers, "bytes", bytes);
+            zstr_free (&start);
+            zstr_free (&bytes);
+            fmq_msg_set_headers (self->message, &headers);
+
+            zchunk_t *chunk = zchunk_new (NULL, 0);
+            fmq_msg_set_chunk (self->message, &chunk);
+            fmq_msg_set_sequence (self->message, self->sequence++);
+            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+            fmq_msg_set_offset (self->message, self->offset);
+            fmq_msg_set_eof (self->message, 1);
+            self->striping = false;
+            client_file_sent (self);
+            map_close (self->server, &self->map);
+            zfile_destroy (&self->file);
+            zdir_patch_destroy (&self->patch);
+            return;
+        }
+        //  Send straight out of the mapping if we have one, so that each
+        //  subscriber costs a reference rather than another copy. Chunks
+        //  we pack come from the mapping, or a worker reads them.
+        if (self->map && (self->map->data || self->compress)) {
+            size_t size = self->map->size - (size_t) self->offset;
+            size_t limit = client_chunk_limit (self);
+            if (size > limit)
+                size = limit;
+            //  Chunk goes to a disk worker for packing, and we send it
+            //  on the dispatch event we get once it's back
+            zchunk_t *packed = NULL;
+            zchunk_t *raw = NULL;
+            bool ended = self->offset == (off_t) self->map->size;
+            if (size && self->compress) {
+                tch_svjob_t *job = client_pack (self, size);
+                if (!job) {
+                    engine_set_exception (self, no_credit_event);
+                    return;
+                }
+                assert (job->offset == self->offset);
+                size = job->size;
+                packed = job->data;
+                raw = job->raw;
+                free (job);
+                //  If one chunk doesn't pack, the rest of the file won't
+                if (!packed)
+                    self->compress = false;
+                //  File we read came up short, so it changed under us;
+                //  we end it here, and the new version follows
+                if (!size && raw) {
+                    zchunk_destroy (&raw);
+                    ended = true;
+                }
+            }
+            if (size || ended) {
+                fmq_msg_set_sequence (self->message, self->sequence++);
+                fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+                fmq_msg_set_offset (self->message, self->offset);
+                fmq_msg_set_eof (self->message, 0);
+                if (*self->codec)
+                    client_pack_headers (self, packed, size);
+                if (packed) {
+                    //  Packed chunk costs the client what it takes on the wire
+                    self->server->packed_raw += size;
+                    self->server->packed_wire += zchunk_size (packed);
+                    self->offset += size;
+                    self->credit -= zchunk_size (packed);
+                    fmq_msg_set_chunk (self->message, &packed);
+                    return;
+                }
+                if (raw)
+                    fmq_msg_set_chunk (self->message, &raw);
+                else
+                if (size) {
+                    __sync_add_and_fetch (&self->map->refs, 1);
+                    fmq_msg_set_chunk_data (self->message,
+                        self->map->data + self->offset, size, map_release, self->map);
+                } else {
+                    //  Zero-sized chunk means end of file
+                    zchunk_t *chunk = zchunk_new (NULL, 0);
+                    fmq_msg_set_chunk (self->message, &chunk);
+                    fmq_msg_set_eof (self->message, 1);
+                    client_file_sent (self);
+                    map_close (self->server, &self->map);
+                    zfile_destroy (&self->file);
+                    zdir_patch_destroy (&self->patch);
+                }
+                self->offset += size;
+                self->credit -= size;
+            } else
+                engine_set_exception (self, no_credit_event);
+            return;
+        }
+        //  Otherwise, as we do unless server/mmap is set, take chunk from
+        //  the mount's cache, so that one read from disk feeds every
+        //  subscriber; the map just shares the open file
+        tch_svchunk_t *cached = self->mount?
+            mount_chunk (self->mount, self, self->file, self->offset): NULL;
+        if (self->waiting) {
+            //  Chunk is on its way from disk, we'll get a dispatch event
+            engine_set_exception (self, no_credit_event);
+            return;
+        }
+        if (cached) {
+            //  Cached chunk is the block holding our offset, send a slice
+            size_t skip = (size_t) (self->offset - cached->offset);
+            size_t size = zchunk_size (cached->chunk) - skip;
+            size_t limit = client_chunk_limit (self);
+            if (size > limit)
+                size = limit;
+            if (size) {
+                fmq_msg_set_sequence (self->message, self->sequence++);
+                fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+                fmq_msg_set_offset (self->message, self->offset);
+                fmq_msg_set_eof (self->message, 0);
+                fmq_msg_set_chunk_data (self->message,
+                    zchunk_data (cached->chunk) + skip, size, chunk_release, cached);
+                self->offset += size;
+                self->credit -= size;
+            } else {
+                chunk_release (NULL, cached);
+                engine_set_exception (self, no_credit_event);
+            }
+            return;
+        }
+        //  Check if we have the credit to send a chunk
+        size_t limit = client_chunk_limit (self);
+        if (limit) {
+            //  Get next chunk for file
+            //zsys_debug ("~~~ read chunk from file ~~~");
+            zchunk_t *chunk = zfile_read (self->file, limit, self->offset);
+            assert (chunk);
+
+            //zsys_debug ("~~~ have credit, prepare to send ~~~");
+            fmq_msg_set_sequence (self->message, self->sequence++);
+            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+            fmq_msg_set_offset (self->message, self->offset);
+            fmq_msg_set_eof (self->message, 0);
+
+            self->offset += zchunk_size (chunk);
+            self->credit -= zchunk_size (chunk);
+
+            //  Zero-sized chunk means end of file
+            if (zchunk_size (chunk) == 0) {
+                //zsys_debug ("~~~ chunk is empty ~~~");
+                fmq_msg_set_eof (self->message, 1);
+                client_file_sent (self);
+                zfile_destroy (&self->file);
+                zdir_patch_destroy (&self->patch);
+            }
+            fmq_msg_set_chunk (self->message, &chunk);
+        } else {
+            //zsys_debug ("~~~ no credit ~~~");
+            engine_set_exception (self, no_credit_event);
+        }
+    }
+}
+
+/* Send current file and the small files queued after it in one chunk,
+ * each whole, if it's small itself. Returns false if it's not, leaving
+ * it to go out chunk by chunk. Files gone from disk we skip as we would
+ * otherwise; anything that isn't a plain small file ends the batch. */
+static bool
+client_batch_send (tch_svclient_t *self)
+{
+    size_t limit = client_chunk_limit (self);
+    if (!limit)
+        return false;
+    tch_svqueue_t *queue = &self->queues [self->level];
+    zchunk_t *batch = NULL;
+    char *first = NULL;
+    size_t files = 0;
+    while (self->patch) {
+        const char *vpath = zdir_patch_vpath (self->patch);
+        if (zdir_patch_op (self->patch) != patch_create
+        ||  zhash_lookup (self->resume, vpath))
+            break;
+        int handle = open (zfile_filename (zdir_patch_file (self->patch), NULL), O_RDONLY);
+        if (handle == -1)
+            zdir_patch_destroy (&self->patch);
+        else {
+            struct stat stat_buf;
+            if (fstat (handle, &stat_buf) == -1 || !S_ISREG (stat_buf.st_mode)
+            ||  stat_buf.st_size >= SMALL_FILE
+            ||  fmq_msg_batch_size (vpath, (size_t) stat_buf.st_size)
+                > limit - (batch? zchunk_size (batch): 0)) {
+                close (handle);
+                break;
+            }
+            size_t size = (size_t) stat_buf.st_size;
+            byte *data = (byte *) malloc (size? size: 1);
+            assert (data);
+            if (read (handle, data, size) != (ssize_t) size) {
+                //  File changed under us; it goes out the usual way
+                free (data);
+                close (handle);
+                break;
+            }
+            close (handle);
+            if (!batch)
+                batch = zchunk_new (NULL, limit);
+            fmq_msg_batch_add (batch, vpath, data, size);
+            free (data);
+            if (!first)
+                first = strdup (vpath);
+            files++;
+            client_file_sent (self);
+            zdir_patch_destroy (&self->patch);
+        }
+        //  Next small file in the same queue joins the batch
+        zdir_patch_t *next = (zdir_patch_t *) zlistx_first (queue->patches);
+        if (!next || zdir_patch_op (next) != patch_create
+        ||  zfile_cursize (zdir_patch_file (next)) >= SMALL_FILE)
+            break;
+        self->patch = (zdir_patch_t *) zlistx_detach (queue->patches, NULL);
+        zhash_delete (queue->queued, zdir_patch_vpath (self->patch));
+    }
+    if (!files) {
+        zchunk_destroy (&batch);
+        if (self->patch)
+            return false;
+        engine_set_exception (self, next_patch_event);
+        return true;
+    }
+    char *count = zsys_sprintf ("%zu", files);
+    zhash_t *headers = zhash_new ();
+    zhash_autofree (headers);
+    zhash_insert (headers, "files", count);
+    zstr_free (&count);
+    fmq_msg_set_headers (self->message, &headers);
+    fmq_msg_set_filename (self->message, first);
+    zstr_free (&first);
+
+    fmq_msg_set_sequence (self->message, self->sequence++);
+    fmq_msg_set_operation (self->message, FMQ_MSG_FILE_BATCH);
+    fmq_msg_set_offset (self->message, 0);
+    fmq_msg_set_eof (self->message, 1);
+    self->credit -= zchunk_size (batch);
+    fmq_msg_set_chunk (self->message, &batch);
+    return true;
+}
+
+/* Open file for sending, mapped if server/mmap is set, or share it if
+ * another client is already sending the same file. Returns NULL if the
+ * file can't be opened, in which case we read it chunk by chunk. */
+static tch_svmap_t *
+map_open (tch_server_t *server, zfile_t *file)
+{
+    int handle = open (zfile_filename (file, NULL), O_RDONLY);
+    if (handle == -1)
+        return NULL;
+    struct stat stat_buf;
+    if (fstat (handle, &stat_buf) == -1 || !S_ISREG (stat_buf.st_mode)) {
+        close (handle);
+        return NULL;
+    }
+    char *key = zsys_sprintf ("%s:%jd:%jd", zfile_filename (file, NULL),
+                              (intmax_t) stat_buf.st_size,
+                              (intmax_t) stat_buf.st_mtime);
+    tch_svmap_t *self = (tch_svmap_t *) zhash_lookup (server->maps, key);
+    if (!self) {
+        //  A file truncated while we send out of its mapping raises
+        //  SIGBUS in whichever thread touches it, so mapping is opt-in;
+        //  otherwise we keep the file open and read what we need of it
+        bool mapped = atoi (zconfig_resolve (server->config, "server/mmap", "0")) != 0;
+        void *data = NULL;
+        if (mapped && stat_buf.st_size > 0) {
+            data = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, handle, 0);
+            if (data == MAP_FAILED) {
+                close (handle);
+                zstr_free (&key);
+                return NULL;
+            }
+        }
+        self = (tch_svmap_t *) zmalloc (sizeof (tch_svmap_t));
+        self->key = key;
+        self->data = (byte *) data;
+        self->handle = mapped? -1: handle;
+        self->size = stat_buf.st_size;
+        self->refs = 1;             //  Held by maps table
+        zhash_insert (server->maps, key, self);
+    }
+    else
+        zstr_free (&key);
+    if (self->handle != handle)
+        close (handle);
+    self->clients++;
+    return self;
+}
+
+/* Client is done sending file; drop mapping from table when the last
+ * client is done. The mapping itself lives until its last chunk is out */
+static void
+map_close (tch_server_t *server, tch_svmap_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        tch_svmap_t *self = *self_p;
+        if (--self->clients == 0) {
+            zhash_delete (server->maps, self->key);
+            map_release (NULL, self);
+        }
+        *self_p = NULL;
+    }
+}
+
+/* Drop one reference to mapping; called by ZeroMQ once a chunk has gone
+ * out, possibly from its I/O thread */
+static void
+map_release (void *data, void *hint)
+{
+    tch_svmap_t *self = (tch_svmap_t *) hint;
+    if (__sync_sub_and_fetch (&self->refs, 1) == 0) {
+        if (self->data)
+            munmap (self->data, self->size);
+        if (self->handle != -1)
+            close (self->handle);
+        free (self->key);
+        free (self);
+    }
+}
+
+/* Bytes of file at offset, with 'want' of them in a row unless the file
+ * ends sooner; sets 'have' to how many we have. A mapping has them all;
+ * else we read them into the window, a few blocks ahead, and they stay
+ * valid until the next call. For rolling over a file on a worker. */
+static const byte *
+map_window (tch_svmap_t *self, tch_svwindow_t *window, uint64_t offset, size_t want, size_t *have)
+{
+    if (self->data) {
+        *have = offset < self->size? self->size - (size_t) offset: 0;
+        return self->data + offset;
+    }
+    if (offset < window->offset
+    ||  offset + want > window->offset + window->size) {
+        size_t limit = want > WINDOW_SIZE? want: WINDOW_SIZE;
+        if (window->limit < limit) {
+            free (window->data);
+            window->data = (byte *) malloc (limit);
+            assert (window->data);
+            window->limit = limit;
+        }
+        window->offset = offset;
+        window->size = 0;
+        while (window->size < limit) {
+            ssize_t rc = pread (self->handle, window->data + window->size,
+                                limit - window->size, (off_t) (offset + window->size));
+            if (rc <= 0)
+                break;              //  End of file, or file went bad
+            window->size += (size_t) rc;
+        }
+    }
+    *have = (size_t) (window->offset + window->size - offset);
+    return window->data + (offset - window->offset);
+}
+
+/* Read size bytes of file at offset, or fewer if it ends sooner */
+static zchunk_t *
+map_read (tch_svmap_t *self, uint64_t offset, size_t size)
+{
+    if (self->data) {
+        if (offset + size > self->size)
+            size = offset < self->size? self->size - (size_t) offset: 0;
+        return zchunk_new (self->data + offset, size);
+    }
+    byte *data = (byte *) malloc (size? size: 1);
+    assert (data);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = pread (self->handle, data + done, size - done, (off_t) (offset + done));
+        if (rc <= 0)
+            break;                  //  End of file, or file went bad
+        done += (size_t) rc;
+    }
+    zchunk_t *chunk = zchunk_new (data, done);
+    free (data);
+    return chunk;
+}
+
+/* Size of next chunk we may send to client: its chunk size, cut down to
+ * its remaining credit. Returns 0 if the credit left is too small to be
+ * worth sending. */
+static size_t
+client_chunk_limit (tch_svclient_t *self)
+{
+    size_t limit;
+    if (self->chunk_size <= self->credit)
+        limit = self->chunk_size;
+    else
+    if (self->credit >= self->chunk_min)
+        limit = (size_t) self->credit;
+    else
+        return 0;
+
+    //  Don't send past the end of a range
+    if (self->ranged && self->offset < self->range_end
+    &&  limit > (size_t) (self->range_end - self->offset))
+        limit = (size_t) (self->range_end - self->offset);
+    return limit;
+}
+
+/* Offset to start sending current file at. This is zero unless the
+ * client told us it has the first part of this same file already. */
+static off_t
+client_resume_offset (tch_svclient_t *self)
+{
+    const char *vpath = zdir_patch_vpath (self->patch);
+    const char *resume = (const char *) zhash_lookup (self->resume, vpath);
+    off_t offset = 0;
+    if (resume) {
+        char digest [41];
+        long long value;
+        const char *current = client_patch_digest (self);
+        if (sscanf (resume, "%40s %lld", digest, &value) == 2
+        &&  current && streq (digest, current)
+        &&  value > 0 && value <= (long long) zfile_cursize (self->file))
+            offset = (off_t) value;
+        zhash_delete (self->resume, vpath);
+    }
+    return offset;
+}
+
+/* Work out delta of current file against the client's signatures. That
+ * rolls over the whole file, so with disk workers, one does it, and the
+ * client gets a dispatch event once it's done */
+static void
+client_delta_match (tch_svclient_t *self, tch_svsig_t *sig)
+{
+    tch_svjob_t *job = (tch_svjob_t *) zmalloc (sizeof (tch_svjob_t));
+    job->map = self->map;
+    job->sig = sig;
+    job->match = true;
+    sig->refs++;
+    __sync_add_and_fetch (&job->map->refs, 1);
+    if (server_workers (self->server) == 0) {
+        s_delta_match (sig, job->map, &job->ops, &job->op_count);
+        self->matched = job;
+        return;
+    }
+    job->client = self;
+    self->matching = job;
+    server_job_post (self->server, job);
+}
+
+/* Start sending current file as the delta we worked out */
+static void
+client_delta_start (tch_svclient_t *self)
+{
+    tch_svjob_t *job = self->matched;
+    self->matched = NULL;
+    self->ops = job->ops;
+    self->op_count = job->op_count;
+    self->op_index = 0;
+    self->op_done = 0;
+    self->delta = true;
+    map_release (NULL, job->map);
+    sig_release (job->sig);
+    free (job);
+}
+
+/* Set up to send current file, now we know whether it goes as a delta */
+static void
+client_file_start (tch_svclient_t *self)
+{
+    if (!self->delta)
+        zstr_free (&self->basis);
+    if (!self->delta && !self->ranged)
+        client_stripe_start (self);
+    self->compress = *self->codec && self->map && !self->delta
+                  && !self->ranged && !self->striping
+                  && client_compressible (self);
+}
+
+/* Work out delta of file against the client's copy, whose signatures we
+ * have. Finds the client's blocks in the new file with a rolling
+ * checksum, and sends the rest as literal data. The client rebuilds the
+ * file in place, so we only copy blocks forward: a block moved to a lower
+ * offset may have been overwritten by the time the client gets to it.
+ * Runs on a disk worker, so it touches only its arguments and the file. */
+static void
+s_delta_match (tch_svsig_t *sig, tch_svmap_t *map,
+               tch_svop_t **ops_p, size_t *count_p)
+{
+    size_t size = map->size;
+    tch_svwindow_t window = { NULL };
+    size_t block = sig->block;
+    size_t limit = 16;
+    tch_svop_t *ops = (tch_svop_t *) malloc (limit * sizeof (tch_svop_t));
+    assert (ops);
+    size_t count = 0;
+
+    uint64_t offset = 0;
+    uint64_t literal = 0;           //  Start of pending literal range
+    uint32_t weak = 0;
+    bool rolling = false;
+    while (offset + block <= size) {
+        //  We look at the block at offset, and the byte after it to roll
+        size_t want = offset + block < size? block + 1: block;
+        size_t have;
+        const byte *data = map_window (map, &window, offset, want, &have);
+        if (have < want)
+            break;              //  File got shorter; rest goes as literal
+        if (!rolling) {
+            weak = fmq_msg_weak_sum (data, block);
+            rolling = true;
+        }
+        int64_t index = sig_match (sig, weak, data, offset);
+        if (index < 0) {
+            if (offset + block < size)
+                weak = fmq_msg_weak_roll (weak, block, data [0], data [block]);
+            offset++;
+            continue;
+        }
+        //  Make room for a literal and a copy
+        if (count + 2 > limit) {
+            limit *= 2;
+            ops = (tch_svop_t *) realloc (ops, limit * sizeof (tch_svop_t));
+            assert (ops);
+        }
+        if (offset > literal) {
+            tch_svop_t *op = &ops [count++];
+            op->offset = literal;
+            op->size = offset - literal;
+            op->literal = true;
+        }
+        uint64_t source = (uint64_t) index * block;
+        if (source != offset) {
+            tch_svop_t *last = count? &ops [count - 1]: NULL;
+            if (last && !last->literal
+            &&  last->offset + last->size == offset
+            &&  last->source + last->size == source)
+                last->size += block;
+            else {
+                tch_svop_t *op = &ops [count++];
+                op->offset = offset;
+                op->source = source;
+                op->size = block;
+                op->literal = false;
+            }
+        }
+        offset += block;
+        literal = offset;
+        rolling = false;
+    }
+    if (size > literal) {
+        if (count == limit) {
+            ops = (tch_svop_t *) realloc (ops, (limit + 1) * sizeof (tch_svop_t));
+            assert (ops);
+        }
+        tch_svop_t *op = &ops [count++];
+        op->offset = literal;
+        op->size = size - literal;
+        op->literal = true;
+    }
+    free (window.data);
+    *ops_p = ops;
+    *count_p = count;
+}
+
+/* Send next delta operation for current file, then the end of file with
+ * the final size, so the client can cut off anything left over */
+static void
+client_delta_send (tch_svclient_t *self)
+{
+    zhash_t *headers = fmq_msg_headers (self->message);
+    //  Client starts from a copy of its file we built the delta against
+    if (self->basis && self->op_index == 0 && self->op_done == 0)
+        zhash_update (headers, "source", self->basis);
+    if (self->op_index < self->op_count) {
+        tch_svop_t *op = &self->ops [self->op_index];
+        size_t size = 0;
+        if (op->literal) {
+            size = (size_t) (op->size - self->op_done);
+            size_t limit = client_chunk_limit (self);
+            if (size > limit)
+                size = limit;
+            if (size == 0) {
+                engine_set_exception (self, no_credit_event);
+                return;
+            }
+            size = client_file_slice (self, self,
+                (off_t) (op->offset + self->op_done), size);
+            if (size == 0 && self->waiting) {
+                engine_set_exception (self, no_credit_event);
+                return;
+            }
+            if (size == 0) {
+                //  File changed under us, so we end here; the client
+                //  finds the digest off, and the new version follows
+                self->op_index = self->op_count;
+                client_delta_send (self);
+                return;
+            }
+            fmq_msg_set_offset (self->message, op->offset + self->op_done);
+            self->op_done += size;
+            self->credit -= size;
+        } else {
+            char *copy = zsys_sprintf ("%llu %llu",
+                (unsigned long long) op->source, (unsigned long long) op->size);
+            zhash_insert (headers, "copy", copy);
+            zstr_free (&copy);
+            zchunk_t *chunk = zchunk_new (NULL, 0);
+            fmq_msg_set_chunk (self->message, &chunk);
+            fmq_msg_set_offset (self->message, op->offset);
+            self->op_done = op->size;
+        }
+        if (self->op_done == op->size) {
+            self->op_index++;
+            self->op_done = 0;
+        }
+        fmq_msg_set_eof (self->message, 0);
+    } else {
+        char *size = zsys_sprintf ("%zu", self->map->size);
+        zhash_insert (headers, "size", size);
+        zstr_free (&size);
+        zchunk_t *chunk = zchunk_new (NULL, 0);
+        fmq_msg_set_chunk (self->message, &chunk);
+        fmq_msg_set_offset (self->message, self->map->size);
+        fmq_msg_set_eof (self->message, 1);
+
+        client_file_sent (self);
+        free (self->ops);
+        self->ops = NULL;
+        self->delta = false;
+        zstr_free (&self->basis);
+        map_close (self->server, &self->map);
+        zfile_destroy (&self->file);
+        zdir_patch_destroy (&self->patch);
+    }
+    fmq_msg_set_sequence (self->message, self->sequence++);
+    fmq_msg_set_operation (self->message, FMQ_MSG_FILE_DELTA);
+}
+
+/* Client now has current file; keep its signatures for next time */
+static void
+client_file_sent (tch_svclient_t *self)
+{
+    const char *vpath = zdir_patch_vpath (self->patch);
+    if (self->delta_block && self->map) {
+        tch_svsig_t *sig = sig_require (self->server, self->map, self->delta_block);
+        zhash_update (self->sigs, vpath, sig);
+        zhash_freefn (self->sigs, vpath, sig_release);
+    }
+    else
+        zhash_delete (self->sigs, vpath);
+    if (self->dedupe)
+        client_holds (self, vpath, client_patch_digest (self));
+}
+
+/* Stripe current file over our streams if it's big enough to be worth
+ * it: each stream takes the next chunk whenever it has credit, so a slow
+ * stream doesn't hold up the others. Streams send out of the mapping,
+ * or the mount's chunk cache, so we need the file open to know its size */
+static void
+client_stripe_start (tch_svclient_t *self)
+{
+    size_t minimum = (size_t) atoll (
+        zconfig_resolve (self->server->config, "server/stripe", "16000000"));
+    if (!self->map || zlist_size (self->streams) == 0
+    ||  self->map->size - (size_t) self->offset < minimum)
+        return;
+
+    self->striping = true;
+    self->stripe_start = self->offset;
+    self->stripe_bytes = 0;
+    //  Wake streams on the next loop, since we're using the message now
+    tch_svclient_t *stream = (tch_svclient_t *) zlist_first (self->streams);
+    while (stream) {
+        engine_set_wakeup_event (stream, 0, dispatch_event);
+        stream = (tch_svclient_t *) zlist_next (self->streams);
+    }
+}
+
+/* True if file we're striping has any data left to hand out */
+static bool
+client_stripe_ready (tch_svclient_t *self)
+{
+    return self->striping && self->offset < (off_t) self->map->size;
+}
+
+/* Send next chunk of file that 'self' is striping, on 'sender', which is
+ * either self or one of its streams. Sender must have credit. Returns
+ * false if there's nothing to send: sender is waiting for the chunk to
+ * come in from disk, or the file ended early, which ends the stripe. */
+static bool
+client_stripe_send (tch_svclient_t *self, tch_svclient_t *sender)
+{
+    size_t size = self->map->size - (size_t) self->offset;
+    size_t limit = client_chunk_limit (sender);
+    if (size > limit)
+        size = limit;
+    size = client_file_slice (self, sender, self->offset, size);
+    if (!size) {
+        if (sender->waiting)
+            return false;
+        //  File changed under us; the patch for its new version follows
+        self->offset = (off_t) self->map->size;
+        if (sender != self)
+            engine_set_wakeup_event (self, 0, dispatch_event);
+        return false;
+    }
+    zhash_t *headers = client_patch_headers (self);
+    char *start = zsys_sprintf ("%jd", (intmax_t) self->stripe_start);
+    zhash_insert (headers, "stripe", start);
+    zstr_free (&start);
+    fmq_msg_set_headers (sender->message, &headers);
+
+    fmq_msg_set_filename (sender->message, zdir_patch_vpath (self->patch));
+    fmq_msg_set_sequence (sender->message, sender->sequence++);
+    fmq_msg_set_operation (sender->message, FMQ_MSG_FILE_CREATE);
+    fmq_msg_set_offset (sender->message, self->offset);
+    fmq_msg_set_eof (sender->message, 0);
+
+    self->offset += size;
+    self->stripe_bytes += size;
+    sender->credit -= size;
+
+    //  Primary sends end of file once streams have taken the last chunk
+    if (sender != self && !client_stripe_ready (self))
+        engine_set_wakeup_event (self, 0, dispatch_event);
+    return true;
+}
+
+/* Put up to size bytes of self's current file at offset in sender's
+ * message: straight out of the mapping if we have one, else out of the
+ * mount's chunk cache, so one read from disk feeds every sender. Returns
+ * the bytes we put in, which are fewer if a cached block ends sooner, or
+ * 0 if the file ended early, or sender waits for a block from disk and
+ * gets a dispatch event once it's in. */
+static size_t
+client_file_slice (tch_svclient_t *self, tch_svclient_t *sender, off_t offset, size_t size)
+{
+    if (self->map && self->map->data) {
+        __sync_add_and_fetch (&self->map->refs, 1);
+        fmq_msg_set_chunk_data (sender->message,
+            self->map->data + offset, size, map_release, self->map);
+        return size;
+    }
+    tch_svchunk_t *cached = self->mount?
+        mount_chunk (self->mount, sender, self->file, offset): NULL;
+    if (sender->waiting)
+        return 0;
+    if (cached) {
+        size_t skip = (size_t) (offset - cached->offset);
+        if (size > zchunk_size (cached->chunk) - skip)
+            size = zchunk_size (cached->chunk) - skip;
+        fmq_msg_set_chunk_data (sender->message,
+            zchunk_data (cached->chunk) + skip, size, chunk_release, cached);
+        return size;
+    }
+    //  Cache is off and we have no workers; read it here
+    zchunk_t *chunk = zfile_read (self->file, size, offset);
+    size = chunk? zchunk_size (chunk): 0;
+    if (size)
+        fmq_msg_set_chunk (sender->message, &chunk);
+    zchunk_destroy (&chunk);
+    return size;
+}
+
+/* Set up extra data streams from ICANHAZ options. A client that wants
+ * them sends "streams" and a "session" id; each stream then connects on
+ * its own and sends "stream" with that session id. */
+static void
+client_streams_attach (tch_svclient_t *self, zhash_t *options)
+{
+    const char *session = options? (const char *) zhash_lookup (options, "stream"): NULL;
+    if (session) {
+        tch_svclient_t *primary = (tch_svclient_t *) zhash_lookup (self->server->sessions, session);
+        if (primary && zlist_size (primary->streams) < primary->stream_limit) {
+            zlist_append (primary->streams, self);
+            self->primary = primary;
+        }
+        else
+            zsys_warning ("refusing data stream for session %s", session);
+        return;
+    }
+    session = options? (const char *) zhash_lookup (options, "session"): NULL;
+    const char *value = options? (const char *) zhash_lookup (options, "streams"): NULL;
+    size_t limit = (size_t) atoi (zconfig_resolve (self->server->config, "server/streams", "8"));
+    if (session && value && !self->session && limit) {
+        self->stream_limit = (size_t) atoi (value);
+        if (self->stream_limit > limit)
+            self->stream_limit = limit;
+        if (self->stream_limit && !zhash_lookup (self->server->sessions, session)) {
+            self->session = strdup (session);
+            self->streams = zlist_new ();
+            zhash_insert (self->server->sessions, session, self);
+        }
+    }
+}
+
+/* Forget client's streams, or the client it's a stream of */
+static void
+client_streams_detach (tch_svclient_t *self)
+{
+    if (self->primary)
+        zlist_remove (self->primary->streams, self);
+    while (zlist_size (self->streams)) {
+        tch_svclient_t *stream = (tch_svclient_t *) zlist_pop (self->streams);
+        stream->primary = NULL;
+    }
+    zlist_destroy (&self->streams);
+    if (self->session) {
+        zhash_delete (self->server->sessions, self->session);
+        zstr_free (&self->session);
+    }
+}
+
+/* Queue the one file a range request is for. Value holds the digest
+ * and size of the file the client wants, then the range to send. If we
+ * don't have that file, we send a delete, so the client looks elsewhere */
+static void
+client_range_start (tch_svclient_t *self, const char *vpath, const char *value)
+{
+    tch_mount_t *mount = mount_lookup (self->server, vpath);
+    if (!mount) {
+        zsys_warning ("range request for %s matches no mount", vpath);
+        return;
+    }
+    const char *name = vpath + strlen (mount->alias);
+    while (*name == '/')
+        name++;
+    char *path = zsys_sprintf ("%s/%s", mount->location, name);
+    zfile_t *file = zfile_new (NULL, path);
+
+    char digest [41];
+    unsigned long long size, start, end;
+    const char *known = mount_digest (mount, vpath);
+    bool have = file
+        && sscanf (value, "%40s %llu %llu %llu", digest, &size, &start, &end) == 4
+        && start < end && end <= size
+        && zfile_is_regular (file) && zfile_is_readable (file)
+        && (unsigned long long) zfile_cursize (file) == size
+        && (!known || streq (known, digest));
+
+    zdir_patch_t *patch = file? zdir_patch_new (mount->location, file,
+        have? patch_create: patch_delete, mount->alias): NULL;
+    if (patch) {
+        if (have) {
+            self->ranged = true;
+            self->range_start = (off_t) start;
+            self->range_end = (off_t) end;
+        }
+        client_unqueue (self, zdir_patch_vpath (patch));
+        client_queue (self, client_priority (fmq_msg_options (self->message)), patch);
+    }
+    zfile_destroy (&file);
+    zstr_free (&path);
+}
+
+/* Note what client has at vpath now, so we can point it at that file
+ * when it needs the same content under another name. A NULL digest
+ * means it has nothing there */
+static void
+client_holds (tch_svclient_t *self, const char *vpath, const char *digest)
+{
+    const char *old = (const char *) zhash_lookup (self->holds, vpath);
+    if (old) {
+        const char *other = (const char *) zhash_lookup (self->held, old);
+        if (other && streq (other, vpath))
+            zhash_delete (self->held, old);
+        zhash_delete (self->holds, vpath);
+    }
+    if (digest) {
+        zhash_update (self->holds, vpath, (void *) digest);
+        zhash_update (self->held, digest, (void *) vpath);
+    }
+}
+
+/* If client has current file's content under another name, tell it to
+ * copy that file rather than send this one. The client checks the copy
+ * against the digest, and fetches the file after all if it's not right.
+ * If it has the content under this same name, we skip the file. Returns
+ * true if we sent the copy or skipped the file. */
+static bool
+client_dedupe (tch_svclient_t *self)
+{
+    const char *vpath = zdir_patch_vpath (self->patch);
+    const char *digest = client_patch_digest (self);
+    const char *source = digest? (const char *) zhash_lookup (self->held, digest): NULL;
+    if (!source)
+        return false;
+    if (streq (source, vpath)) {
+        //  Client has this very content here already, so skip the file
+        zfile_destroy (&self->file);
+        zdir_patch_destroy (&self->patch);
+        engine_set_exception (self, next_patch_event);
+        return true;
+    }
+
+    zhash_t *headers = fmq_msg_headers (self->message);
+    zhash_update (headers, "source", (void *) source);
+    zchunk_t *chunk = zchunk_new (NULL, 0);
+    fmq_msg_set_chunk (self->message, &chunk);
+    fmq_msg_set_sequence (self->message, self->sequence++);
+    fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+    fmq_msg_set_offset (self->message, 0);
+    fmq_msg_set_eof (self->message, 1);
+    self->server->deduped += (uint64_t) zfile_cursize (self->file);
+
+    //  Copy has the source's signatures too
+    tch_svsig_t *sig = (tch_svsig_t *) zhash_lookup (self->sigs, source);
+    if (sig) {
+        sig->refs++;
+        zhash_update (self->sigs, vpath, sig);
+        zhash_freefn (self->sigs, vpath, sig_release);
+    }
+    else
+        zhash_delete (self->sigs, vpath);
+    client_holds (self, vpath, digest);
+    zfile_destroy (&self->file);
+    zdir_patch_destroy (&self->patch);
+    return true;
+}
+
+/* Signatures of one of the client's other files to send current file as
+ * a delta against, for a file the client doesn't have. Like rsync's fuzzy
+ * match, we look for a file with the same extension in the same
+ * directory, closest in size; the client starts from a copy of it */
+static tch_svsig_t *
+client_delta_basis (tch_svclient_t *self)
+{
+    const char *vpath = zdir_patch_vpath (self->patch);
+    const char *slash = strrchr (vpath, '/');
+    size_t dir_length = slash? (size_t) (slash - vpath) + 1: 0;
+    const char *extension = strrchr (vpath + dir_length, '.');
+    if (!extension)
+        extension = "";
+
+    tch_svsig_t *best = NULL;
+    const char *basis = NULL;
+    uint64_t best_gap = 0;
+    tch_svsig_t *sig = (tch_svsig_t *) zhash_first (self->sigs);
+    while (sig) {
+        const char *name = zhash_cursor (self->sigs);
+        if (strncmp (name, vpath, dir_length) == 0
+        &&  !strchr (name + dir_length, '/')) {
+            const char *other = strrchr (name + dir_length, '.');
+            uint64_t size = (uint64_t) sig->count * sig->block;
+            uint64_t gap = size > self->map->size? size - self->map->size:
+                                                   self->map->size - size;
+            if (sig->ready && streq (other? other: "", extension)
+            &&  (!best || gap < best_gap)) {
+                best = sig;
+                basis = name;
+                best_gap = gap;
+            }
+        }
+        sig = (tch_svsig_t *) zhash_next (self->sigs);
+    }
+    if (best)
+        self->basis = strdup (basis);
+    return best;
+}
+
+/* Take the first of our codecs that the client offers too */
+static void
+client_codec_pick (tch_svclient_t *self, const char *offered)
+{
+    const char *codec = fmq_msg_codecs ();
+    while (*codec) {
+        size_t length = strcspn (codec, ",");
+        const char *check = offered;
+        while (*check && length < sizeof (self->codec)) {
+            size_t size = strcspn (check, ",");
+            if (size == length && strncmp (check, codec, length) == 0) {
+                memcpy (self->codec, codec, length);
+                self->codec [length] = 0;
+                return;
+            }
+            check += size;
+            if (*check == ',')
+                check++;
+        }
+        codec += length;
+        if (*codec == ',')
+            codec++;
+    }
+}
+
+/* Is current file worth packing? Not if it's tiny, or its name says it's
+ * packed already. We try anything else, and the first chunk that doesn't
+ * pack turns packing off for the rest of the file */
+static bool
+client_compressible (tch_svclient_t *self)
+{
+    static const char *packed [] = {
+        "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+        "deb", "rpm", "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4",
+        "mkv", "avi", "mov", "ogg", "flac", "woff2", NULL
+    };
+    if (self->map->size - (size_t) self->offset < COMPRESS_MIN)
+        return false;
+    const char *vpath = zdir_patch_vpath (self->patch);
+    const char *extension = strrchr (vpath, '.');
+    if (!extension || strchr (extension, '/'))
+        return true;
+    int index;
+    for (index = 0; packed [index]; index++)
+        if (strcasecmp (extension + 1, packed [index]) == 0)
+            return false;
+    return true;
+}
+
+/* Pack size bytes of current file at our offset. Returns the finished
+ * job, holding the packed chunk, or if it didn't pack, none and for a
+ * file we don't map, the chunk as read; the caller frees the job. With disk workers, we hand the chunk to one and return
+ * NULL; the client gets a dispatch event once the chunk is packed */
+static tch_svjob_t *
+client_pack (tch_svclient_t *self, size_t size)
+{
+    tch_svjob_t *job = self->packed;
+    if (job) {
+        self->packed = NULL;
+        return job;
+    }
+    if (self->packing)
+        return NULL;
+
+    job = (tch_svjob_t *) zmalloc (sizeof (tch_svjob_t));
+    job->map = self->map;
+    job->offset = self->offset;
+    job->size = size;
+    strcpy (job->codec, self->codec);
+    if (server_workers (self->server) == 0) {
+        s_pack (job);
+        job->map = NULL;
+        return job;
+    }
+    //  Worker holds the file until it hands the job back
+    __sync_add_and_fetch (&job->map->refs, 1);
+    job->client = self;
+    self->packing = job;
+    server_job_post (self->server, job);
+    return NULL;
+}
+
+/* Tell client how to unpack the chunk we're sending, if it's packed */
+static void
+client_pack_headers (tch_svclient_t *self, zchunk_t *packed, size_t raw)
+{
+    zhash_t *headers = fmq_msg_get_headers (self->message);
+    if (!headers) {
+        headers = zhash_new ();
+        zhash_autofree (headers);
+    }
+    if (packed) {
+        char *size = zsys_sprintf ("%zu", raw);
+        zhash_update (headers, "codec", self->codec);
+        zhash_update (headers, "raw", size);
+        zstr_free (&size);
+    } else {
+        zhash_delete (headers, "codec");
+        zhash_delete (headers, "raw");
+    }
+    fmq_msg_set_headers (self->message, &headers);
+}
+
+/* Priority client asks for in subscription options, 0 if none */
+static size_t
+client_priority (zhash_t *options)
+{
+    const char *value = options? (const char *) zhash_lookup (options, "priority"): NULL;
+    int priority = value? atoi (value): 0;
+    if (priority < 0)
+        priority = 0;
+    if (priority >= PRIORITIES)
+        priority = PRIORITIES - 1;
+    return (size_t) priority;
+}
+
+/* Queue patch for client at this priority; we own the patch now */
+static void
+client_queue (tch_svclient_t *self, size_t level, zdir_patch_t *patch)
+{
+    tch_svqueue_t *queue = &self->queues [level];
+    void *handle = zlistx_add_end (queue->patches, patch);
+    if (handle)
+        zhash_update (queue->queued, zdir_patch_vpath (patch), handle);
+    else {
+        zsys_error ("unable to append new patch +++");
+        zdir_patch_destroy (&patch);
+    }
+}
+
+/* Drop whatever we have queued, or set aside, for vpath; a newer patch
+ * replaces it */
+static void
+client_unqueue (tch_svclient_t *self, const char *vpath)
+{
+    size_t level;
+    for (level = 0; level < PRIORITIES; level++) {
+        tch_svqueue_t *queue = &self->queues [level];
+        void *handle = zhash_lookup (queue->queued, vpath);
+        if (handle) {
+            zdir_patch_t *existing = (zdir_patch_t *) zlistx_detach (queue->patches, handle);
+            zdir_patch_destroy (&existing);
+            zhash_delete (queue->queued, vpath);
+        }
+        if (queue->patch && streq (zdir_patch_vpath (queue->patch), vpath)) {
+            zdir_patch_destroy (&queue->patch);
+            zfile_destroy (&queue->file);
+            map_close (self->server, &queue->map);
+        }
+    }
+}
+
+/* Has client anything left to send? */
+static bool
+client_pending (tch_svclient_t *self)
+{
+    if (self->patch)
+        return true;
+    size_t level;
+    for (level = 0; level < PRIORITIES; level++)
+        if (self->queues [level].patch || zlistx_size (self->queues [level].patches))
+            return true;
+    return false;
+}
+
+/* Pick what to send next. Each priority has its own queue, and queues
+ * take turns, each sending its weight in bytes per round, highest first,
+ * so urgent files get through without starving the rest. When its
+ * queue's turn is up, we set a file aside at the next chunk, and pick it
+ * up again where we left off; small files waiting behind it go first. */
+static void
+client_schedule (tch_svclient_t *self)
+{
+    if (self->patch) {
+        if (self->queues [self->level].deficit > 0 || !client_preemptible (self))
+            return;
+        client_park (self);
+    }
+    size_t level;
+    int round;
+    for (round = 0; round < 2; round++) {
+        for (level = PRIORITIES; level-- > 0;) {
+            tch_svqueue_t *queue = &self->queues [level];
+            if (!queue->patch && !zlistx_size (queue->patches))
+                queue->deficit = 0;
+            else
+            if (queue->deficit > 0)
+                break;
+        }
+        if (level < PRIORITIES)
+            break;
+        //  Every queue with work has had its turn; start the next round
+        for (level = 0; level < PRIORITIES; level++) {
+            tch_svqueue_t *queue = &self->queues [level];
+            if (queue->patch || zlistx_size (queue->patches))
+                queue->deficit += (int64_t) (level + 1) * SHARE_QUANTUM;
+        }
+    }
+    if (level >= PRIORITIES)
+        return;                 //  Nothing to send
+
+    tch_svqueue_t *queue = &self->queues [level];
+    self->level = level;
+    zdir_patch_t *next = (zdir_patch_t *) zlistx_first (queue->patches);
+    bool small = next && (zdir_patch_op (next) == patch_delete
+        || zfile_cursize (zdir_patch_file (next)) < SMALL_FILE);
+    if (queue->patch && !small)
+        client_unpark (self, queue);
+    else {
+        self->patch = (zdir_patch_t *) zlistx_detach (queue->patches, NULL);
+        zhash_delete (queue->queued, zdir_patch_vpath (self->patch));
+    }
+}
+
+/* Can we set current file aside? Only a whole file we send chunk by
+ * chunk, with nothing on the way, and only one per queue */
+static bool
+client_preemptible (tch_svclient_t *self)
+{
+    return self->file && zdir_patch_op (self->patch) == patch_create
+        && !self->delta && !self->striping && !self->ranged
+        && !self->waiting && !self->packing && !self->packed
+        && !self->matching && !self->matched
+        && !self->queues [self->level].patch;
+}
+
+/* Set current file aside in its queue */
+static void
+client_park (tch_svclient_t *self)
+{
+    tch_svqueue_t *queue = &self->queues [self->level];
+    queue->patch = self->patch;
+    queue->file = self->file;
+    queue->map = self->map;
+    queue->mount = self->mount;
+    queue->offset = self->offset;
+    queue->compress = self->compress;
+    self->patch = NULL;
+    self->file = NULL;
+    self->map = NULL;
+    self->mount = NULL;
+    self->compress = false;
+}
+
+/* Carry on with file we set aside in queue */
+static void
+client_unpark (tch_svclient_t *self, tch_svqueue_t *queue)
+{
+    self->patch = queue->patch;
+    self->file = queue->file;
+    self->map = queue->map;
+    self->mount = queue->mount;
+    self->offset = queue->offset;
+    self->compress = queue->compress;
+    queue->patch = NULL;
+    queue->file = NULL;
+    queue->map = NULL;
+    queue->mount = NULL;
+}
+
+/* Charge bytes we sent to the queue we sent them from, and to the share
+ * and bandwidth cap of the client, or of its primary if it's a stream */
+static void
+client_charge (tch_svclient_t *self, uint64_t bytes)
+{
+    tch_svclient_t *owner = self->primary? self->primary: self;
+    if (!self->primary)
+        self->queues [self->level].deficit -= (int64_t) bytes;
+    owner->share -= (int64_t) bytes;
+    if (owner->rate_cap)
+        owner->tokens -= (int64_t) bytes;
+    if (self->server->egress)
+        self->server->egress_tokens -= (int64_t) bytes;
+}
+
+/* Is it client's turn to send? Clients take turns, each sending its
+ * weight in bytes per round, and a client with a bandwidth cap waits
+ * until the cap lets it send again. If it isn't our turn, we set up to
+ * come back when it is. */
+static bool
+client_turn (tch_svclient_t *self)
+{
+    tch_svclient_t *owner = self->primary? self->primary: self;
+    if (owner->rate_cap) {
+        size_t wait = s_bucket_fill (&owner->tokens, &owner->tokens_at, owner->rate_cap);
+        if (wait) {
+            client_share_done (owner);
+            engine_set_wakeup_event (self, wait, dispatch_event);
+            return false;
+        }
+    }
+    //  Server's egress budget holds up everyone alike, so we wait for
+    //  it in line, and go in turn once it has room again
+    tch_server_t *server = self->server;
+    if (server->egress) {
+        size_t wait = s_bucket_fill (&server->egress_tokens, &server->egress_at, server->egress);
+        if (wait) {
+            client_share_done (owner);
+            client_wait (self, wait);
+            return false;
+        }
+    }
+    if (owner->share > 0) {
+        if (!owner->sharing) {
+            owner->sharing = true;
+            server->sharing++;
+        }
+        return true;
+    }
+    client_share_done (owner);
+    client_wait (self, 0);
+    return false;
+}
+
+/* Client isn't sending on its share any more, for now: it used it up,
+ * or can't send. Once no client is, the next round starts */
+static void
+client_share_done (tch_svclient_t *self)
+{
+    tch_server_t *server = self->server;
+    if (!self->sharing)
+        return;
+    self->sharing = false;
+    server->sharing--;
+    if (server->sharing == 0 && zlistx_size (server->turns) && !server->round_due) {
+        server->round_due = true;
+        engine_set_alarm (server, 0, server_next_round);
+    }
+}
+
+/* Client's weight: one quantum per round, plus one for each level of
+ * priority of its most urgent subscription */
+static size_t
+client_weight (tch_svclient_t *self)
+{
+    size_t weight = 1;
+    tch_svsub_t *sub = (tch_svsub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (weight < sub->priority + 1)
+            weight = sub->priority + 1;
+        sub = (tch_svsub_t *) zlist_next (self->subs);
+    }
+    return weight;
+}
+
+/* Wait in line for next round. It starts once no client is still
+ * sending on its share, and a client waiting on the egress budget is
+ * woken after 'delay' msecs in any case */
+static void
+client_wait (tch_svclient_t *self, size_t delay)
+{
+    tch_server_t *server = self->server;
+    if (!self->turn)
+        self->turn = zlistx_add_end (server->turns, self);
+    if (!server->round_due && (delay || server->sharing == 0)) {
+        server->round_due = true;
+        engine_set_alarm (server, delay, server_next_round);
+    }
+}
+
+/* Has client a slot to send files in? With server/active_files set,
+ * only so many clients send files at once, and the rest wait in line.
+ * A client gives its slot up between files, so clients take turns and
+ * the disk sees a few files read through rather than many at once. */
+static bool
+client_admitted (tch_svclient_t *self)
+{
+    tch_server_t *server = self->server;
+    if (self->admitted || self->primary)
+        return true;
+    if (!self->admission
+    &&  (!server->active_limit
+    ||   (server->active < server->active_limit && !zlistx_size (server->admission)))) {
+        self->admitted = true;
+        server->active++;
+        return true;
+    }
+    if (!self->admission)
+        self->admission = zlistx_add_end (server->admission, self);
+    return false;
+}
+
+/* Give up client's slot once it has no file on the go, or set aside,
+ * and let the next client in line have it */
+static void
+client_release (tch_svclient_t *self)
+{
+    if (!self->admitted || self->patch)
+        return;
+    size_t level;
+    for (level = 0; level < PRIORITIES; level++)
+        if (self->queues [level].patch)
+            return;
+    tch_server_t *server = self->server;
+    self->admitted = false;
+    server->active--;
+    //  We're inside this client's actions, so others go in after
+    if (zlistx_size (server->admission) && !server->admit_due) {
+        server->admit_due = true;
+        engine_set_alarm (server, 0, server_admit);
+    }
+}
+
+/* Give free slots to clients waiting for them, first come first served */
+static int
+server_admit (zloop_t *loop, int timer_id, void *arg)
+{
+    tch_server_t *self = (tch_server_t *) arg;
+    self->admit_due = false;
+    while (zlistx_size (self->admission)
+    &&    (!self->active_limit || self->active < self->active_limit)) {
+        tch_svclient_t *client = (tch_svclient_t *) zlistx_detach (self->admission, NULL);
+        client->admission = NULL;
+        client->admitted = true;
+        self->active++;
+        engine_send_event (client, dispatch_event);
+    }
+    return 0;
+}
+
+/* Pick up egress budget and active file limit from config, which may
+ * change while we run. Both are for the whole server; with several
+ * reactors, each serves its share of the clients on its share of the
+ * budget, rounded up so that none is left with nothing */
+static void
+server_budget (tch_server_t *self)
+{
+    self->egress = (uint64_t) atoll (zconfig_resolve (self->config, "server/egress", "0"));
+    self->active_limit = (size_t) atoi (zconfig_resolve (self->config, "server/active_files", "0"));
+    int reactors = atoi (zconfig_resolve (self->config, "server/reactors", "1"));
+    if (reactors > 1) {
+        self->egress = (self->egress + reactors - 1) / reactors;
+        self->active_limit = (self->active_limit + reactors - 1) / reactors;
+    }
+    //  A raised limit lets clients in line in
+    if (zlistx_size (self->admission) && !self->admit_due
+    &&  (!self->active_limit || self->active < self->active_limit)) {
+        self->admit_due = true;
+        engine_set_alarm (self, 0, server_admit);
+    }
+}
+
+//  Add tokens to a bucket filling at 'rate' bytes per second, which holds
+//  a quarter second's worth. Returns msecs until bucket has tokens again,
+//  or 0 if it has some now.
+static size_t
+s_bucket_fill (int64_t *tokens, int64_t *filled_at, uint64_t rate)
+{
+    int64_t now = zclock_usecs ();
+    int64_t most = (int64_t) rate / 4;
+    if (now - *filled_at >= 1000000)
+        *tokens = most;
+    else {
+        int64_t added = (now - *filled_at) * (int64_t) rate / 1000000;
+        if (added <= 0)
+            now = *filled_at;
+        else
+            *tokens += added;
+    }
+    *filled_at = now;
+    if (*tokens > most)
+        *tokens = most;
+    if (*tokens >= 0)
+        return 0;
+    return (size_t) (-*tokens * 1000 / (int64_t) rate + 1);
+}
+
+/* Start next round, once every client has had its turn at this one:
+ * each client that used up its share gets its weight's worth again, and
+ * those that use that up line up again for the round after. Clients
+ * that waited on the egress budget go on with what share they have. If
+ * some client is still sending on its share, it's not our round yet,
+ * and clients that need a share keep waiting. */
+static int
+server_next_round (zloop_t *loop, int timer_id, void *arg)
+{
+    tch_server_t *self = (tch_server_t *) arg;
+    self->round_due = false;
+    bool fresh = self->sharing == 0;
+    if (fresh)
+        self->round++;
+    size_t count = zlistx_size (self->turns);
+    while (count--) {
+        tch_svclient_t *client = (tch_svclient_t *) zlistx_detach (self->turns, NULL);
+        client->turn = NULL;
+        tch_svclient_t *owner = client->primary? client->primary: client;
+        if (owner->share <= 0) {
+            if (!fresh) {
+                client->turn = zlistx_add_end (self->turns, client);
+                continue;
+            }
+            if (owner->round != self->round) {
+                owner->round = self->round;
+                owner->weight = client_weight (owner);
+                owner->share += (int64_t) owner->weight * SHARE_QUANTUM;
+            }
+        }
+        engine_send_event (client, dispatch_event);
+    }
+    return 0;
+}
+
+/* Destroy queue's patches, and any file it set aside */
+static void
+queue_clear (tch_svqueue_t *self, tch_server_t *server)
+{
+    while (zlistx_size (self->patches)) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlistx_detach (self->patches, NULL);
+        zdir_patch_destroy (&patch);
+    }
+    zlistx_destroy (&self->patches);
+    zhash_destroy (&self->queued);
+    zdir_patch_destroy (&self->patch);
+    zfile_destroy (&self->file);
+    map_close (server, &self->map);
+}
+
+/* Create empty signatures for count blocks */
+static tch_svsig_t *
+sig_new (size_t block, size_t count)
+{
+    tch_svsig_t *self = (tch_svsig_t *) zmalloc (sizeof (tch_svsig_t));
+    self->block = block;
+    self->count = count;
+    self->weak = (uint32_t *) malloc ((count + 1) * sizeof (uint32_t));
+    self->strong = (uint64_t *) malloc ((count + 1) * sizeof (uint64_t));
+    assert (self->weak && self->strong);
+    self->refs = 1;
+    return self;
+}
+
+/* Parse signatures the client sent for a file: per block, the weak sum
+ * as 8 hex digits then the strong sum as 16 hex digits */
+static tch_svsig_t *
+sig_parse (const char *value, size_t block)
+{
+    size_t length = strlen (value);
+    if (block == 0 || length % 24 || length / 24 > INT32_MAX)
+        return NULL;
+    tch_svsig_t *self = sig_new (block, length / 24);
+    size_t index;
+    for (index = 0; index < self->count; index++) {
+        uint64_t sums [2] = { 0, 0 };
+        const char *hex = value + index * 24;
+        int digit;
+        for (digit = 0; digit < 24; digit++) {
+            char ch = hex [digit];
+            int nibble = ch >= '0' && ch <= '9'? ch - '0':
+                         ch >= 'a' && ch <= 'f'? ch - 'a' + 10: -1;
+            if (nibble < 0) {
+                self->refs = 0;
+                sig_release (self);
+                return NULL;
+            }
+            sums [digit < 8? 0: 1] = (sums [digit < 8? 0: 1] << 4) | nibble;
+        }
+        self->weak [index] = (uint32_t) sums [0];
+        self->strong [index] = sums [1];
+    }
+    sig_index (self);
+    self->ready = true;
+    return self;
+}
+
+/* Signatures of file we're sending, taking them if no client got this version
+ * yet. With disk workers, one takes them, and until it's done they're
+ * not ready, so the next change to the file goes out whole */
+static tch_svsig_t *
+sig_require (tch_server_t *server, tch_svmap_t *map, size_t block)
+{
+    char *key = zsys_sprintf ("%s:%zu", map->key, block);
+    tch_svsig_t *self = (tch_svsig_t *) zhash_lookup (server->sigs, key);
+    if (self) {
+        zstr_free (&key);
+        self->refs++;
+        return self;
+    }
+    size_t count = map->size / block;
+    if (count > INT32_MAX)
+        count = INT32_MAX;
+    self = sig_new (block, count);
+    self->key = key;
+    self->table = server->sigs;
+    zhash_insert (server->sigs, key, self);
+    if (server_workers (server) == 0) {
+        sig_fill (self, map);
+        self->ready = true;
+        return self;
+    }
+    //  Worker holds the signatures and the file until it's done
+    tch_svjob_t *job = (tch_svjob_t *) zmalloc (sizeof (tch_svjob_t));
+    job->map = map;
+    job->sig = self;
+    self->refs++;
+    __sync_add_and_fetch (&map->refs, 1);
+    server_job_post (server, job);
+    return self;
+}
+
+/* Take signatures of file, a whole block at a time. Runs on a disk
+ * worker, so it touches only the signatures and the file */
+static void
+sig_fill (tch_svsig_t *self, tch_svmap_t *map)
+{
+    tch_svwindow_t window = { NULL };
+    size_t index;
+    for (index = 0; index < self->count; index++) {
+        size_t have;
+        const byte *data = map_window (map, &window,
+            (uint64_t) index * self->block, self->block, &have);
+        if (have < self->block) {
+            self->count = index;    //  File got shorter, sign what's left
+            break;
+        }
+        self->weak [index] = fmq_msg_weak_sum (data, self->block);
+        self->strong [index] = fmq_msg_strong_sum (data, self->block);
+    }
+    free (window.data);
+    sig_index (self);
+}
+
+/* Build hash table of weak sums, for matching at every byte offset */
+static void
+sig_index (tch_svsig_t *self)
+{
+    self->buckets = 1;
+    while (self->buckets < self->count * 2)
+        self->buckets <<= 1;
+    self->bucket = (int32_t *) malloc (self->buckets * sizeof (int32_t));
+    self->chain = (int32_t *) malloc ((self->count + 1) * sizeof (int32_t));
+    assert (self->bucket && self->chain);
+    memset (self->bucket, 0xff, self->buckets * sizeof (int32_t));
+    //  Insert backwards so chains run in file order
+    size_t index = self->count;
+    while (index--) {
+        size_t slot = (self->weak [index] ^ (self->weak [index] >> 16)) & (self->buckets - 1);
+        self->chain [index] = self->bucket [slot];
+        self->bucket [slot] = (int32_t) index;
+    }
+}
+
+/* Find client's block matching the block at data, which is at offset in
+ * our file, or -1. Prefers the block at the same offset, which the client
+ * doesn't need to move at all */
+static int64_t
+sig_match (tch_svsig_t *self, uint32_t weak, const byte *data, uint64_t offset)
+{
+    size_t slot = (weak ^ (weak >> 16)) & (self->buckets - 1);
+    int32_t index = self->bucket [slot];
+    int64_t found = -1;
+    bool have_strong = false;
+    uint64_t strong = 0;
+    while (index >= 0) {
+        uint64_t source = (uint64_t) index * self->block;
+        if (self->weak [index] == weak && source >= offset) {
+            if (!have_strong) {
+                strong = fmq_msg_strong_sum (data, self->block);
+                have_strong = true;
+            }
+            if (self->strong [index] == strong) {
+                if (source == offset)
+                    return index;
+                if (found < 0)
+                    found = index;
+            }
+        }
+        index = self->chain [index];
+    }
+    return found;
+}
+
+/* Drop one client's hold on signatures */
+static void
+sig_release (void *argument)
+{
+    tch_svsig_t *self = (tch_svsig_t *) argument;
+    if (self->refs && --self->refs)
+        return;
+    if (self->table)
+        zhash_delete (self->table, self->key);
+    free (self->key);
+    free (self->weak);
+    free (self->strong);
+    free (self->bucket);
+    free (self->chain);
+    free (self);
+}
+
+/* Find the mount that a virtual path belongs to */
+static tch_mount_t *
+mount_lookup (tch_server_t *server, const char *vpath)
+{
+    tch_svnode_t *node = server->tree;
+    tch_mount_t *found = node->mount;
+    char name [256];
+    while (node->children && (vpath = s_path_next (vpath, name))) {
+        node = (tch_svnode_t *) zhash_lookup (node->children, name);
+        if (!node)
+            break;
+        if (node->mount)
+            found = node->mount;
+    }
+    return found;
+}
+
+/* Return block of file holding offset from the mount's chunk cache,
+ * reading it from disk if needed. This is how we send files we don't
+ * map, which by default is all of them; mapped files are shared through
+ * their mapping instead. Blocks are the mount's block size, at least
+ * server/chunk_max, and aligned, so clients using different chunk sizes
+ * still share them. The caller owns
+ * one reference to the chunk. Returns NULL if the cache is disabled or
+ * we're at end of file. With disk workers, a block that isn't cached is
+ * loaded in the background; we return NULL and set client->waiting, and
+ * the client gets a dispatch event once the block is in. */
+static tch_svchunk_t *
+mount_chunk (tch_mount_t *self, tch_svclient_t *client, zfile_t *file, off_t offset)
+{
+    size_t workers = server_workers (self->server);
+    if (self->chunk_limit == 0 && workers == 0)
+        return NULL;
+    if (offset >= zfile_cursize (file))
+        return NULL;
+
+    off_t skip = offset % (off_t) self->chunk_block;
+    offset -= skip;
+    char *key = zsys_sprintf ("%s:%jd:%jd:%jd", zfile_filename (file, NULL),
+                              (intmax_t) zfile_cursize (file),
+                              (intmax_t) zfile_modified (file),
+                              (intmax_t) offset);
+    tch_svchunk_t *chunk = (tch_svchunk_t *) zhash_lookup (self->chunks, key);
+    if (chunk) {
+        zstr_free (&key);
+        if (!chunk->chunk) {
+            if (client->waiting != chunk)
+                zlist_append (chunk->waiters, client);
+            client->waiting = chunk;
+            return NULL;
+        }
+        if ((size_t) skip >= zchunk_size (chunk->chunk))
+            return NULL;
+        zlistx_move_end (self->chunk_lru, chunk->handle);
+        __sync_add_and_fetch (&chunk->refs, 1);
+        return chunk;
+    }
+    if (workers) {
+        chunk = (tch_svchunk_t *) zmalloc (sizeof (tch_svchunk_t));
+        chunk->key = key;
+        chunk->offset = offset;
+        chunk->refs = 1;            //  Held by cache
+        chunk->waiters = zlist_new ();
+        zlist_append (chunk->waiters, client);
+        client->waiting = chunk;
+        zhash_insert (self->chunks, key, chunk);
+
+        tch_svjob_t *job = (tch_svjob_t *) zmalloc (sizeof (tch_svjob_t));
+        job->mount = self;
+        job->chunk = chunk;
+        job->file = zfile_dup (file);
+        job->size = self->chunk_block;
+        server_job_post (self->server, job);
+        return NULL;
+    }
+    zchunk_t *data = zfile_read (file, self->chunk_block, offset);
+    if (!data || (size_t) skip >= zchunk_size (data)) {
+        zchunk_destroy (&data);
+        zstr_free (&key);
+        return NULL;
+    }
+    chunk = (tch_svchunk_t *) zmalloc (sizeof (tch_svchunk_t));
+    chunk->key = key;
+    chunk->chunk = data;
+    chunk->offset = offset;
+    chunk->refs = 2;                //  Held by cache and by caller
+    chunk->handle = zlistx_add_end (self->chunk_lru, chunk);
+    zhash_insert (self->chunks, key, chunk);
+    self->chunk_bytes += zchunk_size (data);
+
+    //  Evict least recently used chunks until we're back under the limit;
+    //  a chunk larger than the limit passes straight through
+    while (self->chunk_bytes > self->chunk_limit
+    &&     zlistx_size (self->chunk_lru))
+        mount_chunk_evict (self, (tch_svchunk_t *) zlistx_first (self->chunk_lru));
+    return chunk;
+}
+
+/* Chunk came in from disk: cache it and wake up the clients waiting for
+ * it. An empty chunk tells them the file ended early */
+static void
+mount_chunk_loaded (tch_mount_t *self, tch_svjob_t *job)
+{
+    tch_svchunk_t *chunk = job->chunk;
+    chunk->chunk = job->data? job->data: zchunk_new (NULL, 0);
+    job->data = NULL;
+    chunk->handle = zlistx_add_end (self->chunk_lru, chunk);
+    self->chunk_bytes += zchunk_size (chunk->chunk);
+
+    tch_svclient_t *client;
+    while ((client = (tch_svclient_t *) zlist_pop (chunk->waiters))) {
+        client->waiting = NULL;
+        engine_send_event (client, dispatch_event);
+    }
+    //  Only now, when waiters have their references, trim the cache
+    while (self->chunk_bytes > self->chunk_limit
+    &&     zlistx_size (self->chunk_lru))
+        mount_chunk_evict (self, (tch_svchunk_t *) zlistx_first (self->chunk_lru));
+}
+
+/* Drop cached blocks of file at path, since a patch says it changed.
+ * Block keys have the file's mtime in seconds, so a rewrite at the same
+ * size within a second would otherwise hit the old blocks. Blocks still
+ * loading are reading the file as it is now, so they stay. */
+static void
+mount_chunks_drop (tch_mount_t *self, const char *path)
+{
+    size_t length = strlen (path);
+    tch_svchunk_t *chunk = (tch_svchunk_t *) zlistx_first (self->chunk_lru);
+    while (chunk) {
+        tch_svchunk_t *next = (tch_svchunk_t *) zlistx_next (self->chunk_lru);
+        if (strncmp (chunk->key, path, length) == 0 && chunk->key [length] == ':')
+            mount_chunk_evict (self, chunk);
+        chunk = next;
+    }
+}
+
+/* Drop chunk from cache; it lives on until the last copy is sent */
+static void
+mount_chunk_evict (tch_mount_t *self, tch_svchunk_t *chunk)
+{
+    self->chunk_bytes -= zchunk_size (chunk->chunk);
+    zhash_delete (self->chunks, chunk->key);
+    zlistx_delete (self->chunk_lru, chunk->handle);
+    chunk->handle = NULL;
+    chunk_release (NULL, chunk);
+}
+
+/* Drop one reference to cached chunk; called by ZeroMQ once the chunk
+ * has gone out, possibly from its I/O thread */
+static void
+chunk_release (void *data, void *hint)
+{
+    tch_svchunk_t *self = (tch_svchunk_t *) hint;
+    if (__sync_sub_and_fetch (&self->refs, 1) == 0) {
+        zchunk_destroy (&self->chunk);
+        zlist_destroy (&self->waiters);
+        free (self->key);
+        free (self);
+    }
+}
+
+/* Work out which files the patches need digests for. Drops digests of
+ * files that went away, and returns a list of digests to take for files
+ * that are new or changed since we last hashed them. */
+static zlist_t *
+mount_digests_check (tch_mount_t *self, zlist_t *patches)
+{
+    zlist_t *digests = zlist_new ();
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        mount_digest_check (self, zdir_patch_vpath (patch),
+                            zfile_filename (zdir_patch_file (patch), NULL),
+                            zdir_patch_op (patch) == patch_delete, digests);
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    return digests;
+}
+
+/* Check digest of one file, adding it to digests list if we need to
+ * take it again */
+static void
+mount_digest_check (tch_mount_t *self, const char *vpath, const char *path, bool deleted, zlist_t *digests)
+{
+    struct stat stat_buf;
+    if (deleted || stat (path, &stat_buf) == -1) {
+        if (zhash_lookup (self->digests, vpath)) {
+            zhash_delete (self->digests, vpath);
+            self->digests_dirty = true;
+            self->manifest_dirty = true;
+            self->snap_dirty = true;
+        }
+        return;
+    }
+    int64_t mtime = (int64_t) stat_buf.st_mtim.tv_sec * 1000000000
+                  + stat_buf.st_mtim.tv_nsec;
+    tch_svdigest_t *digest = (tch_svdigest_t *) zhash_lookup (self->digests, vpath);
+    if (!digest
+    ||  digest->inode != (uint64_t) stat_buf.st_ino
+    ||  digest->size != (uint64_t) stat_buf.st_size
+    ||  digest->mtime != mtime) {
+        digest = (tch_svdigest_t *) zmalloc (sizeof (tch_svdigest_t));
+        digest->vpath = strdup (vpath);
+        digest->path = strdup (path);
+        digest->inode = (uint64_t) stat_buf.st_ino;
+        digest->size = (uint64_t) stat_buf.st_size;
+        digest->mtime = mtime;
+        zlist_append (digests, digest);
+    }
+}
+
+/* Store digests we took in the mount's table, and destroy the list.
+ * Digests we couldn't or didn't take are dropped, along with whatever
+ * the table held for those files, which no longer matches them. */
+static void
+mount_digests_store (tch_mount_t *self, zlist_t **digests_p)
+{
+    while (zlist_size (*digests_p)) {
+        tch_svdigest_t *digest = (tch_svdigest_t *) zlist_pop (*digests_p);
+        if (digest->digest) {
+            zstr_free (&digest->path);
+            zhash_update (self->digests, digest->vpath, digest);
+            zhash_freefn (self->digests, digest->vpath, digest_destroy);
+        }
+        else {
+            bool stale = zhash_lookup (self->digests, digest->vpath) != NULL;
+            zhash_delete (self->digests, digest->vpath);
+            digest_destroy (digest);
+            if (!stale)
+                continue;
+        }
+        self->digests_dirty = true;
+        self->manifest_dirty = true;
+        self->snap_dirty = true;
+    }
+    zlist_destroy (digests_p);
+}
+
+/* Digest of file at vpath, or NULL if we don't have it */
+static const char *
+mount_digest (tch_mount_t *self, const char *vpath)
+{
+    if (self->replica)
+        return snap_lookup (self->snap, vpath);
+    tch_svdigest_t *digest = (tch_svdigest_t *) zhash_lookup (self->digests, vpath);
+    return digest? digest->digest: NULL;
+}
+
+/* Load digests we saved for the mount. Each line holds inode, size,
+ * mtime and digest of a file, then its virtual path. */
+static void
+mount_digests_load (tch_mount_t *self)
+{
+    FILE *handle = fopen (self->digests_file, "r");
+    if (!handle)
+        return;
+    char line [8192];
+    while (fgets (line, sizeof (line), handle)) {
+        unsigned long long inode, size;
+        long long mtime;
+        char value [41];
+        int end = 0;
+        if (sscanf (line, "%llu %llu %lld %40s %n", &inode, &size, &mtime, value, &end) < 4
+        ||  line [end] != '/')
+            continue;
+        char *vpath = line + end;
+        vpath [strcspn (vpath, "\n")] = 0;
+
+        tch_svdigest_t *digest = (tch_svdigest_t *) zmalloc (sizeof (tch_svdigest_t));
+        digest->vpath = strdup (vpath);
+        digest->inode = (uint64_t) inode;
+        digest->size = (uint64_t) size;
+        digest->mtime = (int64_t) mtime;
+        digest->digest = strdup (value);
+        zhash_update (self->digests, digest->vpath, digest);
+        zhash_freefn (self->digests, digest->vpath, digest_destroy);
+    }
+    fclose (handle);
+}
+
+/* Save the mount's digests, so a restarted server needn't hash its files
+ * again. We write a new file and rename it over the old one. */
+static void
+mount_digests_save (tch_mount_t *self)
+{
+    char *temp = zsys_sprintf ("%s.tmp", self->digests_file);
+    FILE *handle = fopen (temp, "w");
+    if (handle) {
+        tch_svdigest_t *digest = (tch_svdigest_t *) zhash_first (self->digests);
+        while (digest) {
+            fprintf (handle, "%llu %llu %lld %s %s\n",
+                     (unsigned long long) digest->inode,
+                     (unsigned long long) digest->size,
+                     (long long) digest->mtime, digest->digest, digest->vpath);
+            digest = (tch_svdigest_t *) zhash_next (self->digests);
+        }
+        if (fclose (handle) == 0 && rename (temp, self->digests_file) == 0)
+            self->digests_dirty = false;
+        else {
+            zsys_warning ("unable to save digests to %s (%s)",
+                          self->digests_file, strerror (errno));
+            remove (temp);
         }
-        //  Get next chunk for file
-        //zsys_debug ("~~~ read chunk from file ~~~");
-        zchunk_t *chunk = zfile_read (self->file, CHUNK_SIZE, self->offset);
-        assert (chunk);
+    }
+    else
+        zsys_warning ("unable to save digests to %s (%s)", temp, strerror (errno));
+    zstr_free (&temp);
+    self->digests_save_at = zclock_mono () + DIGESTS_SAVE;
+}
 
-        //  Check if we have the credit to send chunk
-        if (zchunk_size (chunk) <= self->credit) {
-            //zsys_debug ("~~~ have credit, prepare to send ~~~");
-            fmq_msg_set_sequence (self->message, self->sequence++);
-            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
-            fmq_msg_set_offset (self->message, self->offset);
-            fmq_msg_set_eof (self->message, 0);
+/* Take SHA-1 digest of file; runs in a disk I/O worker if we have them */
+static void
+digest_take (tch_svdigest_t *self)
+{
+    zfile_t *file = zfile_new (NULL, self->path);
+    const char *digest = file? zfile_digest (file): NULL;
+    if (digest)
+        self->digest = strdup (digest);
+    zfile_destroy (&file);
+}
 
-            self->offset += zchunk_size (chunk);
-            self->credit -= zchunk_size (chunk);
+/* Destructor for digest, also used as freefn in the mount's table */
+static void
+digest_destroy (void *argument)
+{
+    tch_svdigest_t *self = (tch_svdigest_t *) argument;
+    free (self->vpath);
+    free (self->path);
+    free (self->digest);
+    free (self);
+}
 
-            //  Zero-sized chunk means end of file
-            if (zchunk_size (chunk) == 0) {
-                //zsys_debug ("~~~ chunk is empty ~~~");
-                fmq_msg_set_eof (self->message, 1);
-                zfile_destroy (&self->file);
-                zdir_patch_destroy (&self->patch);
-            }
-            fmq_msg_set_chunk (self->message, &chunk);
-        } else {
-            //zsys_debug ("~~~ no credit ~~~");
-            zchunk_destroy (&chunk);
-            engine_set_next_event (self, no_credit_event);
-        }
+/* Headers for chunks of the current patch. They tell the client which
+ * version of the file this is, so that it can ask us to resume the
+ * transfer if it gets cut off, and how big the file is, so that it can
+ * allocate it all at once */
+static zhash_t *
+client_patch_headers (tch_svclient_t *self)
+{
+    zhash_t *headers = zhash_new ();
+    zhash_autofree (headers);
+    const char *digest = client_patch_digest (self);
+    if (digest)
+        zhash_insert (headers, "digest", (void *) digest);
+    if (zdir_patch_op (self->patch) == patch_create) {
+        char *size = zsys_sprintf ("%jd",
+            (intmax_t) zfile_cursize (zdir_patch_file (self->patch)));
+        zhash_insert (headers, "size", size);
+        zstr_free (&size);
     }
+    return headers;
+}
+
+/* Digest of file the current patch creates, if the mount has it */
+static const char *
+client_patch_digest (tch_svclient_t *self)
+{
+    const char *vpath = zdir_patch_vpath (self->patch);
+    tch_mount_t *mount = mount_lookup (self->server, vpath);
+    return mount? mount_digest (mount, vpath): NULL;
 }
 
 /* handle_client_no_credit */
 static void
 handle_client_no_credit (tch_svclient_t *self)
 {
-    //zsys_debug ("!!! client has no credit, moving to ready state !!!");
+    //  Client that can't send doesn't hold up the next round
+    if (!self->primary)
+        client_share_done (self);
+    //  Time until the next NOM is time the client's window cost us
+    if (!self->stall_at) {
+        self->stall_at = zclock_usecs ();
+        self->stalls++;
+        if (engine_verbose (self->server))
+            zsys_debug ("client out of credit, %llu chunks not yet acknowledged",
+                        (unsigned long long) (self->sequence - self->acked));
+    }
 }
 
 /* handle_client_finished */
@@ -1118,11 +4824,240 @@ server_terminate (tch_server_t *self)
 {
     //  Destroy properties here
     zsys_notice ("terminating filemq service");
+    //  Jobs hold chunks of the mounts' caches, mappings and signatures,
+    //  so workers stop before any of those go
+    server_workers_stop (self);
     while (zlist_size (self->mounts)) {
         tch_mount_t *mount = (tch_mount_t *) zlist_pop (self->mounts);
         mount_destroy (&mount);
     }
     zlist_destroy (&self->mounts);
+    node_destroy (&self->tree);
+    zhash_destroy (&self->maps);
+    zhash_destroy (&self->sigs);
+    zhash_destroy (&self->sessions);
+    zlistx_destroy (&self->turns);
+    zlistx_destroy (&self->admission);
+    if (self->deduped)
+        zsys_info ("clients copied %llu bytes they had rather than fetch them",
+                   (unsigned long long) self->deduped);
+    if (self->packed_raw)
+        zsys_info ("packed %llu bytes of chunks into %llu",
+                   (unsigned long long) self->packed_raw,
+                   (unsigned long long) self->packed_wire);
+    if (self->stalls)
+        zsys_info ("clients waited %lld ms for credit over %llu stalls",
+                   (long long) (self->stall_time / 1000), (unsigned long long) self->stalls);
+}
+
+/* Stop disk workers. We drop jobs nobody started, and wait for each busy
+ * worker to hand back the job it has, so no job outlives what it uses */
+static void
+server_workers_stop (tch_server_t *self)
+{
+    tch_svjob_t *job;
+    while (self->backlog && (job = (tch_svjob_t *) zlist_pop (self->backlog)))
+        job_destroy (job);
+    while (zlist_size (self->workers)) {
+        zactor_t *worker = (zactor_t *) zlist_pop (self->workers);
+        engine_handle_socket (self, worker, NULL);
+        if (!zlist_exists (self->idle, worker)
+        &&  zsock_recv (worker, "p", &job) == 0 && job)
+            job_destroy (job);
+        zactor_destroy (&worker);
+    }
+    zlist_destroy (&self->workers);
+    zlist_destroy (&self->idle);
+    zlist_destroy (&self->backlog);
+}
+
+/* Destroy job we won't finish, dropping whatever it holds. There are no
+ * clients left to wait for it */
+static void
+job_destroy (tch_svjob_t *job)
+{
+    if (job->chunk) {
+        //  Chunk never made it into the cache
+        zhash_delete (job->mount->chunks, job->chunk->key);
+        chunk_release (NULL, job->chunk);
+    }
+    if (job->patches) {
+        job->mount->digesting = false;
+        while (zlist_size (job->patches)) {
+            zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (job->patches);
+            zdir_patch_destroy (&patch);
+        }
+        zlist_destroy (&job->patches);
+        while (zlist_size (job->digests))
+            digest_destroy (zlist_pop (job->digests));
+        zlist_destroy (&job->digests);
+    }
+    if (job->sig)
+        sig_release (job->sig);
+    if (job->map)
+        map_release (NULL, job->map);
+    free (job->ops);
+    zchunk_destroy (&job->data);
+    zchunk_destroy (&job->raw);
+    zfile_destroy (&job->file);
+    free (job);
+}
+
+/* Number of disk I/O workers, starting them on first use. With none, we
+ * read and hash files in the reactor. */
+static size_t
+server_workers (tch_server_t *self)
+{
+    if (!self->workers) {
+        self->workers = zlist_new ();
+        self->idle = zlist_new ();
+        self->backlog = zlist_new ();
+        int count = atoi (zconfig_resolve (self->config, "server/workers", "4"));
+        while (count-- > 0) {
+            zactor_t *worker = zactor_new (s_worker, NULL);
+            zlist_append (self->workers, worker);
+            zlist_append (self->idle, worker);
+            engine_handle_socket (self, worker, server_job_done);
+        }
+    }
+    return zlist_size (self->workers);
+}
+
+/* Hand job to an idle worker, or queue it until one is free. Each worker
+ * takes one job at a time, so a slow disk holds up only its own jobs */
+static void
+server_job_post (tch_server_t *self, tch_svjob_t *job)
+{
+    zactor_t *worker = (zactor_t *) zlist_pop (self->idle);
+    if (worker)
+        zsock_send (worker, "sp", "JOB", job);
+    else
+        zlist_append (self->backlog, job);
+}
+
+/* Worker handed back a job: give it the next one, then use the result */
+static int
+server_job_done (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    tch_server_t *self = (tch_server_t *) argument;
+    tch_svjob_t *job;
+    if (zsock_recv (reader, "p", &job) || !job)
+        return 0;
+
+    zactor_t *worker = (zactor_t *) zlist_first (self->workers);
+    while (worker && zactor_sock (worker) != reader)
+        worker = (zactor_t *) zlist_next (self->workers);
+    assert (worker);
+    tch_svjob_t *next = (tch_svjob_t *) zlist_pop (self->backlog);
+    if (next)
+        zsock_send (worker, "sp", "JOB", next);
+    else
+        zlist_append (self->idle, worker);
+
+    if (job->chunk)
+        mount_chunk_loaded (job->mount, job);
+    else
+    if (job->sig) {
+        if (job->match && job->client) {
+            //  Client starts the delta on its dispatch event
+            job->client->matching = NULL;
+            job->client->matched = job;
+            engine_send_event (job->client, dispatch_event);
+            return 0;
+        }
+        if (!job->match)
+            job->sig->ready = true;
+        sig_release (job->sig);
+        map_release (NULL, job->map);
+        free (job->ops);
+    }
+    else
+    if (job->patches) {
+        job->mount->digesting = false;
+        mount_digests_store (job->mount, &job->digests);
+        if (mount_distribute (job->mount, job->patches))
+            engine_broadcast_event (self, NULL, dispatch_event);
+    }
+    else
+    if (job->map) {
+        map_release (NULL, job->map);
+        job->map = NULL;
+        if (job->client) {
+            //  Client takes the packed chunk on its dispatch event
+            job->client->packing = NULL;
+            job->client->packed = job;
+            engine_send_event (job->client, dispatch_event);
+            return 0;
+        }
+    }
+    zchunk_destroy (&job->data);
+    zchunk_destroy (&job->raw);
+    zfile_destroy (&job->file);
+    free (job);
+    return 0;
+}
+
+/* Pack the job's chunk of its file. A file we don't map we read first,
+ * and if the chunk doesn't pack, we keep it as read for the client to
+ * send as is. Runs on a disk worker, or in the reactor if there are none */
+static void
+s_pack (tch_svjob_t *job)
+{
+    if (job->map->data) {
+        job->data = fmq_msg_pack (job->codec, job->map->data + job->offset, job->size);
+        return;
+    }
+    zchunk_t *raw = map_read (job->map, (uint64_t) job->offset, job->size);
+    job->size = zchunk_size (raw);
+    job->data = job->size? fmq_msg_pack (job->codec, zchunk_data (raw), job->size): NULL;
+    if (job->data)
+        zchunk_destroy (&raw);
+    else
+        job->raw = raw;
+}
+
+/* Disk I/O worker: reads chunks, digests patches and packs chunks so the
+ * reactor never waits on the disk, and hands each job back when it's done */
+static void
+s_worker (zsock_t *pipe, void *args)
+{
+    zsock_signal (pipe, 0);
+    while (true) {
+        char *command = NULL;
+        tch_svjob_t *job = NULL;
+        if (zsock_recv (pipe, "sp", &command, &job))
+            break;              //  Interrupted
+        bool terminated = streq (command, "$TERM");
+        zstr_free (&command);
+        if (terminated)
+            break;
+
+        if (job->chunk) {
+            if (zfile_input (job->file) == 0)
+                job->data = zfile_read (job->file, job->size, job->chunk->offset);
+            else
+                zsys_warning ("unable to read %s", zfile_filename (job->file, NULL));
+            zfile_close (job->file);
+        }
+        else
+        if (job->digests) {
+            tch_svdigest_t *digest = (tch_svdigest_t *) zlist_first (job->digests);
+            while (digest) {
+                digest_take (digest);
+                digest = (tch_svdigest_t *) zlist_next (job->digests);
+            }
+        }
+        else
+        if (job->sig && job->match)
+            s_delta_match (job->sig, job->map, &job->ops, &job->op_count);
+        else
+        if (job->sig)
+            sig_fill (job->sig, job->map);
+        else
+        if (job->map)
+            s_pack (job);
+        zsock_send (pipe, "p", job);
+    }
 }
 
 /* Process server API method, return reply message if any */
@@ -1132,10 +5067,15 @@ server_method (tch_server_t *self, const char *method, zmsg_t *msg)
     if (streq (method, "PUBLISH")) {
         char *location = zmsg_popstr (msg);
         char *alias = zmsg_popstr (msg);
-        tch_mount_t *mount = mount_new (location, alias);
+        tch_mount_t *mount = mount_new (self, location, alias);
         zmsg_t *ret_msg = zmsg_new ();
         if (mount) {
             zlist_append (self->mounts, mount);
+            zactor_t *shard = (zactor_t *) zlist_first (self->shards);
+            while (shard) {
+                mount_replicate (mount, shard);
+                shard = (zactor_t *) zlist_next (self->shards);
+            }
             zmsg_addstr (ret_msg, "SUCCESS");
         }
         else
@@ -1144,34 +5084,280 @@ server_method (tch_server_t *self, const char *method, zmsg_t *msg)
         free (alias);
         return ret_msg;
     }
-
+    else
+    if (streq (method, "MOUNT")) {
+        //  Front reactor published a mount; we serve it as a replica
+        char *location = zmsg_popstr (msg);
+        char *alias = zmsg_popstr (msg);
+        tch_svsnap_t *snap = (tch_svsnap_t *) s_msg_popptr (msg);
+        zlist_append (self->mounts, mount_replica (self, location, alias, snap));
+        free (location);
+        free (alias);
+    }
+    else
+    if (streq (method, "PATCHES")) {
+        //  Front reactor saw changes; swap in its digests and hand
+        //  the patches out to our own subscribers
+        char *location = zmsg_popstr (msg);
+        char *alias = zmsg_popstr (msg);
+        zlist_t *patches = (zlist_t *) s_msg_popptr (msg);
+        tch_svsnap_t *snap = (tch_svsnap_t *) s_msg_popptr (msg);
+        tch_mount_t *mount = mount_replica_lookup (self, location, alias);
+        if (mount) {
+            snap_release (&mount->snap);
+            mount->snap = snap;
+            mount->manifest_dirty = true;
+            if (mount_distribute (mount, patches))
+                engine_broadcast_event (self, NULL, dispatch_event);
+        }
+        else {
+            while (zlist_size (patches)) {
+                zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
+                zdir_patch_destroy (&patch);
+            }
+            zlist_destroy (&patches);
+            snap_release (&snap);
+        }
+        free (location);
+        free (alias);
+    }
     return NULL;
 }
 
+/* Pop a pointer sent as a 'p' in a zsock_send picture */
+static void *
+s_msg_popptr (zmsg_t *msg)
+{
+    void *pointer = NULL;
+    zframe_t *frame = zmsg_pop (msg);
+    if (frame && zframe_size (frame) == sizeof (void *))
+        memcpy (&pointer, zframe_data (frame), sizeof (void *));
+    zframe_destroy (&frame);
+    return pointer;
+}
+
 /* Constructor for the mount class
  * Loads directory tree if possible */
 static tch_mount_t *
-mount_new (char *location, char *alias)
+mount_new (tch_server_t *server, char *location, char *alias)
 {
     //  Mount path must start with '/'
     //  We'll do better error handling later
     assert (*alias == '/');
 
     tch_mount_t *self = (tch_mount_t *) zmalloc (sizeof (tch_mount_t));
+    self->server = server;
     self->location = strdup (location);
     self->alias = strdup (alias);
-    self->dir = zdir_new (self->location, NULL);
-    self->subs = zlist_new ();
+    self->scan = mount_scan (self, NULL);
+    self->seeding = true;
+    //  First mount on a path serves it
+    self->node = node_require (server->tree, self->alias);
+    if (!self->node->mount)
+        self->node->mount = self;
+    self->watches = zhash_new ();
+    zhash_autofree (self->watches);
+    self->changes = zhash_new ();
+    zhash_autofree (self->changes);
+    self->notified = zhash_new ();
+    mount_watch_start (self);
+    self->rescan_at = zclock_mono () + self->interval;
+    self->chunks = zhash_new ();
+    self->chunk_lru = zlistx_new ();
+    self->chunk_limit = (size_t) atoll (
+        zconfig_resolve (server->config, "server/cache", "67108864"));
+    self->chunk_block = mount_chunk_block (server);
+    self->digests = zhash_new ();
+    if (atoi (zconfig_resolve (server->config, "server/digests", "0"))) {
+        //  Keep digests beside the mount, where we don't publish them
+        size_t length = strlen (self->location);
+        while (length > 1 && self->location [length - 1] == '/')
+            length--;
+        self->digests_file = zsys_sprintf ("%.*s%s",
+            (int) length, self->location, DIGESTS_SUFFIX);
+        mount_digests_load (self);
+    }
+    return self;
+}
+
+/* Constructor for a shard's replica of a mount. The front reactor scans
+ * and digests the directory; the replica only keeps a chunk cache and
+ * the front's latest digest snapshot, which it takes ownership of */
+static tch_mount_t *
+mount_replica (tch_server_t *server, char *location, char *alias, tch_svsnap_t *snap)
+{
+    tch_mount_t *self = (tch_mount_t *) zmalloc (sizeof (tch_mount_t));
+    self->server = server;
+    self->location = strdup (location);
+    self->alias = strdup (alias);
+    self->node = node_require (server->tree, self->alias);
+    if (!self->node->mount)
+        self->node->mount = self;
+    self->watch = -1;
+    self->replica = true;
+    self->snap = snap;
+    self->chunks = zhash_new ();
+    self->chunk_lru = zlistx_new ();
+    self->chunk_limit = (size_t) atoll (
+        zconfig_resolve (server->config, "server/cache", "67108864"));
+    self->chunk_block = mount_chunk_block (server);
+    return self;
+}
+
+/* Size of blocks in a mount's chunk cache. A chunk we send never spans
+ * two blocks, so blocks are as big as the biggest chunk we send */
+static size_t
+mount_chunk_block (tch_server_t *server)
+{
+    size_t block = (size_t) atoll (
+        zconfig_resolve (server->config, "server/chunk_max", "1000000"));
+    return block > CHUNK_SIZE? block: CHUNK_SIZE;
+}
+
+/* Find replica of the front's mount */
+static tch_mount_t *
+mount_replica_lookup (tch_server_t *server, const char *location, const char *alias)
+{
+    tch_mount_t *mount = (tch_mount_t *) zlist_first (server->mounts);
+    while (mount) {
+        if (streq (mount->location, location) && streq (mount->alias, alias))
+            return mount;
+        mount = (tch_mount_t *) zlist_next (server->mounts);
+    }
+    return NULL;
+}
+
+/* Have a shard serve the mount too */
+static void
+mount_replicate (tch_mount_t *self, zactor_t *shard)
+{
+    zsock_send (shard, "sssp", "MOUNT", self->location, self->alias,
+                snap_new (self, 1));
+}
+
+/* Send each shard its own copy of the patches, along with one snapshot
+ * of our digests as they stand now that all shards share */
+static void
+mount_publish (tch_mount_t *self, zlist_t *patches)
+{
+    zlist_t *shards = self->server->shards;
+    if ((!zlist_size (patches) && !self->snap_dirty) || !zlist_size (shards))
+        return;
+    self->snap_dirty = false;
+    tch_svsnap_t *snap = snap_new (self, (int) zlist_size (shards));
+    zactor_t *shard = (zactor_t *) zlist_first (shards);
+    while (shard) {
+        zlist_t *copies = zlist_new ();
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+        while (patch) {
+            zlist_append (copies, zdir_patch_dup (patch));
+            patch = (zdir_patch_t *) zlist_next (patches);
+        }
+        zsock_send (shard, "ssspp", "PATCHES", self->location, self->alias,
+                    copies, snap);
+        shard = (zactor_t *) zlist_next (shards);
+    }
+}
+
+/* Take snapshot of the mount's files, with the digests we have for
+ * them, held 'refs' times */
+static tch_svsnap_t *
+snap_new (tch_mount_t *mount, int refs)
+{
+    tch_svsnap_t *self = (tch_svsnap_t *) zmalloc (sizeof (tch_svsnap_t));
+    size_t limit = 64;
+    self->entries = (char **) zmalloc (2 * limit * sizeof (char *));
+    size_t length = strlen (mount->alias);
+    const char *slash = length && mount->alias [length - 1] == '/'? "": "/";
+    tch_svrecord_t record;
+    bool valid = scan_first (mount->scan, &record);
+    while (valid) {
+        if (self->count == limit) {
+            limit *= 2;
+            self->entries = (char **) realloc (self->entries, 2 * limit * sizeof (char *));
+            assert (self->entries);
+        }
+        char *vpath = zsys_sprintf ("%s%s%s", mount->alias, slash, record.path);
+        tch_svdigest_t *digest = (tch_svdigest_t *) zhash_lookup (mount->digests, vpath);
+        self->entries [2 * self->count] = vpath;
+        self->entries [2 * self->count + 1] = digest && digest->digest?
+                                              strdup (digest->digest): NULL;
+        self->count++;
+        valid = scan_next (&record);
+    }
+    qsort (self->entries, self->count, 2 * sizeof (char *), s_snap_compare);
+    self->refs = refs;
+    self->partial = !mount_digests_complete (mount);
     return self;
 }
 
+/* Digest of file at vpath in snapshot, or NULL if we don't have it. This
+ * only reads the snapshot, so any number of shards may look at once */
+static const char *
+snap_lookup (tch_svsnap_t *self, const char *vpath)
+{
+    if (!self)
+        return NULL;
+    char **entry = (char **) bsearch (&vpath, self->entries, self->count,
+                                      2 * sizeof (char *), s_snap_compare);
+    return entry? entry [1]: NULL;
+}
+
+/* Drop our reference to a snapshot, freeing it if we held the last */
+static void
+snap_release (tch_svsnap_t **self_p)
+{
+    tch_svsnap_t *self = *self_p;
+    *self_p = NULL;
+    if (self && __sync_sub_and_fetch (&self->refs, 1) == 0) {
+        size_t index;
+        for (index = 0; index < 2 * self->count; index++)
+            free (self->entries [index]);
+        free (self->entries);
+        free (self);
+    }
+}
+
+//  Compare snapshot entries, or a path with an entry, by path
+static int
+s_snap_compare (const void *item1, const void *item2)
+{
+    return strcmp (*(char * const *) item1, *(char * const *) item2);
+}
+
 //  Allocate properties and structures for a new client connection and
 //  optionally engine_set_next_event (). Return 0 if OK, or -1 on error.
 static int
 client_initialize (tch_svclient_t *self)
 {
     //  Construct properties here
-    self->patches = zlist_new ();
+    self->subs = zlist_new ();
+    size_t level;
+    for (level = 0; level < PRIORITIES; level++) {
+        self->queues [level].patches = zlistx_new ();
+        self->queues [level].queued = zhash_new ();
+    }
+    self->weight = 1;
+    self->share = SHARE_QUANTUM;
+    self->resume = zhash_new ();
+    zhash_autofree (self->resume);
+    self->sigs = zhash_new ();
+    self->holds = zhash_new ();
+    zhash_autofree (self->holds);
+    self->held = zhash_new ();
+    zhash_autofree (self->held);
+    self->chunk_min = atoi (zconfig_resolve (self->server->config, "server/chunk_min", "65536"));
+    self->chunk_max = atoi (zconfig_resolve (self->server->config, "server/chunk_max", "1000000"));
+    self->chunk_time = atoi (zconfig_resolve (self->server->config, "server/chunk_time", "100"));
+    if (self->chunk_min < 1)
+        self->chunk_min = 1;
+    if (self->chunk_max < self->chunk_min)
+        self->chunk_max = self->chunk_min;
+    self->chunk_size = CHUNK_SIZE;
+    if (self->chunk_size < self->chunk_min)
+        self->chunk_size = self->chunk_min;
+    if (self->chunk_size > self->chunk_max)
+        self->chunk_size = self->chunk_max;
     return 0;
 }
 
@@ -1180,18 +5366,54 @@ static void
 client_terminate (tch_svclient_t *self)
 {
     //  Destroy properties here
-    tch_mount_t *mount = (tch_mount_t *) zlist_first (self->server->mounts);
-    while (mount) {
-        mount_sub_purge (mount, self);
-        mount = (tch_mount_t *) zlist_next (self->server->mounts);
+    if (self->stall_at)
+        self->stall_time += zclock_usecs () - self->stall_at;
+    if (self->stalls) {
+        self->server->stalls += self->stalls;
+        self->server->stall_time += self->stall_time;
+        if (engine_verbose (self->server))
+            zsys_debug ("client waited %lld ms for credit over %llu stalls",
+                        (long long) (self->stall_time / 1000), (unsigned long long) self->stalls);
     }
-    while (zlist_size (self->patches)) {
-        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (self->patches);
-        zdir_patch_destroy (&patch);
+    while (zlist_size (self->subs)) {
+        tch_svsub_t *sub = (tch_svsub_t *) zlist_pop (self->subs);
+        sub_destroy (&sub);
+    }
+    zlist_destroy (&self->subs);
+    size_t level;
+    for (level = 0; level < PRIORITIES; level++)
+        queue_clear (&self->queues [level], self->server);
+    if (self->turn)
+        zlistx_delete (self->server->turns, self->turn);
+    client_share_done (self);
+    if (self->admission)
+        zlistx_delete (self->server->admission, self->admission);
+    zhash_destroy (&self->resume);
+    zhash_destroy (&self->sigs);
+    zhash_destroy (&self->holds);
+    zhash_destroy (&self->held);
+    zstr_free (&self->basis);
+    free (self->ops);
+    if (self->waiting)
+        zlist_remove (self->waiting->waiters, self);
+    if (self->packing)
+        self->packing->client = NULL;
+    if (self->packed) {
+        zchunk_destroy (&self->packed->data);
+        zchunk_destroy (&self->packed->raw);
+        free (self->packed);
     }
-    zlist_destroy (&self->patches);
+    if (self->matching)
+        self->matching->client = NULL;
+    if (self->matched) {
+        client_delta_start (self);
+        free (self->ops);
+    }
+    client_streams_detach (self);
     zdir_patch_destroy (&self->patch);
     zfile_destroy (&self->file);
+    map_close (self->server, &self->map);
+    client_release (self);
 }
 
 //  zloop callback when client wakeup timer expires
@@ -1213,23 +5435,6 @@ s_client_handle_ticket (zloop_t *loop, int timer_id, void *argument)
     return 0;
 }
 
-//  Purge subscriptions for a specified client
-static void
-mount_sub_purge (tch_mount_t *self, tch_svclient_t *client)
-{
-    tch_svsub_t *sub = (tch_svsub_t *) zlist_first (self->subs);
-    while (sub) {
-        if (sub->client == client) {
-            tch_svsub_t *next = (tch_svsub_t *) zlist_next (self->subs);
-            zlist_remove (self->subs, sub);
-            sub_destroy (&sub);
-            sub = next;
-        }
-        else
-            sub = (tch_svsub_t *) zlist_next (self->subs);
-    }
-}
-
 //  Destructor for the mount class
 static void
 mount_destroy (tch_mount_t **self_p)
@@ -1237,15 +5442,32 @@ mount_destroy (tch_mount_t **self_p)
     assert (self_p);
     if (*self_p) {
         tch_mount_t *self = *self_p;
+        if (self->digests_dirty && self->digests_file)
+            mount_digests_save (self);
+        zhash_destroy (&self->digests);
+        snap_release (&self->snap);
+        fmq_manifest_destroy (&self->manifest);
+        free (self->digests_file);
         free (self->location);
         free (self->alias);
-        //  Destroy subscriptions
-        while (zlist_size (self->subs)) {
-            tch_svsub_t *sub = (tch_svsub_t *) zlist_pop (self->subs);
-            sub_destroy (&sub);
+        if (self->node->mount == self)
+            self->node->mount = NULL;
+        scan_destroy (&self->scan);
+        mount_watch_stop (self);
+        zhash_destroy (&self->watches);
+        zhash_destroy (&self->changes);
+        zhash_destroy (&self->notified);
+        //  Chunks still in flight outlive the cache
+        tch_svchunk_t *chunk;
+        while ((chunk = (tch_svchunk_t *) zlistx_first (self->chunk_lru)))
+            mount_chunk_evict (self, chunk);
+        //  What's left was loading; its jobs are gone with the workers
+        while ((chunk = (tch_svchunk_t *) zhash_first (self->chunks))) {
+            zhash_delete (self->chunks, chunk->key);
+            chunk_release (NULL, chunk);
         }
-        zlist_destroy (&self->subs);
-        zdir_destroy (&self->dir);
+        zlistx_destroy (&self->chunk_lru);
+        zhash_destroy (&self->chunks);
         free (self);
         *self_p = NULL;
     }
@@ -1286,12 +5508,17 @@ s_server_new (zsock_t *pipe)
     //  against queue overflow, they should use a credit-based flow
     //  control scheme.
     zsock_set_unbounded (self->router);
+#ifdef ZMQ_ROUTER_HANDOVER
+    //  Clients name their connections; let a reconnect take over its name
+    zsock_set_router_handover (self->router, 1);
+#endif
     self->message = fmq_msg_new ();
-    self->clients = zhash_new ();
+    self->clients = s_clients_new (64);
     self->config = zconfig_new ("root", NULL);
     self->loop = zloop_new ();
     srandom ((unsigned int) zclock_time ());
     self->client_id = randof (1000);
+    self->started = zclock_usecs ();
     s_server_config_global (self);
 
     //  Initialize application server context
@@ -1310,8 +5537,28 @@ s_server_destroy (tch_s_server_t **self_p)
     if (*self_p) {
         tch_s_server_t *self = *self_p;
         fmq_msg_destroy (&self->message);
+        //  Stop shards before the links they talk to us over
+        while (zlist_size (self->server.shards)) {
+            zactor_t *shard = (zactor_t *) zlist_pop (self->server.shards);
+            zactor_destroy (&shard);
+        }
+        zlist_destroy (&self->server.shards);
+        while (self->link_count) {
+            zsock_t *link = self->links [--self->link_count];
+            engine_handle_socket (&self->server, link, NULL);
+            zsock_destroy (&link);
+        }
+        free (self->links);
+        //  Message rate is what the client lookup costs shows up in
+        if (self->verbose && self->messages) {
+            int64_t elapsed = zclock_usecs () - self->started;
+            zsys_debug ("handled %llu messages, %llu per second",
+                        (unsigned long long) self->messages,
+                        (unsigned long long) (elapsed > 0?
+                            self->messages * 1000000 / (uint64_t) elapsed: 0));
+        }
         //  Destroy clients before destroying the server
-        zhash_destroy (&self->clients);
+        s_clients_destroy (&self->clients);
         server_terminate (&self->server);
         zsock_destroy (&self->router);
         zconfig_destroy (&self->config);
@@ -1364,6 +5611,7 @@ s_server_config_service (tch_s_server_t *self)
         section = zconfig_next (section);
     }
     s_server_config_global (self);
+    s_server_shards_start (self);
 }
 
 //  Process message from pipe
@@ -1378,8 +5626,14 @@ s_server_handle_pipe (zloop_t *loop, zsock_t *reader, void *argument)
     if (self->verbose)
         zsys_debug ("%s:     API command=%s", self->log_prefix, method);
 
-    if (streq (method, "VERBOSE"))
+    if (streq (method, "VERBOSE")) {
         self->verbose = true;
+        zactor_t *shard = (zactor_t *) zlist_first (self->server.shards);
+        while (shard) {
+            zstr_send (shard, "VERBOSE");
+            shard = (zactor_t *) zlist_next (self->server.shards);
+        }
+    }
     else
     if (streq (method, "$TERM")) {
         //  Shutdown the engine
@@ -1394,6 +5648,8 @@ s_server_handle_pipe (zloop_t *loop, zsock_t *reader, void *argument)
         self->port = zsock_bind (self->router, "%s", endpoint);
         if (self->port == -1)
             zsys_warning ("could not bind to %s", endpoint);
+        else
+            s_server_shards_start (self);
         free (endpoint);
     }
     else
@@ -1427,6 +5683,11 @@ s_server_handle_pipe (zloop_t *loop, zsock_t *reader, void *argument)
             self->verbose = (atoi (value) == 1);
         }
         s_server_config_global (self);
+        zactor_t *shard = (zactor_t *) zlist_first (self->server.shards);
+        while (shard) {
+            zsock_send (shard, "sss", "SET", path, value);
+            shard = (zactor_t *) zlist_next (self->server.shards);
+        }
         free (path);
         free (value);
     }
@@ -1453,21 +5714,38 @@ static int
 s_server_handle_protocol (zloop_t *loop, zsock_t *reader, void *argument)
 {
     tch_s_server_t *self = (tch_s_server_t *) argument;
+    //  When sharded, we only pass each message on, untouched, to the
+    //  shard its routing id hashes to
+    while (self->links && zsock_events (self->router) & ZMQ_POLLIN) {
+        zmq_msg_t routing_id;
+        zmq_msg_init (&routing_id);
+        if (zmq_msg_recv (&routing_id, zsock_resolve (self->router), 0) == -1) {
+            zmq_msg_close (&routing_id);
+            return -1;      //  Interrupted; exit zloop
+        }
+        size_t size = zmq_msg_size (&routing_id);
+        uint32_t hash = s_fnv_hash ((byte *) zmq_msg_data (&routing_id),
+                                    size < SHARD_KEY? size: SHARD_KEY);
+        zsock_t *link = self->links [hash % self->link_count];
+        zmq_msg_send (&routing_id, zsock_resolve (link), ZMQ_SNDMORE);
+        zmq_msg_close (&routing_id);
+        if (s_frames_forward (self->router, link))
+            return -1;
+    }
     //  We process as many messages as we can, to reduce the overhead
     //  of polling and the reactor:
     while (zsock_events (self->router) & ZMQ_POLLIN) {
         if (fmq_msg_recv (self->message, self->router))
             return -1;      //  Interrupted; exit zloop
+        self->messages++;
 
-        //  TODO: use binary hashing on routing_id
-        char *hashkey = zframe_strhex (fmq_msg_routing_id (self->message));
-        tch_sv_client_t *client = (tch_sv_client_t *) zhash_lookup (self->clients, hashkey);
+        zframe_t *routing_id = fmq_msg_routing_id (self->message);
+        tch_sv_client_t *client = s_clients_lookup (self->clients, routing_id,
+                                                    s_routing_id_hash (routing_id));
         if (client == NULL) {
-            client = s_client_new (self, fmq_msg_routing_id (self->message));
-            zhash_insert (self->clients, hashkey, client);
-            zhash_freefn (self->clients, hashkey, s_client_free);
+            client = s_client_new (self, routing_id);
+            s_clients_insert (self->clients, client);
         }
-        free (hashkey);
         //  Any input from client counts as activity
         if (client->ticket)
             zloop_ticket_reset (self->loop, client->ticket);
@@ -1478,6 +5756,103 @@ s_server_handle_protocol (zloop_t *loop, zsock_t *reader, void *argument)
     return 0;
 }
 
+//  Pass replies from a shard back out to its clients
+static int
+s_server_handle_link (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    tch_s_server_t *self = (tch_s_server_t *) argument;
+    while (zsock_events (reader) & ZMQ_POLLIN) {
+        if (s_frames_forward (reader, self->router))
+            return -1;      //  Interrupted; exit zloop
+    }
+    return 0;
+}
+
+//  Move rest of a message from one socket to another, frame by frame,
+//  without copying the frames. Returns 0 if OK, -1 if interrupted.
+static int
+s_frames_forward (zsock_t *from, zsock_t *to)
+{
+    bool more = true;
+    while (more) {
+        zmq_msg_t frame;
+        zmq_msg_init (&frame);
+        if (zmq_msg_recv (&frame, zsock_resolve (from), 0) == -1) {
+            zmq_msg_close (&frame);
+            return -1;
+        }
+        more = zmq_msg_more (&frame) != 0;
+        zmq_msg_send (&frame, zsock_resolve (to), more? ZMQ_SNDMORE: 0);
+        zmq_msg_close (&frame);
+    }
+    return 0;
+}
+
+//  Start shard reactors, if config asks for more than one reactor. We
+//  keep the socket clients talk to, and shards serve the clients, each
+//  running its own clients, workers and replicas of our mounts.
+static void
+s_server_shards_start (tch_s_server_t *self)
+{
+    size_t count = (size_t) atoi (zconfig_resolve (self->config, "server/reactors", "1"));
+    if (count < 2 || self->links)
+        return;
+
+    self->links = (zsock_t **) zmalloc (count * sizeof (zsock_t *));
+    self->server.shards = zlist_new ();
+    size_t index;
+    for (index = 0; index < count; index++) {
+        char *endpoint = zsys_sprintf ("inproc://fmq-shard-%p-%zu", (void *) self, index);
+        zsock_t *link = zsock_new (ZMQ_PAIR);
+        assert (link);
+        zsock_set_unbounded (link);
+        int rc = zsock_bind (link, "%s", endpoint);
+        assert (rc == 0);
+        tch_svshard_t args = { endpoint, self->config, self->verbose, self->log_prefix };
+        zactor_t *shard = zactor_new (s_shard, &args);
+        assert (shard);
+        zstr_free (&endpoint);
+        self->links [self->link_count++] = link;
+        engine_handle_socket (&self->server, link, s_server_handle_link);
+        zlist_append (self->server.shards, shard);
+
+        tch_mount_t *mount = (tch_mount_t *) zlist_first (self->server.mounts);
+        while (mount) {
+            mount_replicate (mount, shard);
+            mount = (tch_mount_t *) zlist_next (self->server.mounts);
+        }
+    }
+    zsys_notice ("serving clients from %zu reactors", count);
+}
+
+//  Shard reactor: a server of its own, except that it talks to clients
+//  over a link to the front reactor, and serves replicas of its mounts
+static void
+s_shard (zsock_t *pipe, void *args)
+{
+    tch_svshard_t *shard = (tch_svshard_t *) args;
+    tch_s_server_t *self = s_server_new (pipe);
+    assert (self);
+    zsock_destroy (&self->router);
+    self->router = zsock_new (ZMQ_PAIR);
+    assert (self->router);
+    zsock_set_unbounded (self->router);
+    int rc = zsock_connect (self->router, "%s", shard->endpoint);
+    assert (rc == 0);
+    zconfig_destroy (&self->config);
+    self->config = zconfig_dup (shard->config);
+    self->server.config = self->config;
+    s_server_config_global (self);
+    self->verbose = shard->verbose;
+    self->log_prefix = shard->log_prefix;
+    zsock_signal (pipe, 0);
+
+    engine_handle_socket ((tch_server_t *) self, self->pipe, s_server_handle_pipe);
+    engine_handle_socket ((tch_server_t *) self, self->router, s_server_handle_protocol);
+    zloop_start (self->loop);
+    s_server_destroy (&self);
+}
+
 //  Watch server config file and reload if changed
 static int
 s_watch_server_config (zloop_t *loop, int timer_id, void *argument)
@@ -1502,6 +5877,7 @@ s_satisfy_pedantic_compilers (void)
     engine_send_event (NULL, NULL_event);
     engine_broadcast_event (NULL, NULL, NULL_event);
     engine_handle_socket (NULL, 0, NULL);
+    engine_handle_fd (NULL, 0, NULL, NULL);
     engine_set_monitor (NULL, 0, NULL);
     engine_set_log_prefix (NULL, NULL);
     engine_configure (NULL, NULL, NULL);
@@ -1515,25 +5891,32 @@ sub_new(tch_svclient_t *client, const char *path, zhash_t *cache)
     tch_svsub_t *self = (tch_svsub_t *) zmalloc (sizeof (tch_svsub_t));
     self->client = client;
     self->path = strdup (path);
-    self->cache = zhash_dup (cache);
-
-    //  Cached filenames may be local, in which case prefix them with
-    //  the subscription path so we can do a consistent match.
+    self->cache = zhash_new ();
+    zhash_autofree (self->cache);
+    sub_cache_add (self, cache);
+    return self;
+}
 
-    tch_svsub_t *cache_item = (tch_svsub_t *) zhash_first (self->cache);
-    while (cache_item) {
-        char *key = (char *) zhash_cursor (self->cache);
-        if (*key != '/') {
-            size_t new_key_len = strlen (self->path) + strlen (key) + 2;
-            char *new_key = (char *) calloc (new_key_len, sizeof (char));
-            snprintf (new_key, new_key_len, "%s/%s", self->path, key);
-            zsys_debug ("sub_new: new_key=%s", new_key);
-            zhash_rename (self->cache, key, new_key);
-            free (new_key);
+/* Add client's cache of what it holds to the subscription's. Cached
+ * filenames may be local, in which case prefix them with the
+ * subscription path so we can do a consistent match. */
+static void
+sub_cache_add (tch_svsub_t *self, zhash_t *cache)
+{
+    size_t length = strlen (self->path);
+    bool slashed = length && self->path [length - 1] == '/';
+    const char *digest = cache? (const char *) zhash_first (cache): NULL;
+    while (digest) {
+        const char *key = zhash_cursor (cache);
+        if (*key == '/')
+            zhash_update (self->cache, key, (void *) digest);
+        else {
+            char *vpath = zsys_sprintf ("%s%s%s", self->path, slashed? "": "/", key);
+            zhash_update (self->cache, vpath, (void *) digest);
+            zstr_free (&vpath);
         }
-        cache_item = (tch_svsub_t *) zhash_next (self->cache);
+        digest = (const char *) zhash_next (cache);
     }
-    return self;
 }
 
 //  This is the server actor, which polls its two sockets and processes